@@ -0,0 +1,190 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <coroutine>
+#include <exception>
+#include <variant>
+#include <unordered_map>
+#include <jw/midi/message.h>
+#if __has_include(<sys/epoll.h>)
+# include <jw/midi/epoll_reactor.h>
+#endif
+
+namespace jw::midi
+{
+    // Lazily started coroutine returning a value of type T.  Awaiting it
+    // starts the coroutine, and resumes the awaiter when it completes.
+    template<typename T = void>
+    struct task
+    {
+        struct promise_type;
+        using handle_type = std::coroutine_handle<promise_type>;
+
+        struct promise_base
+        {
+            std::suspend_always initial_suspend() noexcept { return { }; }
+
+            auto final_suspend() noexcept
+            {
+                struct awaiter
+                {
+                    bool await_ready() const noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(handle_type h) noexcept
+                    {
+                        if (auto c = h.promise().continuation) return c;
+                        return std::noop_coroutine();
+                    }
+                    void await_resume() const noexcept { }
+                };
+                return awaiter { };
+            }
+
+            void unhandled_exception() noexcept { exception = std::current_exception(); }
+
+            std::coroutine_handle<> continuation { };
+            std::exception_ptr exception { };
+        };
+
+        struct promise_type : promise_base
+        {
+            task get_return_object() noexcept { return task { handle_type::from_promise(*this) }; }
+            template<typename U> void return_value(U&& v) { value.emplace(std::forward<U>(v)); }
+
+            T result()
+            {
+                if (this->exception) std::rethrow_exception(this->exception);
+                return std::move(*value);
+            }
+
+            std::optional<T> value { };
+        };
+
+        task(task&& o) noexcept : h { std::exchange(o.h, nullptr) } { }
+        task& operator=(task&& o) noexcept { std::swap(h, o.h); return *this; }
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+        ~task() { if (h) h.destroy(); }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+        {
+            h.promise().continuation = c;
+            return h;
+        }
+        T await_resume() { return h.promise().result(); }
+
+    private:
+        explicit task(handle_type p) noexcept : h { p } { }
+        handle_type h;
+    };
+
+    template<>
+    struct task<void>::promise_type : task<void>::promise_base
+    {
+        task get_return_object() noexcept { return task { handle_type::from_promise(*this) }; }
+        void return_void() noexcept { }
+        void result() { if (exception) std::rethrow_exception(exception); }
+    };
+
+    // Start a task without awaiting it.  The coroutine frame is destroyed
+    // when it completes.  Exceptions escaping from the task terminate the
+    // program.
+    struct detached_task
+    {
+        struct promise_type
+        {
+            detached_task get_return_object() noexcept { return { }; }
+            std::suspend_never initial_suspend() noexcept { return { }; }
+            std::suspend_never final_suspend() noexcept { return { }; }
+            void return_void() noexcept { }
+            void unhandled_exception() noexcept { std::terminate(); }
+        };
+    };
+
+    inline detached_task spawn(task<void> t) { co_await std::move(t); }
+
+    struct async_stream;
+
+    // Interface used by async streams to suspend until they are ready.  An
+    // implementation must resume the given coroutine once the stream may
+    // make progress, from whichever thread drives the executor.
+    //
+    // Before suspending, is_input_ready() / is_output_ready() are checked,
+    // so that a stream which is ready already does not need to wait.  The
+    // default implementations always return false.
+    struct async_executor
+    {
+        virtual ~async_executor() = default;
+        virtual void await_input(async_stream& s, std::coroutine_handle<> h) = 0;
+        virtual void await_output(async_stream& s, std::coroutine_handle<> h) = 0;
+        virtual bool is_input_ready(async_stream&) { return false; }
+        virtual bool is_output_ready(async_stream&) { return false; }
+    };
+
+    // A MIDI stream for use from coroutines.  The native handle is passed to
+    // the executor, for epoll_executor this is the file descriptor.
+    struct async_stream
+    {
+        async_stream(std::iostream& s, async_executor& e, int native_handle = -1) noexcept
+            : stream { s }, executor { e }, native_handle { native_handle } { }
+
+        auto input_ready() noexcept { return awaiter<&async_executor::is_input_ready, &async_executor::await_input> { *this }; }
+        auto output_ready() noexcept { return awaiter<&async_executor::is_output_ready, &async_executor::await_output> { *this }; }
+
+        std::iostream& stream;
+        async_executor& executor;
+        const int native_handle;
+
+    private:
+        template<auto Ready, auto Await>
+        struct awaiter
+        {
+            async_stream& s;
+            bool await_ready() const { return (s.executor.*Ready)(s); }
+            void await_suspend(std::coroutine_handle<> h) { (s.executor.*Await)(s, h); }
+            void await_resume() const noexcept { }
+        };
+    };
+
+    // Receive one message, suspending the calling coroutine while no data is
+    // available.  Invalid or interrupted messages are skipped.  Returns an
+    // empty message on end-of-file or stream errors.
+    task<message> async_extract(async_stream& s);
+
+    // Transmit one message and flush the stream.  Suspends first only if
+    // the executor reports that the stream is not ready for output.
+    task<void> async_emit(async_stream& s, untimed_message msg);
+
+#   if __has_include(<sys/epoll.h>)
+    // Executor that waits for readiness of file descriptors via an
+    // epoll_reactor.  Coroutines are resumed from the thread running the
+    // reactor.  Each descriptor may have one waiting reader and one waiting
+    // writer at any time.  Readiness is first checked with a non-blocking
+    // poll(), and only if that fails is the descriptor registered with
+    // epoll.  Streams must have a valid file descriptor as native handle,
+    // otherwise std::invalid_argument is thrown.
+    struct epoll_executor final : async_executor
+    {
+        explicit epoll_executor(epoll_reactor& r) noexcept : reactor { r } { }
+
+        virtual void await_input(async_stream& s, std::coroutine_handle<> h) override;
+        virtual void await_output(async_stream& s, std::coroutine_handle<> h) override;
+        virtual bool is_input_ready(async_stream& s) override;
+        virtual bool is_output_ready(async_stream& s) override;
+
+    private:
+        struct waiters
+        {
+            std::coroutine_handle<> input { };
+            std::coroutine_handle<> output { };
+        };
+
+        void update(int fd);
+        void dispatch(int fd, std::uint32_t events);
+
+        epoll_reactor& reactor;
+        std::unordered_map<int, waiters> fds;
+    };
+#   endif
+}
@@ -0,0 +1,150 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <array>
+#include <span>
+#include <memory>
+#include <istream>
+#include <ostream>
+#include <filesystem>
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // Binary cache format for parsed MIDI files.  A cache file consists of a
+    // header, followed by flat arrays of tracks, tempo changes and events,
+    // and finally a payload section containing the raw bytes of each event.
+    // All integers are little-endian, and all arrays are 8-byte aligned, so
+    // that a cache can be used directly from a memory-mapped file.  Loading
+    // requires no per-event decoding and no allocation.
+    inline constexpr std::array<char, 4> cache_magic { 'J', 'W', 'M', 'C' };
+    inline constexpr std::uint32_t cache_version = 1;
+
+    struct cache_header
+    {
+        std::array<char, 4> magic;
+        std::uint32_t version;
+        std::uint64_t source_size;
+        std::uint64_t source_hash;          // FNV-1a, see source_hash()
+        std::uint16_t asynchronous_tracks;
+        std::uint16_t division;             // As stored in the MThd chunk
+        std::uint32_t num_tracks;
+        std::uint32_t num_tempos;
+        std::uint32_t reserved;
+        std::uint64_t num_events;
+        std::uint64_t payload_size;
+    };
+
+    struct cache_track
+    {
+        std::uint64_t first_event;
+        std::uint64_t num_events;
+    };
+
+    struct cache_tempo
+    {
+        std::uint64_t tick;
+        std::uint32_t quarter_note_us;
+        std::uint32_t track;
+    };
+
+    struct cache_event
+    {
+        enum kind_t : std::uint8_t
+        {
+            channel,    // Status byte and data bytes
+            system,     // System common, excluding sysex
+            sysex,      // Sysex data, including any framing bytes
+            realtime,   // Single status byte
+            meta        // Meta type, followed by data
+        };
+
+        std::uint64_t tick;
+        std::uint64_t offset;           // Relative to start of payload
+        std::uint32_t size;
+        kind_t kind;
+        std::uint8_t meta_channel;      // 0xff if not present
+        std::uint16_t reserved;
+    };
+
+    static_assert(sizeof(cache_header) == 56);
+    static_assert(sizeof(cache_track) == 16);
+    static_assert(sizeof(cache_tempo) == 16);
+    static_assert(sizeof(cache_event) == 24);
+
+    // Non-owning view of a cache in memory.  The constructor only verifies
+    // the header and track index, so this is O(tracks).  Payload bounds are
+    // checked when accessing each event.  On big-endian hosts, all caches
+    // are considered invalid.
+    struct cache_view
+    {
+        cache_view() noexcept = default;
+        explicit cache_view(std::span<const byte> data) noexcept;
+
+        bool valid() const noexcept { return hdr != nullptr; }
+        explicit operator bool() const noexcept { return valid(); }
+
+        const cache_header& header() const noexcept { return *hdr; }
+        std::span<const cache_track> tracks() const noexcept { return trk; }
+        std::span<const cache_tempo> tempo_map() const noexcept { return tempo; }
+        std::span<const cache_event> events() const noexcept { return evt; }
+        std::span<const cache_event> events(std::size_t track) const { return evt.subspan(trk[track].first_event, trk[track].num_events); }
+
+        bool asynchronous_tracks() const noexcept { return hdr->asynchronous_tracks != 0; }
+        std::variant<unsigned, file::smpte_format> time_division() const noexcept;
+
+        // Raw bytes of the given event, as described in cache_event::kind_t.
+        std::span<const byte> bytes(const cache_event& e) const;
+
+        // Decode a single event.  Sysex and meta messages allocate.
+        untimed_message message(const cache_event& e) const;
+
+        // Decode the entire cache into a regular file.
+        file to_file() const;
+
+        // Check if this cache was built from a source with the given size and
+        // (optionally) hash.
+        bool matches(std::uint64_t size) const noexcept { return valid() and hdr->source_size == size; }
+        bool matches(std::uint64_t size, std::uint64_t hash) const noexcept { return matches(size) and hdr->source_hash == hash; }
+
+        // Check the size, and optionally the hash, of the given source file.
+        bool matches(const std::filesystem::path& source, bool check_hash = false) const;
+
+    private:
+        const cache_header* hdr { nullptr };
+        std::span<const cache_track> trk { };
+        std::span<const cache_tempo> tempo { };
+        std::span<const cache_event> evt { };
+        std::span<const byte> payload { };
+    };
+
+    // Cache file loaded into memory.  Where supported, the file is mapped
+    // read-only, otherwise it is read into a buffer.  Throws if the file
+    // can not be opened.  Use valid() to check that it contains a cache.
+    struct mapped_cache : cache_view
+    {
+        explicit mapped_cache(const std::filesystem::path& cache);
+        ~mapped_cache();
+
+        mapped_cache(mapped_cache&& other) noexcept;
+        mapped_cache& operator=(mapped_cache&& other) noexcept;
+        mapped_cache(const mapped_cache&) = delete;
+        mapped_cache& operator=(const mapped_cache&) = delete;
+
+    private:
+        void* map { nullptr };
+        std::size_t map_size { 0 };
+        std::unique_ptr<std::uint64_t[]> buffer;
+    };
+
+    // Hash the remaining contents of a stream, for use with write_cache().
+    std::uint64_t source_hash(std::istream& in);
+
+    // Serialize a parsed MIDI file.  The source size and hash are stored in
+    // the header, so that the cache can be validated later.
+    void write_cache(std::ostream& out, const file& f, std::uint64_t source_size = 0, std::uint64_t source_hash = 0);
+
+    // Parse a MIDI file and write its cache.
+    void build_cache(const std::filesystem::path& source, const std::filesystem::path& cache);
+}
@@ -0,0 +1,126 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <optional>
+#include <condition_variable>
+#include <jw/midi/message.h>
+#include <jw/midi/file.h>
+#include <jw/midi/statistics.h>
+
+namespace jw::midi
+{
+    // Timing accuracy of a clock_generator.  Lateness is measured from the
+    // scheduled time of each clock tick or quarter frame, to the moment it
+    // was handed to the streambuf.
+    struct clock_statistics
+    {
+        std::uint64_t events;               // Clock ticks and quarter frames sent.
+        std::chrono::nanoseconds max_lateness;
+        std::chrono::nanoseconds mean_lateness;
+        latency_histogram lateness;
+    };
+
+    // Generates MIDI clock (24 per quarter note) and, optionally, MTC
+    // quarter frames on an output stream, from a background thread.  Clock
+    // ticks are sent with emit(), so they go through put_realtime() when the
+    // stream has a realtime_streambuf.  For accurate timing, the stream
+    // should not otherwise buffer its output.
+    //
+    // Events are scheduled against absolute deadlines, so that timing
+    // errors do not accumulate.  The thread sleeps until shortly before
+    // each deadline, and spins for the remainder.  If the thread is
+    // delayed past one or more deadlines, the missed events are not
+    // dropped, but sent back-to-back as a burst, after which the schedule
+    // continues as before.  A tempo change takes effect from the last tick
+    // sent, so the tick interval changes without a phase jump.
+    //
+    // Song position is counted in MIDI clocks while running.  MTC time
+    // advances only while running, and is set from the song position on
+    // locate(), using the current tempo.
+    //
+    // All member functions are thread-safe.
+    struct clock_generator
+    {
+        using clock = std::chrono::steady_clock;
+
+        explicit clock_generator(std::ostream& out, double bpm = 120.0,
+                                 std::chrono::nanoseconds spin_time = std::chrono::microseconds { 200 });
+        ~clock_generator();
+
+        clock_generator(const clock_generator&) = delete;
+        clock_generator& operator=(const clock_generator&) = delete;
+
+        void tempo(double bpm);
+        double tempo() const;
+
+        // Enable MTC quarter frames at the given rate.  Only
+        // frames_per_second is used, which must be 24, 25, 29 (29.97
+        // drop-frame) or 30.  Sends an MTC full frame message.
+        void enable_mtc(file::smpte_format rate);
+        void disable_mtc();
+
+        // Transport control.  start() rewinds to position zero and sends
+        // Start, stop() sends Stop, and resume() sends Continue.
+        void start();
+        void stop();
+        void resume();
+        bool running() const;
+
+        // Move to the given position in MIDI beats (sixteenth notes), and
+        // send a Song Position Pointer.  If running, the transport is
+        // stopped first.
+        void locate(unsigned beats);
+
+        // Current position, in MIDI clocks.
+        std::uint64_t position() const;
+
+        clock_statistics statistics() const;
+        void reset_statistics();
+
+    private:
+        using interval_t = std::chrono::duration<double, std::nano>;
+
+        void run();
+        void wait_until(std::unique_lock<std::mutex>& lock, clock::time_point deadline);
+        void send_tick(clock::time_point deadline);
+        void send_quarter_frame(clock::time_point deadline);
+        void send_full_frame();
+        void record(clock::time_point deadline);
+        void restart_schedule(clock::time_point now);
+        std::uint64_t mtc_frame() const noexcept;
+
+        clock::time_point next_tick() const noexcept { return tick_anchor + std::chrono::duration_cast<clock::duration>(tick_interval * ticks); }
+        clock::time_point next_quarter_frame() const noexcept { return qf_anchor + std::chrono::duration_cast<clock::duration>(qf_interval * quarter_frames); }
+
+        std::ostream& out;
+        const std::chrono::nanoseconds spin_time;
+        mutable std::mutex mutex;
+        std::condition_variable cv;
+
+        interval_t tick_interval;
+        clock::time_point tick_anchor;
+        std::uint64_t ticks { 0 };              // Since tick_anchor.
+        std::uint64_t song_clocks { 0 };
+
+        std::optional<file::smpte_format> mtc_rate;
+        interval_t qf_interval;
+        clock::time_point qf_anchor;
+        std::uint64_t quarter_frames { 0 };     // Since qf_anchor.
+        std::uint64_t mtc_origin { 0 };         // Frame number at qf_anchor.
+
+        bool is_running { false };
+        bool quit { false };
+        std::uint64_t generation { 0 };         // Incremented on every state change.
+
+        std::uint64_t num_events { 0 };
+        std::chrono::nanoseconds total_lateness { 0 };
+        std::chrono::nanoseconds max_lateness { 0 };
+        latency_histogram lateness { };
+
+        std::thread thread;
+    };
+}
@@ -0,0 +1,71 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <mutex>
+#include <vector>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <jw/io/realtime_streambuf.h>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    // Output streambuf that gathers outgoing bytes, and writes them to
+    // another streambuf in larger blocks.  The buffer is written out when
+    // it reaches the size threshold, on an explicit flush (eg. std::flush),
+    // or when the oldest byte in it has waited for max_latency, whichever
+    // comes first.  Deadlines are serviced by a single background thread,
+    // which is shared between all instances.  After each write, the target
+    // is synced.
+    //
+    // Realtime bytes bypass the buffer.  If the target is a
+    // realtime_streambuf, they are passed to its put_realtime() directly,
+    // without waiting for a buffered write in progress.  Otherwise they are
+    // written and synced immediately, but since the target can then not be
+    // accessed concurrently, they may wait for a buffered write to finish.
+    //
+    // If writing to the target fails on the background thread, the
+    // exception is rethrown by the next operation on this streambuf.
+    struct coalescing_streambuf final : io::realtime_streambuf
+    {
+        using clock = std::chrono::steady_clock;
+
+        explicit coalescing_streambuf(std::streambuf* target, std::size_t threshold = 256,
+                                      std::chrono::nanoseconds max_latency = std::chrono::microseconds { 250 });
+        virtual ~coalescing_streambuf();
+
+        coalescing_streambuf(const coalescing_streambuf&) = delete;
+        coalescing_streambuf& operator=(const coalescing_streambuf&) = delete;
+
+        virtual void put_realtime(char_type c) override;
+
+        // Number of blocks written to the target so far.
+        std::uint64_t writes() const noexcept { return num_writes.load(std::memory_order_relaxed); }
+
+    protected:
+        virtual int_type overflow(int_type c) override;
+        virtual std::streamsize xsputn(const char_type* s, std::streamsize n) override;
+        virtual int sync() override;
+
+    private:
+        friend struct coalescing_flusher;
+
+        void write_buffer();
+        void timed_flush();
+        void check_error();
+
+        std::streambuf* const target;
+        io::realtime_streambuf* const rt_target;
+        const std::size_t threshold;
+        const std::chrono::nanoseconds max_latency;
+        std::mutex mutex;           // Shared with the flusher thread, so never a dummy_mutex.
+        std::vector<char_type> buffer;
+        clock::time_point deadline;
+        std::exception_ptr error;
+        std::atomic<bool> failed { false };     // Set when 'error' is set.
+        std::atomic<std::uint64_t> num_writes { 0 };
+        bool scheduled { false };   // Guarded by the flusher.
+    };
+}
@@ -0,0 +1,117 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <vector>
+#include <iterator>
+#include <optional>
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // A track stored in encoded form, for keeping large numbers of files in
+    // memory.  Events are stored much like in an SMF track chunk: a delta
+    // time followed by the message bytes, with running status for channel
+    // messages.  Messages are decoded while iterating.
+    //
+    // Every 'block_size' events, the tick and byte offset are stored in a
+    // sparse index, and running status is reset.  Seeking to any event or
+    // tick decodes at most one block, plus any events skipped in it.
+    //
+    // Empty ticks within the track are not stored, only the end-of-track
+    // tick is kept.
+    struct compact_track
+    {
+        static constexpr std::size_t block_size = 64;
+
+        struct event
+        {
+            std::uint64_t tick;
+            untimed_message message;
+        };
+
+        struct iterator
+        {
+            using iterator_category = std::input_iterator_tag;
+            using value_type = event;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const event*;
+            using reference = const event&;
+
+            iterator() noexcept = default;
+
+            reference operator*() const noexcept { return current; }
+            pointer operator->() const noexcept { return &current; }
+            iterator& operator++() { ++i; next(); return *this; }
+            iterator operator++(int) { auto copy = *this; ++*this; return copy; }
+
+            bool operator==(const iterator& other) const noexcept { return i == other.i; }
+
+            // Index of the current event in the track.
+            std::size_t index() const noexcept { return i; }
+
+        private:
+            friend struct compact_track;
+
+            iterator(const compact_track* t, std::size_t index) noexcept : trk { t }, i { index } { }
+            void next();
+
+            const compact_track* trk { nullptr };
+            std::size_t i { 0 };
+            std::size_t pos { 0 };
+            byte running_status { 0 };
+            event current { };
+        };
+
+        compact_track() noexcept = default;
+        explicit compact_track(const file::track& trk);
+
+        iterator begin() const { return seek(0); }
+        iterator end() const noexcept { return { this, num_events }; }
+
+        // Iterator to the event with the given index.
+        iterator seek(std::size_t index) const;
+
+        // Iterator to the first event at or after the given tick.
+        iterator lower_bound(std::uint64_t tick) const;
+
+        std::size_t size() const noexcept { return num_events; }
+        bool empty() const noexcept { return num_events == 0; }
+
+        // Tick of the last event, or the end-of-track marker.
+        std::optional<std::uint64_t> end_tick() const noexcept { return last_tick; }
+
+        // Approximate number of bytes in use, including this object.
+        std::size_t memory_usage() const noexcept;
+
+        file::track decode() const;
+
+    private:
+        struct block
+        {
+            std::uint64_t tick;
+            std::uint64_t offset;
+        };
+
+        std::vector<byte> data;
+        std::vector<block> index;
+        std::size_t num_events { 0 };
+        std::optional<std::uint64_t> last_tick;
+    };
+
+    // A file with all tracks in compact form.
+    struct compact_file
+    {
+        compact_file() noexcept = default;
+        explicit compact_file(const file& f);
+
+        std::size_t memory_usage() const noexcept;
+
+        file decode() const;
+
+        bool asynchronous_tracks;
+        std::variant<unsigned, file::smpte_format> time_division;
+        std::vector<compact_track> tracks;
+    };
+}
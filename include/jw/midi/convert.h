@@ -0,0 +1,30 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // Merge all tracks into a single track, as in a format 0 file.  Messages
+    // on the same tick are ordered by track, and keep their order within
+    // each track.  The merged track ends at the end of the longest track.
+    // Throws std::invalid_argument if the file has asynchronous tracks
+    // (format 2), since these do not share a common time line.
+    //
+    // The rvalue overloads move messages out of the source file.  Sysex
+    // layouts are not carried over.
+    file merge_tracks(const file& f);
+    file merge_tracks(file&& f);
+
+    // Split a file into one track per channel.  The first track is the
+    // conductor track, which receives all messages that have no channel,
+    // and all tempo, time signature, key signature and SMPTE offset events,
+    // even if these have a channel prefix.  It is followed by one track for
+    // each channel that is used, in ascending order, which holds the
+    // channel messages and the meta events with that channel prefix.  A file
+    // with more than one track is merged first.  Every track ends where the
+    // source track ends.
+    file split_channels(const file& f);
+    file split_channels(file&& f);
+}
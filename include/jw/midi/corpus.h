@@ -0,0 +1,79 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <chrono>
+#include <vector>
+#include <exception>
+#include <functional>
+#include <filesystem>
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // Result of loading a single file from a corpus.  If loading failed,
+    // 'error' holds the exception, and 'data' is empty.
+    struct corpus_entry
+    {
+        std::filesystem::path path;
+        std::uint64_t size;             // Size of the source file in bytes.
+        file data;
+        std::exception_ptr error;
+
+        bool ok() const noexcept { return not error; }
+        explicit operator bool() const noexcept { return ok(); }
+    };
+
+    struct corpus_statistics
+    {
+        std::uint64_t files;            // Files loaded successfully.
+        std::uint64_t failed;           // Files that could not be loaded.
+        std::uint64_t bytes;            // Total size of all successfully loaded files.
+        std::uint64_t events;           // Total number of messages in all loaded files.
+        std::chrono::nanoseconds elapsed;
+
+        double files_per_second() const noexcept { return per_second(files + failed); }
+        double mb_per_second() const noexcept { return per_second(bytes) / 1e6; }
+        double events_per_second() const noexcept { return per_second(events); }
+
+    private:
+        double per_second(std::uint64_t n) const noexcept
+        {
+            return elapsed.count() > 0 ? n / std::chrono::duration<double> { elapsed }.count() : 0;
+        }
+    };
+
+    struct corpus_options
+    {
+        // Number of worker threads.  Zero uses all available cores.
+        unsigned threads = 0;
+
+        // Maximum combined size of source files that are being read, parsed,
+        // or are waiting for the callback to return.  A single file larger
+        // than this is still loaded, but only when nothing else is in flight.
+        std::uint64_t max_bytes_in_flight = 256 << 20;
+
+        // When scanning a directory: descend into subdirectories, and only
+        // load files with one of these extensions (case-sensitive).  An empty
+        // list loads all regular files.
+        bool recursive = true;
+        std::vector<std::filesystem::path> extensions { ".mid", ".midi", ".smf" };
+    };
+
+    // Called once for each file, as soon as it is loaded.  This is invoked
+    // from the worker threads, and may be called concurrently.  The entry
+    // may be moved from.  If the callback throws, loading stops and the
+    // exception is rethrown from load_corpus().
+    using corpus_callback = std::function<void(corpus_entry&)>;
+
+    // Load a list of MIDI files in parallel, on a work-stealing thread pool.
+    // Each file is read with a single read call and parsed from memory.
+    // Failures are reported per file, via corpus_entry::error.  Blocks until
+    // all files are processed.
+    corpus_statistics load_corpus(std::span<const std::filesystem::path> files, const corpus_callback& callback, const corpus_options& options = { });
+
+    // Load all MIDI files in the given directory.  The directory is scanned
+    // while files are being loaded.
+    corpus_statistics load_corpus(const std::filesystem::path& directory, const corpus_callback& callback, const corpus_options& options = { });
+}
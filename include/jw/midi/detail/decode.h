@@ -0,0 +1,107 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Status byte classification and message construction, shared by the
+// stream codec templates and the library sources.  Not part of the public
+// interface.
+
+#pragma once
+#include <array>
+#include <memory>
+#include <jw/midi/message.h>
+
+namespace jw::midi::detail
+{
+    constexpr bool is_status(byte b) { return (b & 0x80) != 0; }
+    constexpr bool is_realtime(byte b) { return b >= 0xf8; }
+    constexpr bool is_system(byte b) { return b >= 0xf0; }
+
+    [[noreturn]] inline untimed_message invalid_msg(byte, const byte*)
+    {
+        throw io::failure { "invalid status byte" };
+    }
+
+    struct status_info
+    {
+        using factory = untimed_message(*)(byte status, const byte* data);
+
+        std::size_t size;       // Number of data bytes, or -2 for sysex.
+        std::size_t category;   // Index into untimed_message::category.
+        bool valid;
+        factory make;           // Constructs a message from its data bytes.
+    };
+
+    constexpr status_info make_status_info(byte status)
+    {
+        constexpr auto channel = untimed_message::index_of<channel_message>();
+        constexpr auto system = untimed_message::index_of<system_message>();
+        constexpr auto realtime = untimed_message::index_of<realtime_message>();
+        switch (status & 0xf0)
+        {
+        case 0x80:
+        case 0x90: return { 2, channel, true, [](byte s, const byte* i) -> untimed_message
+            {
+                byte vel = i[1];
+                bool on = (s & 0x10) != 0;
+                if (on and vel == 0)
+                {
+                    on = false;
+                    vel = 0x40;
+                }
+                return { s & 0x0fu, note_event { i[0], vel, on } };
+            } };
+        case 0xa0: return { 2, channel, true, [](byte s, const byte* i) -> untimed_message { return { s & 0x0fu, key_pressure { i[0], i[1] } }; } };
+        case 0xb0: return { 2, channel, true, [](byte s, const byte* i) -> untimed_message { return { s & 0x0fu, control_change { i[0], i[1] } }; } };
+        case 0xc0: return { 1, channel, true, [](byte s, const byte* i) -> untimed_message { return { s & 0x0fu, program_change { i[0] } }; } };
+        case 0xd0: return { 1, channel, true, [](byte s, const byte* i) -> untimed_message { return { s & 0x0fu, channel_pressure { i[0] } }; } };
+        case 0xe0: return { 2, channel, true, [](byte s, const byte* i) -> untimed_message { return { s & 0x0fu, pitch_change { { i[0], i[1] } } }; } };
+        case 0xf0:
+            switch (status)
+            {
+            case 0xf0: return { std::size_t(-2), system, true, invalid_msg };
+            case 0xf1: return { 1, system, true, [](byte, const byte* i) -> untimed_message { return { mtc_quarter_frame { i[0] } }; } };
+            case 0xf2: return { 2, system, true, [](byte, const byte* i) -> untimed_message { return { song_position { { i[0], i[1] } } }; } };
+            case 0xf3: return { 1, system, true, [](byte, const byte* i) -> untimed_message { return { song_select { i[0] } }; } };
+            case 0xf6: return { 0, system, true, [](byte, const byte*) -> untimed_message { return { tune_request { } }; } };
+            case 0xf4:
+            case 0xf5:
+            case 0xf7: return { 0, system, false, invalid_msg };
+            case 0xf9:
+            case 0xfd: return { 0, realtime, false, invalid_msg };
+            default: return { 0, realtime, true, [](byte s, const byte*) -> untimed_message { return { static_cast<midi::realtime>(s - 0xf8) }; } };
+            }
+        default: return { 0, 0, false, invalid_msg };
+        }
+    }
+
+    // Lookup table indexed by status byte.  Data bytes are marked invalid.
+    inline constexpr auto status_table = []
+    {
+        std::array<status_info, 256> table { };
+        for (unsigned i = 0; i < table.size(); ++i)
+            table[i] = make_status_info(i);
+        return table;
+    }();
+
+    constexpr bool is_valid_status(byte b) { return status_table[b].valid; }
+
+    constexpr std::size_t msg_size(byte status)
+    {
+        if (not status_table[status].valid) throw io::failure { "invalid status byte" };
+        return status_table[status].size;
+    }
+
+    inline untimed_message realtime_msg(byte status)
+    {
+        if (not status_table[status].valid) throw io::failure { "invalid status byte" };
+        return { static_cast<realtime>(status - 0xf8) };
+    }
+
+    // Construct any message other than sysex from its status and data bytes.
+    // Throws io::failure on invalid status bytes.
+    template<typename I>
+    untimed_message make_msg(byte status, I i)
+    {
+        return status_table[status].make(status, std::to_address(i));
+    }
+}
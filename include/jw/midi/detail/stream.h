@@ -0,0 +1,526 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Stream codec implementation, parameterised on a stream policy (see
+// policy.h).  Not part of the public interface.
+
+#pragma once
+#include <array>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <bit>
+#include <cxxabi.h>
+#include <jw/io/realtime_streambuf.h>
+#include <jw/midi/message.h>
+#include <jw/midi/encode.h>
+#include <jw/midi/statistics.h>
+#include <jw/midi/detail/decode.h>
+
+namespace jw::midi::detail
+{
+    struct relaxed_counter
+    {
+        void operator++() noexcept { value.fetch_add(1, std::memory_order_relaxed); }
+        void operator+=(std::uint64_t n) noexcept { value.fetch_add(n, std::memory_order_relaxed); }
+        std::uint64_t load() const noexcept { return value.load(std::memory_order_relaxed); }
+        void reset() noexcept { value.store(0, std::memory_order_relaxed); }
+
+    private:
+        std::atomic<std::uint64_t> value { 0 };
+    };
+
+    struct dummy_counter
+    {
+        constexpr void operator++() noexcept { }
+        constexpr void operator+=(std::uint64_t) noexcept { }
+        constexpr std::uint64_t load() const noexcept { return 0; }
+        constexpr void reset() noexcept { }
+    };
+
+    template<bool enable, typename Clock>
+    struct basic_histogram
+    {
+        typename Clock::time_point start() const noexcept { return Clock::now(); }
+
+        void stop(typename Clock::time_point begin) noexcept
+        {
+            const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - begin).count();
+            const std::size_t i = ns <= 0 ? 0 : std::bit_width(static_cast<std::uint64_t>(ns)) - 1;
+            ++buckets[std::min(i, buckets.size() - 1)];
+        }
+
+        latency_histogram load() const noexcept
+        {
+            latency_histogram h;
+            for (unsigned i = 0; i < buckets.size(); ++i) h.buckets[i] = buckets[i].load();
+            return h;
+        }
+
+        void reset() noexcept { for (auto& i : buckets) i.reset(); }
+
+    private:
+        std::array<relaxed_counter, latency_histogram::num_buckets> buckets;
+    };
+
+    template<typename Clock>
+    struct basic_histogram<false, Clock>
+    {
+        struct empty { };
+        constexpr empty start() const noexcept { return { }; }
+        template<typename T> constexpr void stop(const T&) noexcept { }
+        constexpr latency_histogram load() const noexcept { return { }; }
+        constexpr void reset() noexcept { }
+    };
+
+    using counter = std::conditional_t<config::collect_statistics, relaxed_counter, dummy_counter>;
+
+    template<typename Clock>
+    struct rx_counters
+    {
+        counter channel_messages, system_messages, realtime_messages;
+        counter bytes, running_status, errors, resyncs, partial_waits;
+        basic_histogram<config::collect_statistics, Clock> latency;
+    };
+
+    template<typename Clock>
+    struct tx_counters
+    {
+        counter channel_messages, system_messages, realtime_messages;
+        counter bytes, running_status, realtime_bytes, errors;
+        basic_histogram<config::collect_statistics, Clock> latency;
+    };
+
+    // Holds a partially received message.  Only sysex data is stored on the
+    // heap, all other messages fit in the inline buffer.
+    struct pending_buffer
+    {
+        void push_back(byte b)
+        {
+            if (is_sysex()) return sysex.push_back(b);
+            data[count++] = b;
+            if (b == 0xf0) sysex.push_back(b);
+        }
+
+        void clear() noexcept
+        {
+            count = 0;
+            sysex.clear();
+        }
+
+        std::vector<byte> release_sysex() noexcept { return std::move(sysex); }
+
+        bool empty() const noexcept { return count == 0; }
+        std::size_t size() const noexcept { return is_sysex() ? sysex.size() : count; }
+        byte front() const noexcept { return data[0]; }
+        const byte* begin() const noexcept { return data.data(); }
+
+    private:
+        bool is_sysex() const noexcept { return count > 0 and data[0] == 0xf0; }
+
+        std::array<byte, 3> data;
+        std::uint8_t count { 0 };
+        std::vector<byte> sysex { };
+    };
+
+    template<typename P>
+    struct istream_info
+    {
+        typename P::rx_mutex mutex { };
+        pending_buffer pending_msg { };
+        typename P::clock::time_point pending_msg_time;
+        byte last_status { 0 };
+        rx_counters<typename P::clock> stats { };
+    };
+
+    template<typename P>
+    struct ostream_info
+    {
+        typename P::tx_mutex mutex { };
+        byte last_status { 0 };
+        bool realtime { false };
+        tx_counters<typename P::clock> stats { };
+
+        void init(std::ostream& stream)
+        {
+            if constexpr (P::rdbuf_never_changes)
+                realtime = dynamic_cast<io::realtime_streambuf*>(stream.rdbuf()) != nullptr;
+        }
+    };
+
+    template<typename T>
+    void delete_pword(std::ios_base::event e, std::ios_base& stream, int i)
+    {
+        if (e != std::ios_base::erase_event) return;
+        void*& p = stream.pword(i);
+        if (p == nullptr) return;
+        delete static_cast<T*>(p);
+        p = nullptr;
+    }
+
+    template <typename T, typename S>
+    T* get_pword(int i, S& stream)
+    {
+        void*& p = stream.pword(i);
+        if (p == nullptr) [[unlikely]]
+        {
+            auto* const info = new T { };
+            p = info;
+            if (stream.iword(i)++ == 0) stream.register_callback(delete_pword<T>, i);
+            if constexpr (requires { info->init(stream); }) info->init(stream);
+        }
+        return static_cast<T*>(p);
+    }
+
+    // Each policy allocates its own pword slot.
+    template<typename P>
+    istream_info<P>& rx_state(std::istream& stream)
+    {
+        static const int i = std::ios_base::xalloc();
+        return *get_pword<istream_info<P>>(i, stream);
+    }
+
+    template<typename P>
+    ostream_info<P>& tx_state(std::ostream& stream)
+    {
+        static const int i = std::ios_base::xalloc();
+        return *get_pword<ostream_info<P>>(i, stream);
+    }
+
+    // Track running status through a sequence of raw bytes.
+    template<typename I>
+    void update_status(byte& last_status, I i, const I end)
+    {
+        bool in_sysex = false;
+        while (true)
+        {
+            if (not in_sysex)
+            {
+                for (; i != end; ++i)
+                {
+                    if (not is_status(*i)) continue;
+                    if (is_realtime(*i)) continue;
+                    if (*i == 0xf0) break;
+                    if (is_system(*i)) last_status = 0;
+                    else last_status = *i;
+                }
+            }
+            else i = std::find(i, end, 0xf7);
+            if (i == end) break;
+            in_sysex ^= true;
+        }
+    }
+
+    template<typename P>
+    struct midi_out
+    {
+        static constexpr std::size_t buffer_size = 4;
+
+        midi_out(std::ostream& o) : out { o }, rdbuf { o.rdbuf() }, tx { tx_state<P>(o) } { }
+
+        void emit(const untimed_message& in)
+        {
+            if (not in.valid() or in.is_meta_message()) [[unlikely]] return;
+            const auto start = tx.stats.latency.start();
+            std::unique_lock lock { tx.mutex, std::defer_lock };
+            if (not in.is_realtime_message()) lock.lock();
+            std::ostream::sentry sentry { out };
+            if (not sentry) [[unlikely]] return;
+            try
+            {
+                const auto* begin = data.cbegin();
+                if (auto* t = std::get_if<realtime>(&in.category))
+                {
+                    put_realtime(static_cast<byte>(*t) + 0xf8);
+                    ++tx.stats.realtime_messages;
+                    tx.stats.latency.stop(start);
+                    return;
+                }
+                else if (auto* t = std::get_if<channel_message>(&in.category))
+                {
+                    visit([this, t](auto&& msg) { (*this)(t->channel, msg); }, t->message);
+                    bool running_status = tx.last_status == data[0];
+                    begin += running_status;
+                    size -= running_status;
+                    tx.last_status = data[0];
+                    tx.stats.running_status += running_status;
+                    ++tx.stats.channel_messages;
+                }
+                else if (auto* t = std::get_if<system_message>(&in.category))
+                {
+                    visit(*this, t->message);
+                    if (size > 0) tx.last_status = 0;
+                    ++tx.stats.system_messages;
+                }
+
+                if (size > 0) [[likely]]
+                {
+                    rdbuf->sputn(reinterpret_cast<const char*>(begin), size);
+                    tx.stats.bytes += size;
+                }
+                tx.stats.latency.stop(start);
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...)
+            {
+                ++tx.stats.errors;
+                out._M_setstate(std::ios::badbit);
+            }
+        }
+
+        void emit(std::span<const byte> bytes)
+        {
+            if (bytes.empty()) [[unlikely]] return;
+            const auto start = tx.stats.latency.start();
+            std::unique_lock lock { tx.mutex };
+            std::ostream::sentry sentry { out };
+            if (not sentry) [[unlikely]] return;
+            try
+            {
+                const bool running_status = is_status(bytes[0]) and tx.last_status == bytes[0];
+                tx.stats.running_status += running_status;
+                update_status(tx.last_status, bytes.begin(), bytes.end());
+                bytes = bytes.subspan(running_status);
+                rdbuf->sputn(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+                tx.stats.bytes += bytes.size();
+                tx.stats.latency.stop(start);
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...)
+            {
+                ++tx.stats.errors;
+                out._M_setstate(std::ios::badbit);
+            }
+        }
+
+        void operator()(byte ch, const note_event& msg)
+        {
+            const byte on = 0x90 | ch;
+            if ((P::optimize_note_off or msg.velocity == 0x40) and not msg.on and tx.last_status == on)
+                put(encode(ch, note_event { msg.note, 0x00, true }));
+            else
+                put(encode(ch, msg));
+        }
+
+        template<typename T>
+        void operator()(byte ch, const T& msg)
+        {
+            put(encode(ch, msg));
+        }
+
+        void operator()(const sysex& msg)
+        {
+            update_status(tx.last_status, msg.data.cbegin(), msg.data.cend());
+            rdbuf->sputn(reinterpret_cast<const char*>(msg.data.data()), msg.data.size());
+            tx.stats.bytes += msg.data.size();
+            size = 0;
+        }
+
+        template<typename T>
+        void operator()(const T& msg)
+        {
+            put(encode(msg));
+        }
+
+    private:
+        void put_realtime(byte a)
+        {
+            if constexpr (P::rdbuf_never_changes)
+            {
+                if (tx.realtime)
+                {
+                    ++tx.stats.realtime_bytes;
+                    return static_cast<jw::io::realtime_streambuf*>(rdbuf)->put_realtime(a);
+                }
+            }
+            else if (auto* rtbuf = dynamic_cast<io::realtime_streambuf*>(rdbuf))
+            {
+                ++tx.stats.realtime_bytes;
+                return rtbuf->put_realtime(a);
+            }
+            rdbuf->sputc(a);
+            ++tx.stats.bytes;
+        }
+
+        template<std::size_t N>
+        void put(const encoded_bytes<N>& msg)
+        {
+            static_assert(N <= buffer_size);
+            std::copy(msg.begin(), msg.end(), data.begin());
+            size = msg.size;
+        }
+
+        std::ostream& out;
+        std::streambuf* const rdbuf;
+        ostream_info<P>& tx;
+        std::size_t size;
+        std::array<byte, buffer_size> data;
+    };
+
+    template<typename P, bool dont_block>
+    extract_status do_extract(std::istream& in, timed_message<typename P::clock::time_point>& out)
+    {
+        using clock = typename P::clock;
+        using message_type = timed_message<typename clock::time_point>;
+        auto& rx { rx_state<P>(in) };
+        std::unique_lock lock { rx.mutex };
+        auto* const buf { in.rdbuf() };
+        std::istream::sentry sentry { in, true };
+        if (not sentry) return extract_status::stream_error;
+
+        constexpr int eof = std::char_traits<char>::eof();
+        constexpr int no_data = eof - 1;
+
+        auto peek = [&]() -> int
+        {
+            if (dont_block and buf->in_avail() == 0)
+            {
+                buf->pubsync();
+                if (buf->in_avail() == 0) return no_data;
+            }
+            return buf->sgetc();
+        };
+
+        auto get = [&]
+        {
+            const int b = peek();
+            if (b >= 0)
+            {
+                buf->sbumpc();
+                ++rx.stats.bytes;
+                if (not is_realtime(b)) rx.pending_msg.push_back(b);
+            }
+            return b;
+        };
+
+        auto wait = [](int b)
+        {
+            if (b == eof) return extract_status::end_of_file;
+            return extract_status::would_block;
+        };
+
+        auto invalid = [&rx]
+        {
+            ++rx.stats.errors;
+            rx.pending_msg.clear();
+            rx.last_status = 0;
+            return extract_status::invalid_status;
+        };
+
+        auto realtime = [&](byte b, typename clock::time_point t)
+        {
+            if (not is_valid_status(b)) return invalid();
+            ++rx.stats.realtime_messages;
+            out = message_type { realtime_msg(b), t };
+            return extract_status::ok;
+        };
+
+        byte status = rx.last_status;
+
+        // Wait for data to arrive
+        if (rx.pending_msg.empty())
+        {
+            // Discard data until the first status byte
+            if (status == 0) while (true)
+            {
+                const int b = peek();
+                if (b < 0) return wait(b);
+                if (is_status(b) and b != 0xf7) break;
+                buf->sbumpc();
+                ++rx.stats.bytes;
+                ++rx.stats.resyncs;
+            }
+            const int b = get();
+            if (b < 0) return wait(b);
+            rx.pending_msg_time = clock::now();
+            if (is_realtime(b)) return realtime(b, rx.pending_msg_time);
+        }
+
+        // Check for new status byte
+        bool new_status = false;
+        if (is_status(rx.pending_msg.front()))
+        {
+            status = rx.pending_msg.front();
+            new_status = true;
+        }
+        if (not is_valid_status(status)) return invalid();
+
+        // Read bytes from streambuf
+        const bool is_sysex = status == 0xf0;
+        while (rx.pending_msg.size() < status_table[status].size + new_status)
+        {
+            const int b = get();
+            if (b < 0)
+            {
+                if (b == no_data) ++rx.stats.partial_waits;
+                return wait(b);
+            }
+            if (is_realtime(b)) return realtime(b, clock::now());
+            if (is_status(b))
+            {
+                if (is_sysex and b == 0xf7) break;
+                ++rx.stats.errors;
+                rx.pending_msg_time = clock::now();
+                rx.pending_msg.clear();
+                rx.pending_msg.push_back(b);
+                return extract_status::unexpected_status;
+            }
+        }
+
+        // Store running status
+        if (is_system(status)) rx.last_status = 0;
+        else rx.last_status = status;
+
+        if (status_table[status].category == untimed_message::index_of<system_message>()) ++rx.stats.system_messages;
+        else ++rx.stats.channel_messages;
+        rx.stats.running_status += not new_status;
+        rx.stats.latency.stop(rx.pending_msg_time);
+
+        // Construct the message
+        if (is_sysex) out = message_type { sysex { rx.pending_msg.release_sysex() }, rx.pending_msg_time };
+        else out = message_type { make_msg(status, rx.pending_msg.begin() + new_status), rx.pending_msg_time };
+        rx.pending_msg.clear();
+        return extract_status::ok;
+    }
+
+    template<typename P, bool dont_block>
+    timed_message<typename P::clock::time_point> do_extract(std::istream& in)
+    {
+        timed_message<typename P::clock::time_point> msg { };
+        bool unexpected = false;
+        try
+        {
+            switch (do_extract<P, dont_block>(in, msg))
+            {
+            case extract_status::ok:
+            case extract_status::would_block:
+            case extract_status::stream_error:
+                break;
+            case extract_status::end_of_file: throw io::end_of_file { };
+            case extract_status::invalid_status: throw io::failure { "invalid status byte" };
+            case extract_status::unexpected_status: unexpected = true;
+            }
+        }
+        catch (const io::failure&) { in._M_setstate(std::ios::failbit); }
+        catch (const io::end_of_file&) { in._M_setstate(std::ios::eofbit); }
+        catch (const abi::__forced_unwind&) { throw; }
+        catch (...) { in._M_setstate(std::ios::badbit); }
+
+        if (unexpected)
+        {
+            try { in.setstate(std::ios::failbit); }
+            catch (const std::ios::failure&) { }
+            throw io::failure { "unexpected status byte" };
+        }
+        return msg;
+    }
+
+    template<typename P, bool dont_block>
+    extract_status do_extract_nothrow(std::istream& in, timed_message<typename P::clock::time_point>& out)
+    {
+        try { return do_extract<P, dont_block>(in, out); }
+        catch (const abi::__forced_unwind&) { throw; }
+        catch (...) { return extract_status::stream_error; }
+    }
+}
@@ -0,0 +1,166 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <bit>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <optional>
+#include <functional>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    // Selects messages by type and channel.  Types are channel_message
+    // subtypes (note_event, control_change, ...), system_message subtypes
+    // (sysex, song_position, ...), realtime or meta_message.  Passing
+    // channel_message or system_message selects all of their subtypes.
+    // The channel mask only applies to channel messages.
+    struct message_filter
+    {
+        static constexpr unsigned num_kinds = 13;
+        static constexpr std::uint32_t all_kinds = (1u << num_kinds) - 1;
+        static constexpr std::uint16_t all_channels = 0xffff;
+
+        std::uint32_t kinds { all_kinds };
+        std::uint16_t channels { all_channels };
+
+        template<typename... T>
+        static constexpr message_filter of(std::uint16_t channel_mask = all_channels) noexcept
+        {
+            return { (kind_mask<T>() | ...), channel_mask };
+        }
+
+        static constexpr std::uint16_t channel(unsigned ch) noexcept { return 1u << (ch & 0x0f); }
+
+        template<typename T>
+        static consteval std::uint32_t kind_mask() noexcept
+        {
+            if constexpr (std::is_same_v<T, channel_message>) return 0x003f;
+            else if constexpr (std::is_same_v<T, system_message>) return 0x07c0;
+            else if constexpr (channel_message::contains<T>()) return 1u << channel_message::index_of<T>();
+            else if constexpr (system_message::contains<T>()) return 1u << (6 + system_message::index_of<T>());
+            else if constexpr (std::is_same_v<T, realtime>) return 1u << 11;
+            else if constexpr (std::is_same_v<T, meta_message>) return 1u << 12;
+            else static_assert(sizeof(T) == 0, "not a message type");
+        }
+    };
+
+    // Bounded lock-free queue for one producer and one consumer thread.
+    // Capacity is rounded up to a power of two.
+    template<typename T>
+    struct spsc_queue
+    {
+        explicit spsc_queue(std::size_t capacity)
+            : mask { std::bit_ceil(std::max<std::size_t>(capacity, 2)) - 1 }, slots { new std::optional<T>[mask + 1] } { }
+
+        spsc_queue(const spsc_queue&) = delete;
+        spsc_queue& operator=(const spsc_queue&) = delete;
+
+        template<typename U>
+        bool try_push(U&& value)
+        {
+            const auto w = write_pos.load(std::memory_order_relaxed);
+            if (w - read_cache > mask)
+            {
+                read_cache = read_pos.load(std::memory_order_acquire);
+                if (w - read_cache > mask) return false;
+            }
+            slots[w & mask].emplace(std::forward<U>(value));
+            write_pos.store(w + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::optional<T> try_pop()
+        {
+            const auto r = read_pos.load(std::memory_order_relaxed);
+            if (r == write_cache)
+            {
+                write_cache = write_pos.load(std::memory_order_acquire);
+                if (r == write_cache) return std::nullopt;
+            }
+            std::optional<T> value { std::move(slots[r & mask]) };
+            slots[r & mask].reset();
+            read_pos.store(r + 1, std::memory_order_release);
+            return value;
+        }
+
+        bool empty() const noexcept { return read_pos.load(std::memory_order_acquire) == write_pos.load(std::memory_order_acquire); }
+        std::size_t capacity() const noexcept { return mask + 1; }
+
+    private:
+        const std::size_t mask;
+        std::unique_ptr<std::optional<T>[]> slots;
+        alignas(64) std::atomic<std::size_t> write_pos { 0 };
+        std::size_t read_cache { 0 };       // Producer's copy of read_pos.
+        alignas(64) std::atomic<std::size_t> read_pos { 0 };
+        std::size_t write_cache { 0 };      // Consumer's copy of write_pos.
+    };
+
+    using message_queue = spsc_queue<message>;
+
+    // Routes each message to the subscribers whose filter matches it.  For
+    // every combination of type and channel, the list of matching
+    // subscribers is computed when subscribing, so routing a message only
+    // visits the subscribers that receive it.
+    //
+    // Subscribers receive messages through a callback, or through a
+    // message_queue which is read from another thread.  When a queue is
+    // full, the message is dropped for that subscriber, and counted.
+    //
+    // Dispatching may happen from one thread only.  Subscribing and
+    // unsubscribing is not thread-safe.
+    struct dispatcher
+    {
+        using callback = std::function<void(const message&)>;
+
+        // Returns an index by which the subscriber is identified.  The queue
+        // must remain valid while subscribed.
+        std::size_t subscribe(message_filter filter, callback f);
+        std::size_t subscribe(message_filter filter, message_queue& queue);
+        void unsubscribe(std::size_t subscriber);
+
+        // Number of messages not delivered because the queue was full.
+        std::uint64_t dropped(std::size_t subscriber) const noexcept { return subscribers[subscriber].dropped; }
+
+        // Deliver one message to all matching subscribers.  Returns the
+        // number of subscribers that received it, not counting those whose
+        // queue was full.
+        std::size_t dispatch(const message& msg);
+
+        // Read all available messages from the stream, at most
+        // 'max_messages', and dispatch them.  Returns the number of messages
+        // read.  Invalid or interrupted messages are counted in errors().
+        // Once the stream reaches end-of-file or an error, active() returns
+        // false.
+        std::size_t poll(std::istream& in, std::size_t max_messages = 16);
+
+        bool active() const noexcept { return is_active; }
+        std::size_t errors() const noexcept { return num_errors; }
+
+    private:
+        // Channel messages: type * 16 + channel.  Other messages: one key
+        // per type.
+        static constexpr std::size_t num_keys = 6 * 16 + (message_filter::num_kinds - 6);
+
+        struct subscriber
+        {
+            message_filter filter;
+            callback function;
+            message_queue* queue;
+            std::uint64_t dropped;
+            bool active;
+        };
+
+        static std::size_t route_key(const untimed_message& msg) noexcept;
+        static bool matches(const message_filter& filter, std::size_t key) noexcept;
+        void add_routes(std::size_t subscriber);
+
+        std::vector<subscriber> subscribers;
+        std::array<std::vector<std::uint32_t>, num_keys> routes;
+        std::size_t num_errors { 0 };
+        bool is_active { true };
+    };
+}
@@ -0,0 +1,158 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <array>
+#include <span>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    // Fixed-capacity sequence of encoded MIDI bytes.  All functions in this
+    // file are usable in constant expressions, so that fixed messages can be
+    // encoded at compile time and transmitted with emit_bytes().
+    template<std::size_t N>
+    struct encoded_bytes
+    {
+        std::array<byte, N> data { };
+        std::size_t size { 0 };
+
+        constexpr const byte* begin() const noexcept { return data.data(); }
+        constexpr const byte* end() const noexcept { return data.data() + size; }
+        constexpr std::span<const byte> span() const noexcept { return { begin(), size }; }
+        constexpr operator std::span<const byte>() const noexcept { return span(); }
+    };
+
+    // Encode a single message.  The status byte is always included.
+    constexpr encoded_bytes<3> encode(unsigned ch, const note_event& msg) noexcept
+    {
+        const byte status = (msg.on ? 0x90 : 0x80) | (ch & 0x0f);
+        return { { status, static_cast<byte>(msg.note), static_cast<byte>(msg.velocity) }, 3 };
+    }
+
+    constexpr encoded_bytes<3> encode(unsigned ch, const key_pressure& msg) noexcept
+    {
+        return { { static_cast<byte>(0xa0 | (ch & 0x0f)), static_cast<byte>(msg.note), static_cast<byte>(msg.value) }, 3 };
+    }
+
+    constexpr encoded_bytes<3> encode(unsigned ch, const control_change& msg) noexcept
+    {
+        return { { static_cast<byte>(0xb0 | (ch & 0x0f)), static_cast<byte>(msg.control), static_cast<byte>(msg.value) }, 3 };
+    }
+
+    constexpr encoded_bytes<3> encode(unsigned ch, const program_change& msg) noexcept
+    {
+        return { { static_cast<byte>(0xc0 | (ch & 0x0f)), static_cast<byte>(msg.value) }, 2 };
+    }
+
+    constexpr encoded_bytes<3> encode(unsigned ch, const channel_pressure& msg) noexcept
+    {
+        return { { static_cast<byte>(0xd0 | (ch & 0x0f)), static_cast<byte>(msg.value) }, 2 };
+    }
+
+    constexpr encoded_bytes<3> encode(unsigned ch, const pitch_change& msg) noexcept
+    {
+        return { { static_cast<byte>(0xe0 | (ch & 0x0f)), static_cast<byte>(msg.value.lo), static_cast<byte>(msg.value.hi) }, 3 };
+    }
+
+    constexpr encoded_bytes<3> encode(const channel_message& msg) noexcept
+    {
+        return std::visit([ch = msg.channel](const auto& m) { return encode(ch, m); }, msg.message);
+    }
+
+    constexpr encoded_bytes<3> encode(const mtc_quarter_frame& msg) noexcept
+    {
+        return { { 0xf1, static_cast<byte>(msg.data) }, 2 };
+    }
+
+    constexpr encoded_bytes<3> encode(const song_position& msg) noexcept
+    {
+        return { { 0xf2, static_cast<byte>(msg.value.lo), static_cast<byte>(msg.value.hi) }, 3 };
+    }
+
+    constexpr encoded_bytes<3> encode(const song_select& msg) noexcept
+    {
+        return { { 0xf3, static_cast<byte>(msg.value) }, 2 };
+    }
+
+    constexpr encoded_bytes<3> encode(const tune_request&) noexcept
+    {
+        return { { 0xf6 }, 1 };
+    }
+
+    constexpr encoded_bytes<3> encode(realtime msg) noexcept
+    {
+        return { { static_cast<byte>(static_cast<byte>(msg) + 0xf8) }, 1 };
+    }
+
+    // Concatenate a list of encoded messages, omitting repeated status bytes
+    // where running status applies.
+    template<std::size_t... N>
+    constexpr encoded_bytes<(N + ...)> encode_sequence(const encoded_bytes<N>&... msgs) noexcept
+    {
+        encoded_bytes<(N + ...)> out { };
+        byte last_status = 0;
+        auto append = [&out, &last_status](const auto& msg)
+        {
+            std::size_t i = 0;
+            const byte status = msg.data[0];
+            if (status == last_status) ++i;
+            if (status < 0xf0) last_status = status;
+            else if (status < 0xf8) last_status = 0;
+            for (; i < msg.size; ++i) out.data[out.size++] = msg.data[i];
+        };
+        (append(msgs), ...);
+        return out;
+    }
+
+    // Pre-encoded equivalents of long_control_change(), rpn_change() and
+    // nrpn_change().
+    constexpr auto encode_long_control_change(unsigned ch, unsigned control, split_uint14_t value) noexcept
+    {
+        return encode_sequence(encode(ch, control_change { control + 0x00, value.hi }),
+                               encode(ch, control_change { control + 0x20, value.lo }));
+    }
+
+    constexpr auto encode_rpn_change(unsigned ch, split_uint14_t param, split_uint14_t value) noexcept
+    {
+        return encode_sequence(encode(ch, control_change { 0x65, param.hi }),
+                               encode(ch, control_change { 0x64, param.lo }),
+                               encode(ch, control_change { 0x06, value.hi }),
+                               encode(ch, control_change { 0x26, value.lo }));
+    }
+
+    constexpr auto encode_nrpn_change(unsigned ch, split_uint14_t param, split_uint14_t value) noexcept
+    {
+        return encode_sequence(encode(ch, control_change { 0x63, param.hi }),
+                               encode(ch, control_change { 0x62, param.lo }),
+                               encode(ch, control_change { 0x06, value.hi }),
+                               encode(ch, control_change { 0x26, value.lo }));
+    }
+
+    // Send the given channel mode control (eg. 0x7b for All Notes Off) on
+    // all 16 channels.
+    constexpr encoded_bytes<48> encode_all_channels(control_change msg) noexcept
+    {
+        encoded_bytes<48> out { };
+        for (unsigned ch = 0; ch < 16; ++ch)
+            for (byte b : encode(ch, msg).span())
+                out.data[out.size++] = b;
+        return out;
+    }
+
+    inline constexpr auto all_notes_off = encode_all_channels(control_change { 0x7b, 0 });
+    inline constexpr auto all_sound_off = encode_all_channels(control_change { 0x78, 0 });
+    inline constexpr auto reset_all_controllers = encode_all_channels(control_change { 0x79, 0 });
+
+    // Universal sysex messages for General MIDI.
+    inline constexpr std::array<byte, 6> gm_reset { 0xf0, 0x7e, 0x7f, 0x09, 0x01, 0xf7 };
+    inline constexpr std::array<byte, 6> gm2_reset { 0xf0, 0x7e, 0x7f, 0x09, 0x03, 0xf7 };
+    inline constexpr std::array<byte, 6> gm_off { 0xf0, 0x7e, 0x7f, 0x09, 0x02, 0xf7 };
+
+    // Write a pre-encoded byte sequence to the ostream with a single sputn().
+    // If the first byte matches the current running status, it is omitted.
+    // Running status is updated according to the status bytes contained in
+    // the sequence.  Realtime bytes in the sequence are not treated
+    // specially.
+    void emit_bytes(std::ostream& out, std::span<const byte> data);
+}
@@ -0,0 +1,80 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#if __has_include(<sys/epoll.h>)
+#include <functional>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <sys/epoll.h>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    // Services any number of file descriptors from a single thread, using
+    // epoll.  This is intended to be used with fd_streambuf, to handle many
+    // MIDI ports without a thread per port.
+    //
+    // All functions except stop() must be called from the thread that calls
+    // run() / run_once().  Callbacks may add or remove watches, including
+    // their own.
+    struct epoll_reactor
+    {
+        using callback = std::function<void(std::uint32_t events)>;
+        using message_handler = std::function<void(message&&)>;
+
+        epoll_reactor();
+        ~epoll_reactor();
+
+        epoll_reactor(const epoll_reactor&) = delete;
+        epoll_reactor& operator=(const epoll_reactor&) = delete;
+
+        // Invoke a callback whenever any of the specified events (EPOLLIN,
+        // EPOLLOUT, ...) is pending on the given descriptor.  If 'oneshot' is
+        // set, the watch is removed before the callback is invoked.
+        void watch(int fd, callback cb, std::uint32_t events = EPOLLIN, bool oneshot = false);
+
+        // Invoke a handler for each message received on the given istream,
+        // whose rdbuf() must be an fd_streambuf.  Invalid messages are
+        // skipped.  The watch is removed when end-of-file is reached, or the
+        // stream enters a failed state.
+        void watch(std::istream& in, message_handler handler);
+
+        // Stop watching the given descriptor.
+        void unwatch(int fd);
+
+        // Wait up to the given timeout for events, and dispatch them.  A
+        // negative timeout waits indefinitely.  Returns the number of
+        // callbacks invoked.  Where epoll_pwait2() is not available, the
+        // timeout is rounded up to whole milliseconds.
+        std::size_t run_once(std::chrono::nanoseconds timeout = std::chrono::nanoseconds { -1 });
+
+        // Dispatch events until stop() is called.
+        void run();
+
+        // Interrupt run() or run_once().  This may be called from any thread.
+        void stop();
+
+        std::size_t size() const noexcept { return watches.size(); }
+
+    private:
+        struct entry
+        {
+            int fd;
+            bool oneshot;
+            bool removed;
+            callback cb;
+        };
+
+        const int epoll_fd;
+        const int wake_fd;
+        std::atomic<bool> stopped { false };
+        std::unordered_map<int, std::unique_ptr<entry>> watches;
+        std::vector<std::unique_ptr<entry>> removed;
+        std::vector<epoll_event> events;
+    };
+}
+#endif
@@ -0,0 +1,78 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <vector>
+#include <memory>
+#include <jw/midi/message.h>
+#include <jw/midi/policy.h>
+
+namespace jw::midi
+{
+    // Immutable encoded form of a single message, including status byte.
+    // It can be shared between any number of outputs, and kept for later
+    // retransmission.
+    struct encoded_message
+    {
+        std::span<const byte> bytes() const noexcept { return data; }
+        bool empty() const noexcept { return data.empty(); }
+
+    private:
+        friend std::shared_ptr<const encoded_message> encode_shared(untimed_message&&);
+        friend std::shared_ptr<const encoded_message> encode_shared(const untimed_message&);
+        friend struct fanout_router;
+
+        enum class kind : std::uint8_t { other, channel, realtime };
+        static kind kind_of(const untimed_message& msg) noexcept;
+
+        std::vector<byte> data;
+        kind type { kind::other };
+    };
+
+    using shared_encoded_message = std::shared_ptr<const encoded_message>;
+
+    // Encode a message once, for transmission with fanout_router::send().
+    // The rvalue overload takes over the data of a sysex message without
+    // copying it.  Meta messages and invalid messages encode to an empty
+    // block, which is not transmitted.
+    shared_encoded_message encode_shared(untimed_message&& msg);
+    shared_encoded_message encode_shared(const untimed_message& msg);
+
+    // Transmits each message to a number of output streams, encoding it
+    // only once.  Running status is still tracked per output, in the same
+    // state that emit() uses, so router and emit() may be used on the same
+    // stream.  As with emit(), status bytes within sysex data update the
+    // running status.  Sysex data is written to each output directly from the
+    // message, and never copied.  Meta messages are not transmitted.
+    //
+    // Each output is locked while it is written to, as with emit().  Adding
+    // and removing outputs is not thread-safe.
+    struct fanout_router
+    {
+        // Add an output stream, which must remain valid while it is in use.
+        // Returns the index by which this output is identified.
+        std::size_t add(std::ostream& out);
+
+        // Stop sending to the given output.  Its index is not reused.
+        void remove(std::size_t output) noexcept { outputs[output].out = nullptr; }
+
+        void send(const untimed_message& msg);
+        void send(const encoded_message& msg) { send_bytes(msg.bytes(), msg.type); }
+        void send(const shared_encoded_message& msg) { if (msg) send(*msg); }
+
+    private:
+        using tx_info = detail::ostream_info<default_policy>;
+
+        struct output
+        {
+            std::ostream* out;
+            tx_info* tx;
+        };
+
+        void send_bytes(std::span<const byte> msg, encoded_message::kind type);
+        void send_realtime(byte b);
+
+        std::vector<output> outputs;
+    };
+}
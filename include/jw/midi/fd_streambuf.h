@@ -0,0 +1,57 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#if __has_include(<unistd.h>) and __has_include(<poll.h>)
+#include <memory>
+#include <jw/io/realtime_streambuf.h>
+
+namespace jw::midi
+{
+    // Stream buffer for POSIX file descriptors, such as raw MIDI devices,
+    // pipes, ptys and FIFOs.  Each underflow reads as many bytes as are
+    // available with a single read().  in_avail() reports the number of bytes
+    // that can be read without blocking, and -1 when the other end is closed,
+    // so this is suitable for try_extract().
+    //
+    // By default, output is written through, with one write() per sputn()
+    // call, so every emitted message is sent immediately.  If a transmit
+    // buffer size is given, output is held until it is flushed (eg. via
+    // std::flush) or the buffer is full, which adds unbounded latency.  For
+    // batching with a latency bound, use coalescing_streambuf instead.
+    // Realtime bytes are always written immediately.
+    //
+    // The descriptor may be in blocking or non-blocking mode.  In both cases,
+    // reads and writes block (via poll()) when no progress can be made.
+    // System errors are thrown as std::system_error.
+    struct fd_streambuf final : io::realtime_streambuf
+    {
+        explicit fd_streambuf(int fd, bool take_ownership = false, std::size_t rx_buffer_size = 512, std::size_t tx_buffer_size = 0);
+        virtual ~fd_streambuf();
+
+        fd_streambuf(const fd_streambuf&) = delete;
+        fd_streambuf& operator=(const fd_streambuf&) = delete;
+
+        int fd() const noexcept { return file; }
+
+        virtual void put_realtime(char_type c) override;
+
+    protected:
+        virtual int_type underflow() override;
+        virtual std::streamsize showmanyc() override;
+        virtual int_type overflow(int_type c) override;
+        virtual std::streamsize xsputn(const char_type* s, std::streamsize n) override;
+        virtual int sync() override;
+
+    private:
+        void write_all(const char_type* s, std::size_t n);
+
+        const int file;
+        const bool owned;
+        const std::size_t rx_size;
+        const std::size_t tx_size;
+        std::unique_ptr<char_type[]> rx_buf;
+        std::unique_ptr<char_type[]> tx_buf;
+    };
+}
+#endif
@@ -6,6 +6,11 @@
 #include <map>
 #include <fstream>
 #include <filesystem>
+#include <future>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
 #include <jw/midi/message.h>
 
 namespace jw::midi
@@ -20,6 +25,29 @@ namespace jw::midi
             unsigned clocks_per_frame : 8;
         };
 
+        // Packet layout of a sysex message that was joined from an 0xf0
+        // event and following 0xf7 continuation events.
+        struct sysex_packet
+        {
+            std::size_t offset;         // Start of this packet in sysex::data.
+            std::uint64_t delay;        // Ticks after the first packet.
+        };
+
+        struct sysex_layout
+        {
+            std::uint64_t tick;         // Location of the sysex in the track,
+            std::size_t index;          // and its index at that tick.
+            std::vector<sysex_packet> packets;
+        };
+
+        struct read_options
+        {
+            // Join sysex messages that are split over multiple events into
+            // one message, at the time of the first packet.  The packet
+            // timing is stored in sysex_layouts.
+            bool reassemble_sysex;
+        };
+
         file(std::istream& stream) : file { read(stream) } { }
         file(const std::filesystem::path& f) : file { read(f) } { }
 
@@ -29,18 +57,116 @@ namespace jw::midi
         file& operator=(const file&) = default;
         file& operator=(file&&) noexcept = default;
 
-        static file read(std::istream&);
-        static file read(const std::filesystem::path& file)
+        static file read(std::istream& stream) { return read(stream, { false }); }
+        static file read(std::istream&, const read_options&);
+        static file read(const std::filesystem::path& file) { return read(file, { false }); }
+        static file read(const std::filesystem::path& file, const read_options& options)
         {
             std::ifstream stream { file, std::ios::in | std::ios::binary };
             stream.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
-            return read(stream);
+            return read(stream, options);
         }
 
         bool asynchronous_tracks;
         std::variant<unsigned, smpte_format> time_division;
         std::vector<track> tracks;
+
+        // For each track, the layout of every joined sysex message.  Only
+        // filled in by read() with reassemble_sysex.  This is not updated
+        // when the tracks are modified.
+        std::vector<std::vector<sysex_layout>> sysex_layouts;
     };
 
     inline std::istream& operator>>(std::istream& in, file& out) { out = file::read(in); return in; }
+
+    // A MIDI file of which only the header is parsed on construction.  Each
+    // track is decoded when it is first accessed, or in the background via
+    // prefetch().  The stream must be seekable, and must remain valid for the
+    // lifetime of this object.  When constructed from a path, the file is
+    // kept open internally.  This object is not movable, since background
+    // decoding refers to it.  The destructor waits for pending prefetches.
+    struct lazy_file
+    {
+        explicit lazy_file(std::istream& stream);
+        explicit lazy_file(const std::filesystem::path& f) : lazy_file { open(f) } { }
+        ~lazy_file();
+
+        lazy_file(lazy_file&&) = delete;
+        lazy_file& operator=(lazy_file&&) = delete;
+
+        std::size_t num_tracks() const noexcept { return tracks.size(); }
+
+        // Returns the specified track, decoding it first if necessary.  This
+        // may be called concurrently from multiple threads.  If decoding
+        // fails, the stream state is set as in file::read(), and the
+        // exception is rethrown.  The next call tries again.
+        const file::track& track(std::size_t i);
+
+        // Check if the specified track has been decoded already.
+        bool is_loaded(std::size_t i) const noexcept { return tracks[i]->loaded.load(std::memory_order_acquire); }
+
+        // Decode the specified track in a background thread.  Errors are
+        // reported through the returned future.
+        std::future<void> prefetch(std::size_t i);
+
+        // Decode all remaining tracks, and move them into a regular file.
+        file load() &&;
+
+        bool asynchronous_tracks;
+        std::variant<unsigned, file::smpte_format> time_division;
+
+    private:
+        struct lazy_track
+        {
+            std::streamoff offset;
+            std::size_t size;
+            std::once_flag once { };
+            std::atomic<bool> loaded { false };
+            file::track track { };
+        };
+
+        lazy_file(std::unique_ptr<std::ifstream>&& f) : lazy_file { *f } { owned_stream = std::move(f); }
+
+        static std::unique_ptr<std::ifstream> open(const std::filesystem::path& file)
+        {
+            auto stream = std::make_unique<std::ifstream>(file, std::ios::in | std::ios::binary);
+            stream->exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
+            return stream;
+        }
+
+        std::unique_ptr<std::istream> owned_stream;
+        std::istream* stream;
+        std::unique_ptr<config::rx_mutex> mutex { std::make_unique<config::rx_mutex>() };
+        std::vector<std::unique_ptr<lazy_track>> tracks;
+        std::mutex prefetch_mutex;
+        std::condition_variable prefetch_cv;
+        std::size_t num_prefetching { 0 };
+    };
+
+    // Parser for MIDI files from streams that are not seekable, such as
+    // pipes or decompression streams.  The input is consumed in windows of
+    // a fixed size, and unknown chunks are skipped by reading past them.
+    // Each message is passed to the callback as soon as it is decoded, so
+    // memory use does not depend on the file size, only on the window size
+    // and the largest sysex or meta message.
+    struct file_parser
+    {
+        using callback = std::function<void(std::size_t track, std::uint64_t tick, untimed_message&& msg)>;
+
+        explicit file_parser(std::size_t window_size = 4096)
+            : size { window_size > 0 ? window_size : 1 }, window { new byte[size] } { }
+
+        // Parse an entire file.  The header fields below are set before the
+        // first message is passed to the callback.  As with file::read(),
+        // errors are reported via the stream state.
+        void parse(std::istream& in, const callback& cb);
+
+        bool asynchronous_tracks;
+        std::variant<unsigned, file::smpte_format> time_division;
+        std::size_t num_tracks { 0 };
+
+    private:
+        std::size_t size;
+        std::unique_ptr<byte[]> window;
+    };
 }
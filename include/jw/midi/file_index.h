@@ -0,0 +1,99 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // A tick-sorted sequence of values of one kind, with for each entry its
+    // time stamp and the track it came from, in separate arrays.
+    template<typename V>
+    struct column
+    {
+        std::span<const std::uint64_t> ticks;
+        std::span<const V> values;
+        std::span<const std::uint16_t> tracks;
+
+        std::size_t size() const noexcept { return ticks.size(); }
+        bool empty() const noexcept { return ticks.empty(); }
+
+        // Entries with a tick in the range [from, to).
+        column range(std::uint64_t from, std::uint64_t to) const noexcept
+        {
+            const std::size_t a = std::lower_bound(ticks.begin(), ticks.end(), from) - ticks.begin();
+            const std::size_t b = std::lower_bound(ticks.begin() + a, ticks.end(), to) - ticks.begin();
+            return { ticks.subspan(a, b - a), values.subspan(a, b - a), tracks.subspan(a, b - a) };
+        }
+    };
+
+    // A set of columns of the same value type, stored back to back.
+    template<typename V>
+    struct column_group
+    {
+        column<V> operator[](std::size_t key) const noexcept
+        {
+            if (key + 1 >= offsets.size()) return { };
+            const std::size_t a = offsets[key];
+            const std::size_t n = offsets[key + 1] - a;
+            return { { ticks.data() + a, n }, { values.data() + a, n }, { tracks.data() + a, n } };
+        }
+
+        std::vector<std::uint32_t> offsets;     // Start of each column, plus the end.
+        std::vector<std::uint64_t> ticks;
+        std::vector<V> values;
+        std::vector<std::uint16_t> tracks;
+    };
+
+    // Columnar projection of a file, for queries that only look at a few
+    // kinds of messages.  Each kind of message gets its own tick-sorted
+    // column per channel (and per controller for control changes), merged
+    // over all tracks.  On equal ticks, entries keep their track order.
+    //
+    // Sysex, system common and unknown meta messages are not indexed.  The
+    // index does not reference the file, and is not updated when the file
+    // changes.
+    struct file_index
+    {
+        struct note_value
+        {
+            byte note;
+            byte velocity;
+        };
+
+        file_index() = default;
+        explicit file_index(const file& f);
+
+        column<note_value> notes_on(unsigned ch) const noexcept { return note_on_group[ch]; }
+        column<note_value> notes_off(unsigned ch) const noexcept { return note_off_group[ch]; }
+        column<note_value> key_pressures(unsigned ch) const noexcept { return key_pressure_group[ch]; }
+        column<byte> control_changes(unsigned ch, unsigned control) const noexcept { return control_group[ch * 128 + control]; }
+        column<byte> program_changes(unsigned ch) const noexcept { return program_group[ch]; }
+        column<byte> channel_pressures(unsigned ch) const noexcept { return channel_pressure_group[ch]; }
+        column<std::uint16_t> pitch_bends(unsigned ch) const noexcept { return pitch_group[ch]; }   // 0x2000 is center.
+
+        column<std::chrono::microseconds> tempo_changes() const noexcept { return tempo_group[0]; }
+        column<meta::time_signature> time_signatures() const noexcept { return time_signature_group[0]; }
+        column<meta::key_signature> key_signatures() const noexcept { return key_signature_group[0]; }
+        column<meta::smpte_offset> smpte_offsets() const noexcept { return smpte_group[0]; }
+        column<std::string> texts(decltype(meta::text::type) type) const noexcept { return text_group[type]; }
+
+    private:
+        column_group<note_value> note_on_group;
+        column_group<note_value> note_off_group;
+        column_group<note_value> key_pressure_group;
+        column_group<byte> control_group;
+        column_group<byte> program_group;
+        column_group<byte> channel_pressure_group;
+        column_group<std::uint16_t> pitch_group;
+        column_group<std::chrono::microseconds> tempo_group;
+        column_group<meta::time_signature> time_signature_group;
+        column_group<meta::key_signature> key_signature_group;
+        column_group<meta::smpte_offset> smpte_group;
+        column_group<std::string> text_group;
+    };
+}
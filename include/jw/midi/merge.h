@@ -0,0 +1,108 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    struct epoll_reactor;
+
+    // Merges messages from multiple input streams into a single stream,
+    // ordered by time stamp.  All sources are polled from one thread via the
+    // non-blocking try_extract().  Running status and partially received
+    // messages are kept per source, since these are stored in each istream.
+    //
+    // Messages are held back for at most 'window' after their time stamp, so
+    // that messages from other sources which arrived earlier but were polled
+    // later can be ordered before them.  Realtime messages are never held
+    // back, and are returned before any other pending message.
+    //
+    // get() sleeps until input arrives.  Sources whose rdbuf() is an
+    // fd_streambuf are waited on with epoll, and wake it as soon as data is
+    // available.  If any other source is active, input is polled at
+    // 'poll_interval' instead.
+    //
+    // This class is not thread-safe.
+    struct input_merger
+    {
+        struct merged_message
+        {
+            std::size_t source;
+            message msg;
+        };
+
+        explicit input_merger(clock::duration window = { }, clock::duration poll_interval = std::chrono::microseconds { 100 });
+        ~input_merger();
+        input_merger(input_merger&&) noexcept;
+
+        // Add an input stream, which must remain valid while it is in use.
+        // Returns the index by which this source is identified.
+        std::size_t add(std::istream& in);
+
+        // Check if the given source has not reached end-of-file or an
+        // unrecoverable error.
+        bool active(std::size_t source) const noexcept { return sources[source].active; }
+        std::size_t num_active() const noexcept { return active_sources; }
+
+        // Number of invalid or interrupted messages received on the given
+        // source.
+        std::size_t errors(std::size_t source) const noexcept { return sources[source].errors; }
+
+        // Read all available messages from every source.  At most
+        // 'max_per_source' messages are read from each, so that a busy source
+        // can not delay the others indefinitely.  Returns the number of
+        // messages received.
+        std::size_t poll(std::size_t max_per_source = 16);
+
+        // Return the next message, or nothing if no message is due yet.  This
+        // does not poll the sources.
+        std::optional<merged_message> try_get();
+
+        // Wait until a message is due, and return it.  If all sources are
+        // inactive and no messages are left, returns nothing.
+        std::optional<merged_message> get();
+
+        // Remaining number of messages pending.
+        std::size_t size() const noexcept { return realtime_queue.size() + heap.size(); }
+
+    private:
+        struct source
+        {
+            std::istream* stream;
+            std::size_t errors;
+            int fd;             // -1 if not an fd_streambuf.
+            bool active;
+        };
+
+        struct entry
+        {
+            std::uint64_t sequence;
+            merged_message msg;
+        };
+
+        static bool later(const entry& a, const entry& b) noexcept
+        {
+            if (a.msg.msg.time != b.msg.msg.time) return a.msg.msg.time > b.msg.msg.time;
+            return a.sequence > b.sequence;
+        }
+
+        void deactivate(source& src);
+        void wait();
+
+        const clock::duration window;
+        const clock::duration poll_interval;
+        std::vector<source> sources;
+        std::size_t active_sources { 0 };
+        std::size_t polled_sources { 0 };   // Active sources without fd.
+        bool backlog { false };             // Some source may have more input.
+        std::unique_ptr<epoll_reactor> reactor;
+        std::deque<merged_message> realtime_queue;
+        std::vector<entry> heap;
+        std::uint64_t sequence { 0 };
+    };
+}
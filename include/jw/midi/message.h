@@ -253,6 +253,24 @@ namespace jw::midi
     // available yet.
     message try_extract(std::istream& in);
 
+    // Result of the non-throwing extract() and try_extract() overloads.
+    enum class extract_status
+    {
+        ok,
+        would_block,        // Not enough bytes available yet.
+        end_of_file,
+        invalid_status,     // Received an invalid status byte.  Running status is cleared.
+        unexpected_status,  // Message was interrupted by a status byte, which starts the next message.
+        stream_error        // Stream is not good, or the streambuf threw an exception.
+    };
+
+    // Non-throwing versions of extract() and try_extract().  Errors are
+    // reported via the return value, and the stream state is not modified.
+    // For any message other than sysex, these do not allocate memory (except
+    // on the very first call for a given stream).
+    extract_status extract(std::istream& in, message& out);
+    extract_status try_extract(std::istream& in, message& out);
+
     // Clear running status on an ostream, so that the next transmitted
     // message will include the status byte.  This is an IO manipulator, it
     // may be invoked via stream operator <<.
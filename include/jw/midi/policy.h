@@ -0,0 +1,142 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <concepts>
+#include <jw/midi/message.h>
+#include <jw/midi/statistics.h>
+#include <jw/midi/detail/stream.h>
+
+namespace jw::midi
+{
+    // Per-stream replacement for the settings in jwmidi_config.h.  The
+    // stream functions below take a policy as template parameter, and are
+    // specialised for it at compile time.  This way, one program can use
+    // locked streams next to unlocked ones, each with its own clock.  See
+    // jwmidi_config.h for the meaning of each setting.  Any type with the
+    // same members may be used as policy.
+    template<typename RxMutex = config::rx_mutex, typename TxMutex = config::tx_mutex, typename Clock = config::clock,
+             bool RdbufNeverChanges = config::rdbuf_never_changes, bool OptimizeNoteOff = config::optimize_note_off>
+    struct stream_policy
+    {
+        using rx_mutex = RxMutex;
+        using tx_mutex = TxMutex;
+        using clock = Clock;
+        static constexpr bool rdbuf_never_changes = RdbufNeverChanges;
+        static constexpr bool optimize_note_off = OptimizeNoteOff;
+    };
+
+    // Policy used by the non-template stream functions.
+    using default_policy = stream_policy<>;
+
+    // For streams that are only accessed from a single thread.
+    using unlocked_policy = stream_policy<config::dummy_mutex, config::dummy_mutex>;
+
+    template<typename P>
+    concept is_stream_policy = requires
+    {
+        typename P::rx_mutex;
+        typename P::tx_mutex;
+        typename P::clock;
+        { P::rdbuf_never_changes } -> std::convertible_to<bool>;
+        { P::optimize_note_off } -> std::convertible_to<bool>;
+    } and std::chrono::is_clock_v<typename P::clock>;
+
+    // Message type produced by reading from a stream with policy P.
+    template<is_stream_policy P>
+    using policy_message = timed_message<typename P::clock::time_point>;
+
+    // Policy-specific versions of the stream functions in message.h,
+    // encode.h and statistics.h.  Stream state (running status, partially
+    // received messages, statistics) is kept separately for each policy, so
+    // a given stream must always be used with the same policy.  The
+    // non-template versions use default_policy.
+    template<is_stream_policy P>
+    inline void emit(std::ostream& out, const untimed_message& msg)
+    {
+        detail::midi_out<P> { out }.emit(msg);
+    }
+
+    template<is_stream_policy P>
+    inline void emit_bytes(std::ostream& out, std::span<const byte> data)
+    {
+        detail::midi_out<P> { out }.emit(data);
+    }
+
+    template<is_stream_policy P>
+    inline policy_message<P> extract(std::istream& in)
+    {
+        return detail::do_extract<P, false>(in);
+    }
+
+    template<is_stream_policy P>
+    inline policy_message<P> try_extract(std::istream& in)
+    {
+        return detail::do_extract<P, true>(in);
+    }
+
+    template<is_stream_policy P>
+    inline extract_status extract(std::istream& in, policy_message<P>& out)
+    {
+        return detail::do_extract_nothrow<P, false>(in, out);
+    }
+
+    template<is_stream_policy P>
+    inline extract_status try_extract(std::istream& in, policy_message<P>& out)
+    {
+        return detail::do_extract_nothrow<P, true>(in, out);
+    }
+
+    template<is_stream_policy P>
+    inline std::ostream& clear_status(std::ostream& stream)
+    {
+        auto& tx = detail::tx_state<P>(stream);
+        std::unique_lock lock { tx.mutex };
+        tx.last_status = 0;
+        return stream;
+    }
+
+    template<is_stream_policy P>
+    inline istream_statistics rx_statistics(std::istream& stream)
+    {
+        const auto& c = detail::rx_state<P>(stream).stats;
+        return
+        {
+            c.channel_messages.load(), c.system_messages.load(), c.realtime_messages.load(),
+            c.bytes.load(), c.running_status.load(), c.errors.load(), c.resyncs.load(),
+            c.partial_waits.load(), c.latency.load()
+        };
+    }
+
+    template<is_stream_policy P>
+    inline ostream_statistics tx_statistics(std::ostream& stream)
+    {
+        const auto& c = detail::tx_state<P>(stream).stats;
+        return
+        {
+            c.channel_messages.load(), c.system_messages.load(), c.realtime_messages.load(),
+            c.bytes.load(), c.running_status.load(), c.realtime_bytes.load(), c.errors.load(),
+            c.latency.load()
+        };
+    }
+
+    template<is_stream_policy P>
+    inline void reset_statistics(std::istream& stream)
+    {
+        auto& c = detail::rx_state<P>(stream).stats;
+        for (auto* i : { &c.channel_messages, &c.system_messages, &c.realtime_messages, &c.bytes,
+                         &c.running_status, &c.errors, &c.resyncs, &c.partial_waits })
+            i->reset();
+        c.latency.reset();
+    }
+
+    template<is_stream_policy P>
+    inline void reset_statistics(std::ostream& stream)
+    {
+        auto& c = detail::tx_state<P>(stream).stats;
+        for (auto* i : { &c.channel_messages, &c.system_messages, &c.realtime_messages, &c.bytes,
+                         &c.running_status, &c.realtime_bytes, &c.errors })
+            i->reset();
+        c.latency.reset();
+    }
+}
@@ -0,0 +1,150 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <vector>
+#include <thread>
+#include <istream>
+#include <ostream>
+#include <streambuf>
+#include <exception>
+#include <condition_variable>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    // Binary log of raw MIDI traffic.  The log starts with a header:
+    //
+    //   "JWML", version (u32 LE), start time (i64 LE, ns since clock epoch)
+    //
+    // followed by records, each consisting of:
+    //
+    //   time since previous record (ns, LEB128), length (LEB128), bytes
+    //
+    // Records contain bytes exactly as received, including interleaved
+    // realtime bytes and running status.
+    inline constexpr std::uint32_t log_version = 1;
+
+    // Append-only log writer.  Records are collected in a buffer.  When it
+    // is full, it is swapped with a second, preallocated buffer, and written
+    // out by a background thread, so that the receiving thread does not
+    // allocate memory or wait for the output stream.  If the background
+    // thread falls behind, the buffer grows instead.  flush() writes out all
+    // records and waits until done.  Errors from the output stream are
+    // rethrown by flush().
+    //
+    // A log with no records is empty, without a header.
+    struct log_writer
+    {
+        explicit log_writer(std::ostream& out, std::size_t buffer_size = 64 << 10);
+        ~log_writer();
+
+        log_writer(const log_writer&) = delete;
+        log_writer& operator=(const log_writer&) = delete;
+
+        void record(clock::time_point time, std::span<const byte> data);
+        void flush();
+
+    private:
+        void put_varint(std::uint64_t value);
+        void start_write();
+        void run();
+
+        std::ostream& out;
+        const std::size_t size;
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable done_cv;
+        config::tx_mutex output_mutex;
+        std::vector<byte> buffer;       // Being filled.
+        std::vector<byte> spare;        // Being written, if 'writing'.
+        std::exception_ptr error;
+        std::int64_t last_time { };
+        bool started { false };
+        bool writing { false };
+        bool quit { false };
+        std::thread thread;
+    };
+
+    // Wraps the streambuf of a MIDI input stream, and records all bytes read
+    // from it to a log.  Bytes are timestamped when they are read from the
+    // underlying streambuf.  in_avail() is forwarded, so this works with
+    // try_extract().
+    //
+    //   capture_streambuf capture { in.rdbuf(), log };
+    //   in.rdbuf(&capture);
+    struct capture_streambuf final : std::streambuf
+    {
+        capture_streambuf(std::streambuf* source, log_writer& log, std::size_t buffer_size = 256);
+
+        std::streambuf* source() const noexcept { return src; }
+
+    protected:
+        virtual int_type underflow() override;
+        virtual std::streamsize showmanyc() override;
+
+    private:
+        std::streambuf* const src;
+        log_writer& log;
+        std::vector<char_type> buf;
+    };
+
+    struct log_record
+    {
+        clock::time_point time;
+        std::span<const byte> data;     // Valid until the next call to next().
+    };
+
+    // Sequential reader for a log created by log_writer.
+    struct log_reader
+    {
+        explicit log_reader(std::istream& in);
+
+        // Read the next record.  Returns false at end of log.  Throws
+        // io::failure if the log is corrupt.
+        bool next(log_record& out);
+
+        clock::time_point start_time() const noexcept { return start; }
+
+    private:
+        std::uint64_t get_varint();
+
+        std::istream& in;
+        clock::time_point start;
+        clock::time_point last;
+        std::vector<byte> buf;
+    };
+
+    // Replays a log as an input streambuf.  With original timing, each
+    // record becomes available at the same offset from the start of replay
+    // as it was recorded, and in_avail() returns 0 until then.  Otherwise,
+    // all data is available immediately, which is useful for benchmarking
+    // the decoder on real captures.
+    struct replay_streambuf final : std::streambuf
+    {
+        enum mode_t
+        {
+            original_timing,
+            as_fast_as_possible
+        };
+
+        explicit replay_streambuf(std::istream& log, mode_t mode = original_timing);
+
+    protected:
+        virtual int_type underflow() override;
+        virtual std::streamsize showmanyc() override;
+
+    private:
+        bool load();
+        clock::time_point due() const noexcept { return replay_start + (pending.time - reader.start_time()); }
+
+        log_reader reader;
+        const mode_t mode;
+        log_record pending { };
+        bool have_pending { false };
+        bool end { false };
+        clock::time_point replay_start;
+        std::vector<char_type> buf;
+    };
+}
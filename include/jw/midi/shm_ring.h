@@ -0,0 +1,104 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#if __has_include(<linux/futex.h>) and __has_include(<sys/mman.h>)
+#include <span>
+#include <string>
+#include <chrono>
+#include <jw/io/realtime_streambuf.h>
+#include <jw/midi/message.h>
+
+namespace jw::midi
+{
+    struct shm_ring_header;
+
+    // Single-producer, single-consumer byte ring in POSIX shared memory, for
+    // passing MIDI data between processes.  One process creates the ring,
+    // the other opens it by name.  Exactly one side may write, and the other
+    // may read.
+    //
+    // Next to the main ring, there is a small priority lane for realtime
+    // bytes, which the reader services first.
+    //
+    // Readers and writers only make a system call (futex) when they have to
+    // sleep, or when the other side is sleeping.  In the steady state, no
+    // system calls are made at all.  System errors are thrown as
+    // std::system_error.
+    struct shm_ring
+    {
+        // Create a new ring, replacing any existing one with the same name.
+        // The name is removed again when this object is destroyed.
+        // Capacities are rounded up to a power of two.
+        static shm_ring create(const std::string& name, std::size_t capacity = 4096, std::size_t realtime_capacity = 64);
+
+        // Open a ring created by another process.
+        static shm_ring open(const std::string& name);
+
+        ~shm_ring();
+        shm_ring(shm_ring&& other) noexcept;
+        shm_ring& operator=(shm_ring&& other) noexcept;
+        shm_ring(const shm_ring&) = delete;
+        shm_ring& operator=(const shm_ring&) = delete;
+
+        // Producer interface.  write() blocks until all data is written.
+        // try_write() writes as much as fits, and returns the number of
+        // bytes written.  close() signals end-of-file to the reader.
+        void write(std::span<const byte> data);
+        std::size_t try_write(std::span<const byte> data);
+        void put_realtime(byte b);
+        void close();
+
+        // Consumer interface.  peek() returns the contiguous readable data at
+        // the front of the ring, in place.  Call consume() when done with
+        // it.  available() returns -1 when the ring is closed and empty.
+        std::span<const byte> peek() const noexcept;
+        void consume(std::size_t n) noexcept;
+        std::ptrdiff_t available() const noexcept;
+        int get_realtime() noexcept;    // -1 if none.
+
+        // Block until data is available, or the ring is closed.  Returns
+        // false on timeout.
+        bool wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max());
+
+    private:
+        shm_ring(const std::string& name, bool creator, std::size_t capacity, std::size_t realtime_capacity);
+        void release() noexcept;
+        void wake_reader() noexcept;
+
+        shm_ring_header* hdr { nullptr };
+        byte* data { nullptr };
+        byte* rt_data { nullptr };
+        std::size_t map_size { 0 };
+        std::string name;
+        bool owner { false };
+    };
+
+    // Streambuf adapter for shm_ring.  Either ring may be null, for
+    // unidirectional use.  Incoming data is read directly from the ring,
+    // without copying.  Outgoing data is written directly to the ring, so
+    // there is no buffer to flush.  Realtime bytes are sent through the
+    // priority lane, and received ahead of any queued data.
+    struct shm_streambuf final : io::realtime_streambuf
+    {
+        shm_streambuf(shm_ring* rx, shm_ring* tx);
+        virtual ~shm_streambuf();
+
+        virtual void put_realtime(char_type c) override;
+
+    protected:
+        virtual int_type underflow() override;
+        virtual std::streamsize showmanyc() override;
+        virtual int_type overflow(int_type c) override;
+        virtual std::streamsize xsputn(const char_type* s, std::streamsize n) override;
+
+    private:
+        void release_segment() noexcept;
+
+        shm_ring* const rx;
+        shm_ring* const tx;
+        std::size_t segment { 0 };      // Bytes of rx ring exposed in get area.
+        char_type rt_byte;
+    };
+}
+#endif
@@ -0,0 +1,73 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <numeric>
+
+namespace jw::midi
+{
+    // Latency histogram with logarithmic buckets.  Bucket i counts samples
+    // between 2^i and 2^(i+1) nanoseconds, bucket 0 also includes zero.
+    struct latency_histogram
+    {
+        static constexpr std::size_t num_buckets = 32;
+        std::array<std::uint64_t, num_buckets> buckets { };
+
+        std::uint64_t samples() const noexcept { return std::accumulate(buckets.begin(), buckets.end(), std::uint64_t { 0 }); }
+
+        // Upper bound of the bucket containing the given percentile (0 - 1).
+        std::chrono::nanoseconds percentile(double p) const noexcept
+        {
+            const std::uint64_t n = samples();
+            const std::uint64_t want = p * n;
+            std::uint64_t seen = 0;
+            for (unsigned i = 0; i < num_buckets; ++i)
+            {
+                seen += buckets[i];
+                if (seen > want or seen == n) return std::chrono::nanoseconds { std::int64_t { 2 } << i };
+            }
+            return std::chrono::nanoseconds { std::int64_t { 2 } << (num_buckets - 1) };
+        }
+    };
+
+    // Snapshot of the statistics collected on an input stream.
+    struct istream_statistics
+    {
+        std::uint64_t channel_messages;
+        std::uint64_t system_messages;
+        std::uint64_t realtime_messages;
+        std::uint64_t bytes;                // Total bytes consumed from the streambuf.
+        std::uint64_t running_status;       // Messages received without status byte.
+        std::uint64_t errors;               // Invalid or unexpected status bytes.
+        std::uint64_t resyncs;              // Bytes discarded while waiting for a status byte.
+        std::uint64_t partial_waits;        // try_extract() calls that left a message incomplete.
+        latency_histogram latency;          // From arrival of the first byte, to returning the message.
+    };
+
+    // Snapshot of the statistics collected on an output stream.
+    struct ostream_statistics
+    {
+        std::uint64_t channel_messages;
+        std::uint64_t system_messages;
+        std::uint64_t realtime_messages;
+        std::uint64_t bytes;                // Total bytes written to the streambuf.
+        std::uint64_t running_status;       // Status bytes omitted due to running status.
+        std::uint64_t realtime_bytes;       // Bytes sent via realtime_streambuf::put_realtime().
+        std::uint64_t errors;               // Exceptions thrown by the streambuf.
+        latency_histogram latency;          // From calling emit(), to completion of sputn().
+    };
+
+    // Retrieve a snapshot of the statistics collected on the given stream.
+    // These are only collected if enabled in the configuration header,
+    // otherwise all values are zero.
+    istream_statistics rx_statistics(std::istream&);
+    ostream_statistics tx_statistics(std::ostream&);
+
+    // Reset all statistics on the given stream to zero.
+    void reset_statistics(std::istream&);
+    void reset_statistics(std::ostream&);
+}
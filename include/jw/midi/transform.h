@@ -0,0 +1,91 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <span>
+#include <array>
+#include <vector>
+#include <variant>
+#include <stdexcept>
+#include <jw/midi/file.h>
+
+namespace jw::midi
+{
+    // A sequence of operations to apply to every track of a file.  Tracks
+    // are processed in parallel.  Operations are applied in the order they
+    // are added.  The 'channels' parameters are bit masks, where bit n
+    // selects channel n.
+    struct transform
+    {
+        static constexpr std::uint16_t all_channels = 0xffff;
+
+        // Shift all notes and key pressure messages by the given number of
+        // semitones.  Messages that would fall outside 0 - 127 are removed.
+        transform& transpose(int semitones, std::uint16_t channels = all_channels)
+        {
+            steps.emplace_back(transpose_step { semitones, channels });
+            return *this;
+        }
+
+        // Multiply note-on velocities by the given factor.  The result is
+        // clamped to 1 - 127, so that notes are never turned off.
+        transform& scale_velocity(float factor, std::uint16_t channels = all_channels)
+        {
+            steps.emplace_back(velocity_step { factor, channels });
+            return *this;
+        }
+
+        // Move messages on channel n to channel map[n].  This also applies to
+        // the channel prefix of meta messages.
+        transform& remap_channels(const std::array<byte, 16>& map)
+        {
+            steps.emplace_back(remap_step { map });
+            return *this;
+        }
+
+        // Multiply all time stamps by the given factor.  Messages that end up
+        // on the same tick keep their original order.
+        transform& stretch(double factor)
+        {
+            if (not (factor >= 0)) throw std::invalid_argument { "negative stretch factor" };
+            steps.emplace_back(stretch_step { factor });
+            return *this;
+        }
+
+        // Move note-on messages towards the nearest multiple of 'grid' ticks.
+        // A strength of 1 moves notes onto the grid, smaller values move
+        // them part of the way.  Note-off messages are moved along with their
+        // note-on, so that note durations are preserved.  Where a note would
+        // now overlap the next note on the same key, it is shortened.  On
+        // the same tick, note-offs of earlier notes come before note-ons.
+        // Other messages are not moved.
+        transform& quantize(std::uint64_t grid, double strength = 1.0, std::uint16_t channels = all_channels)
+        {
+            steps.emplace_back(quantize_step { grid, strength, channels });
+            return *this;
+        }
+
+        // Apply all operations to a single track, on the calling thread.
+        void apply(file::track& track) const;
+
+        // Apply all operations to every track in the given file(s), on the
+        // specified number of threads.  Zero uses all available cores.
+        void apply(file& f, unsigned threads = 0) const { apply(std::span<file> { &f, 1 }, threads); }
+        void apply(std::span<file> files, unsigned threads = 0) const;
+
+        void operator()(file& f, unsigned threads = 0) const { apply(f, threads); }
+        void operator()(std::span<file> files, unsigned threads = 0) const { apply(files, threads); }
+
+    private:
+        struct transpose_step { int semitones; std::uint16_t channels; };
+        struct velocity_step { float factor; std::uint16_t channels; };
+        struct remap_step { std::array<byte, 16> map; };
+        struct stretch_step { double factor; };
+        struct quantize_step { std::uint64_t grid; double strength; std::uint16_t channels; };
+
+        using step = std::variant<transpose_step, velocity_step, remap_step, stretch_step, quantize_step>;
+        std::vector<step> steps;
+
+        friend struct transform_visitor;
+    };
+}
@@ -0,0 +1,118 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#pragma once
+#include <array>
+#include <span>
+#include <vector>
+#include <cstdint>
+#include <jw/midi/message.h>
+
+// MIDI 2.0 Universal MIDI Packet format, and translation to and from MIDI 1.0
+// messages.
+
+namespace jw::midi::ump
+{
+    // Number of 32-bit words in a packet, indexed by message type.
+    inline constexpr std::array<std::uint8_t, 16> packet_words { 1, 1, 1, 2, 2, 4, 1, 1, 2, 2, 2, 3, 3, 4, 3, 4 };
+
+    enum message_type : std::uint8_t
+    {
+        utility = 0x0,
+        system = 0x1,
+        midi1_channel_voice = 0x2,
+        data64 = 0x3,
+        midi2_channel_voice = 0x4,
+        data128 = 0x5,
+        flex_data = 0xd,
+        stream = 0xf
+    };
+
+    // Protocol used when translating channel voice messages to UMP.
+    enum class protocol
+    {
+        midi1,  // Message type 0x2, 7-bit values.
+        midi2   // Message type 0x4, 16-bit velocity and 32-bit controllers.
+    };
+
+    struct packet
+    {
+        std::array<std::uint32_t, 4> word { };
+
+        constexpr unsigned type() const noexcept { return word[0] >> 28; }
+        constexpr unsigned group() const noexcept { return (word[0] >> 24) & 0x0f; }
+        constexpr std::size_t size() const noexcept { return packet_words[type()]; }
+        constexpr std::span<const std::uint32_t> words() const noexcept { return { word.data(), size() }; }
+    };
+
+    // Scale a value up or down to a different bit width, using the
+    // min-center-max algorithm specified in the UMP specification.  This
+    // preserves the minimum, center and maximum values exactly.
+    constexpr std::uint32_t scale_up(std::uint32_t value, unsigned src_bits, unsigned dst_bits) noexcept
+    {
+        const unsigned scale_bits = dst_bits - src_bits;
+        std::uint64_t result = std::uint64_t { value } << scale_bits;
+        const std::uint32_t center = 1u << (src_bits - 1);
+        if (value <= center) return result;
+        const unsigned repeat_bits = src_bits - 1;
+        std::uint64_t repeat = value & ((1u << repeat_bits) - 1);
+        if (scale_bits > repeat_bits) repeat <<= scale_bits - repeat_bits;
+        else repeat >>= repeat_bits - scale_bits;
+        while (repeat != 0)
+        {
+            result |= repeat;
+            repeat >>= repeat_bits;
+        }
+        return result;
+    }
+
+    constexpr std::uint32_t scale_down(std::uint32_t value, unsigned src_bits, unsigned dst_bits) noexcept
+    {
+        return value >> (src_bits - dst_bits);
+    }
+
+    // Split a buffer of words into packets, invoking a function for each.
+    // Returns the number of words consumed, which may be less than the
+    // buffer size if it ends with an incomplete packet.
+    template<typename F>
+    std::size_t for_each_packet(std::span<const std::uint32_t> words, F&& func)
+    {
+        std::size_t i = 0;
+        while (i < words.size())
+        {
+            const std::size_t n = packet_words[words[i] >> 28];
+            if (i + n > words.size()) break;
+            packet p;
+            for (std::size_t j = 0; j < n; ++j) p.word[j] = words[i + j];
+            func(p);
+            i += n;
+        }
+        return i;
+    }
+
+    // Translate a message to UMP, appending the resulting words.  Sysex
+    // messages are split into sysex7 packets.  Meta messages are ignored.
+    void encode(const untimed_message& msg, std::vector<std::uint32_t>& out, unsigned group = 0, protocol p = protocol::midi2);
+    void encode(std::span<const untimed_message> msgs, std::vector<std::uint32_t>& out, unsigned group = 0, protocol p = protocol::midi2);
+
+    // Translates UMP to MIDI 1.0 messages.  Sysex7 packets are reassembled
+    // per group.  Packet types without a MIDI 1.0 equivalent are ignored.
+    // MIDI 2.0 program change with bank select, and (N)RPN messages, expand
+    // into multiple control change messages.
+    struct decoder
+    {
+        // Translate one packet, appending any resulting messages.
+        void decode(const packet& p, std::vector<untimed_message>& out);
+
+        // Translate a buffer of words.  Returns the number of words
+        // consumed, see for_each_packet().
+        std::size_t decode(std::span<const std::uint32_t> words, std::vector<untimed_message>& out);
+
+        // Translate a buffer of words directly to a MIDI 1.0 byte stream,
+        // without constructing messages.  Running status is not applied.
+        std::size_t decode(std::span<const std::uint32_t> words, std::vector<byte>& out);
+
+    private:
+        std::array<std::vector<byte>, 16> pending_sysex { };
+    };
+}
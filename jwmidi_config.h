@@ -10,6 +10,9 @@
 
 namespace jw::midi::config
 {
+    // These settings form the default_policy for stream operations.  They
+    // may be overridden per stream with the templates in policy.h.
+
     // Use this if you don't intend to read from / write to the same iostream
     // from multiple threads.
     struct dummy_mutex
@@ -47,6 +50,11 @@ namespace jw::midi::config
     // If set to false, the optimization is only applied when the note-off
     // velocity is exactly 64.
     constexpr bool optimize_note_off = true;
+
+    // Collect per-stream statistics, which can be retrieved with
+    // rx_statistics() and tx_statistics().  Counters are updated with relaxed
+    // atomic operations.  When disabled, no counting code is generated at all.
+    constexpr bool collect_statistics = false;
 }
 
 #undef JWDPMI
@@ -0,0 +1,101 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/async.h>
+#if __has_include(<sys/epoll.h>)
+#include <stdexcept>
+#include <poll.h>
+#endif
+
+namespace jw::midi
+{
+    task<message> async_extract(async_stream& s)
+    {
+        while (true)
+        {
+            message msg;
+            switch (try_extract(s.stream, msg))
+            {
+            case extract_status::ok:
+                co_return msg;
+            case extract_status::would_block:
+                co_await s.input_ready();
+                continue;
+            case extract_status::invalid_status:
+            case extract_status::unexpected_status:
+                continue;
+            case extract_status::end_of_file:
+            case extract_status::stream_error:
+                co_return message { };
+            }
+        }
+    }
+
+    task<void> async_emit(async_stream& s, untimed_message msg)
+    {
+        co_await s.output_ready();
+        emit(s.stream, msg);
+        s.stream.flush();
+    }
+
+#   if __has_include(<sys/epoll.h>)
+    static int checked_fd(const async_stream& s)
+    {
+        if (s.native_handle < 0) throw std::invalid_argument { "async_stream has no file descriptor" };
+        return s.native_handle;
+    }
+
+    static bool poll_now(const async_stream& s, short events)
+    {
+        pollfd p { checked_fd(s), events, 0 };
+        return ::poll(&p, 1, 0) > 0 and (p.revents & (events | POLLHUP | POLLERR)) != 0;
+    }
+
+    bool epoll_executor::is_input_ready(async_stream& s) { return poll_now(s, POLLIN); }
+    bool epoll_executor::is_output_ready(async_stream& s) { return poll_now(s, POLLOUT); }
+
+    void epoll_executor::await_input(async_stream& s, std::coroutine_handle<> h)
+    {
+        checked_fd(s);
+        fds[s.native_handle].input = h;
+        update(s.native_handle);
+    }
+
+    void epoll_executor::await_output(async_stream& s, std::coroutine_handle<> h)
+    {
+        checked_fd(s);
+        fds[s.native_handle].output = h;
+        update(s.native_handle);
+    }
+
+    void epoll_executor::update(int fd)
+    {
+        auto i = fds.find(fd);
+        std::uint32_t events = 0;
+        if (i != fds.end())
+        {
+            if (i->second.input) events |= EPOLLIN;
+            if (i->second.output) events |= EPOLLOUT;
+        }
+        if (events == 0)
+        {
+            if (i != fds.end()) fds.erase(i);
+            reactor.unwatch(fd);
+            return;
+        }
+        reactor.watch(fd, [this, fd](std::uint32_t e) { dispatch(fd, e); }, events);
+    }
+
+    void epoll_executor::dispatch(int fd, std::uint32_t events)
+    {
+        constexpr std::uint32_t error = EPOLLHUP | EPOLLERR;
+        auto& w = fds[fd];
+        std::coroutine_handle<> input { }, output { };
+        if ((events & (EPOLLIN | error)) != 0) std::swap(input, w.input);
+        if ((events & (EPOLLOUT | error)) != 0) std::swap(output, w.output);
+        update(fd);
+        if (input) input.resume();
+        if (output) output.resume();
+    }
+#   endif
+}
@@ -0,0 +1,356 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <bit>
+#include <cstring>
+#include <algorithm>
+#include <system_error>
+#include <jw/midi/cache.h>
+#include <jw/midi/encode.h>
+#include "codec.h"
+
+#if __has_include(<sys/mman.h>) and __has_include(<unistd.h>)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define JWMIDI_HAVE_MMAP
+#endif
+
+namespace jw::midi
+{
+    static constexpr bool little_endian = std::endian::native == std::endian::little;
+
+    static std::uint16_t encode_division(const decltype(file::time_division)& division) noexcept
+    {
+        struct
+        {
+            std::uint16_t operator()(unsigned ticks) { return ticks & 0x7fff; }
+            std::uint16_t operator()(const file::smpte_format& smpte)
+            {
+                const auto fps = static_cast<std::uint8_t>(-static_cast<std::int8_t>(smpte.frames_per_second));
+                return (fps << 8) | smpte.clocks_per_frame;
+            }
+        } visitor;
+        return std::visit(visitor, division);
+    }
+
+    std::variant<unsigned, file::smpte_format> cache_view::time_division() const noexcept
+    {
+        const split_uint16_t division = hdr->division;
+        if ((division & 0x8000) == 0) return { static_cast<unsigned>(division) };
+        return file::smpte_format { static_cast<unsigned>(-static_cast<int8_t>(division.hi)), division.lo };
+    }
+
+    cache_view::cache_view(std::span<const byte> data) noexcept
+    {
+        if constexpr (not little_endian) return;
+        if (data.size() < sizeof(cache_header)) return;
+        if (reinterpret_cast<std::uintptr_t>(data.data()) % alignof(std::uint64_t) != 0) return;
+
+        auto* const h = reinterpret_cast<const cache_header*>(data.data());
+        if (h->magic != cache_magic) return;
+        if (h->version != cache_version) return;
+
+        // Check sizes one by one, to avoid overflow.
+        std::size_t pos = sizeof(cache_header);
+        auto take = [&](std::uint64_t n, std::size_t size) -> const byte*
+        {
+            if (n > (data.size() - pos) / size) return nullptr;
+            auto* const p = data.data() + pos;
+            pos += n * size;
+            return p;
+        };
+
+        auto* const t = take(h->num_tracks, sizeof(cache_track));
+        if (t == nullptr) return;
+        auto* const m = take(h->num_tempos, sizeof(cache_tempo));
+        if (m == nullptr) return;
+        auto* const e = take(h->num_events, sizeof(cache_event));
+        if (e == nullptr) return;
+        if (data.size() - pos != h->payload_size) return;
+
+        std::span<const cache_track> tracks { reinterpret_cast<const cache_track*>(t), h->num_tracks };
+        std::uint64_t next = 0;
+        for (const auto& i : tracks)
+        {
+            if (i.first_event != next) return;
+            if (i.num_events > h->num_events - next) return;
+            next += i.num_events;
+        }
+        if (next != h->num_events) return;
+
+        hdr = h;
+        trk = tracks;
+        tempo = { reinterpret_cast<const cache_tempo*>(m), h->num_tempos };
+        evt = { reinterpret_cast<const cache_event*>(e), h->num_events };
+        payload = data.subspan(pos);
+    }
+
+    std::span<const byte> cache_view::bytes(const cache_event& e) const
+    {
+        if (e.offset > payload.size() or e.size > payload.size() - e.offset)
+            throw io::failure { "event out of bounds" };
+        return payload.subspan(e.offset, e.size);
+    }
+
+    untimed_message cache_view::message(const cache_event& e) const
+    {
+        const auto b = bytes(e);
+        if (b.empty()) throw io::failure { "empty event" };
+        switch (e.kind)
+        {
+        case cache_event::channel:
+        case cache_event::system:
+            if (b[0] == 0xf0 or not is_status(b[0]) or is_realtime(b[0]))
+                throw io::failure { "invalid status byte" };
+            if (b.size() != msg_size(b[0]) + 1) throw io::failure { "incorrect message size" };
+            return make_msg(b[0], b.data() + 1);
+
+        case cache_event::realtime:
+            if (b.size() != 1 or not is_realtime(b[0])) throw io::failure { "invalid status byte" };
+            return realtime_msg(b[0]);
+
+        case cache_event::sysex:
+            return sysex { { b.begin(), b.end() } };
+
+        case cache_event::meta:
+            {
+                decltype(meta::channel) ch { };
+                if (e.meta_channel != 0xff)
+                {
+                    if (e.meta_channel > 15) throw io::failure { "invalid channel number" };
+                    ch = e.meta_channel;
+                }
+                chunk_reader buf { b.data() + 1, b.data() + b.size() };
+                return read_meta(b[0], b.size() - 1, buf, ch);
+            }
+
+        default:
+            throw io::failure { "invalid event type" };
+        }
+    }
+
+    file cache_view::to_file() const
+    {
+        file output { };
+        if (not valid()) return output;
+        output.asynchronous_tracks = asynchronous_tracks();
+        output.time_division = time_division();
+        output.tracks.resize(trk.size());
+        for (unsigned i = 0; i < trk.size(); ++i)
+        {
+            auto& track = output.tracks[i];
+            for (const auto& e : events(i))
+            {
+                auto& pos = track.emplace_hint(track.end(), std::piecewise_construct, std::make_tuple(e.tick), std::make_tuple())->second;
+                pos.push_back(message(e));
+            }
+        }
+        return output;
+    }
+
+    bool cache_view::matches(const std::filesystem::path& source, bool check_hash) const
+    {
+        if (not valid()) return false;
+        std::error_code ec;
+        const auto size = std::filesystem::file_size(source, ec);
+        if (ec or not matches(size)) return false;
+        if (not check_hash) return true;
+        std::ifstream in { source, std::ios::in | std::ios::binary };
+        if (not in) return false;
+        return matches(size, source_hash(in));
+    }
+
+    std::uint64_t source_hash(std::istream& in)
+    {
+        std::uint64_t hash = 0xcbf29ce484222325;
+        std::array<char, 0x10000> buf;
+        auto* const rdbuf = in.rdbuf();
+        while (true)
+        {
+            const auto n = rdbuf->sgetn(buf.data(), buf.size());
+            for (std::streamsize i = 0; i < n; ++i)
+            {
+                hash ^= static_cast<byte>(buf[i]);
+                hash *= 0x100000001b3;
+            }
+            if (n < static_cast<std::streamsize>(buf.size())) break;
+        }
+        return hash;
+    }
+
+    struct cache_encoder
+    {
+        std::vector<byte>& payload;
+        cache_event& e;
+
+        void put(std::span<const byte> data) { payload.insert(payload.end(), data.begin(), data.end()); }
+
+        void operator()(std::monostate) { throw io::failure { "invalid message" }; }
+        void operator()(const channel_message& msg) { e.kind = cache_event::channel; put(encode(msg).span()); }
+        void operator()(realtime msg) { e.kind = cache_event::realtime; put(encode(msg).span()); }
+
+        void operator()(const system_message& msg)
+        {
+            if (auto* const s = std::get_if<sysex>(&msg.message))
+            {
+                e.kind = cache_event::sysex;
+                put(s->data);
+            }
+            else
+            {
+                e.kind = cache_event::system;
+                std::visit([this](const auto& m)
+                {
+                    if constexpr (not std::is_same_v<std::remove_cvref_t<decltype(m)>, sysex>)
+                        put(encode(m).span());
+                }, msg.message);
+            }
+        }
+
+        void operator()(const meta_message& msg)
+        {
+            e.kind = cache_event::meta;
+            if (msg->channel) e.meta_channel = *msg->channel;
+            const auto at = payload.size();
+            payload.push_back(0);
+            payload[at] = write_meta(*msg, payload);
+        }
+    };
+
+    void write_cache(std::ostream& out, const file& f, std::uint64_t source_size, std::uint64_t source_hash)
+    {
+        if constexpr (not little_endian) throw io::failure { "unsupported byte order" };
+
+        std::vector<cache_track> tracks;
+        std::vector<cache_tempo> tempos;
+        std::vector<cache_event> events;
+        std::vector<byte> payload;
+
+        tracks.reserve(f.tracks.size());
+        for (unsigned i = 0; i < f.tracks.size(); ++i)
+        {
+            cache_track t { events.size(), 0 };
+            for (const auto& [tick, msgs] : f.tracks[i])
+            {
+                for (const auto& msg : msgs)
+                {
+                    auto& e = events.emplace_back(cache_event { tick, payload.size(), 0, cache_event::channel, 0xff, 0 });
+                    std::visit(cache_encoder { payload, e }, msg.category);
+                    e.size = payload.size() - e.offset;
+
+                    if (msg.is_meta_message())
+                        if (auto* const tempo = std::get_if<meta::tempo_change>(&std::get<meta_message>(msg.category)->message))
+                            tempos.push_back({ tick, static_cast<std::uint32_t>(tempo->quarter_note.count()), i });
+                }
+            }
+            t.num_events = events.size() - t.first_event;
+            tracks.push_back(t);
+        }
+
+        std::stable_sort(tempos.begin(), tempos.end(), [](const auto& a, const auto& b) { return a.tick < b.tick; });
+
+        cache_header h { };
+        h.magic = cache_magic;
+        h.version = cache_version;
+        h.source_size = source_size;
+        h.source_hash = source_hash;
+        h.asynchronous_tracks = f.asynchronous_tracks;
+        h.division = encode_division(f.time_division);
+        h.num_tracks = tracks.size();
+        h.num_tempos = tempos.size();
+        h.num_events = events.size();
+        h.payload_size = payload.size();
+
+        auto write = [&out](const auto* data, std::size_t n)
+        {
+            out.write(reinterpret_cast<const char*>(data), n * sizeof(*data));
+        };
+        write(&h, 1);
+        write(tracks.data(), tracks.size());
+        write(tempos.data(), tempos.size());
+        write(events.data(), events.size());
+        write(payload.data(), payload.size());
+    }
+
+    void build_cache(const std::filesystem::path& source, const std::filesystem::path& cache)
+    {
+        std::ifstream in { source, std::ios::in | std::ios::binary };
+        in.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
+        const auto size = std::filesystem::file_size(source);
+        const auto hash = source_hash(in);
+        in.seekg(0);
+        const file f = file::read(in);
+
+        // Write to a temporary file first, so that readers never see a
+        // partially written cache.
+        auto tmp = cache;
+        tmp += ".tmp";
+        {
+            std::ofstream out { tmp, std::ios::out | std::ios::binary | std::ios::trunc };
+            out.exceptions(std::ios::badbit | std::ios::failbit);
+            write_cache(out, f, size, hash);
+        }
+        std::filesystem::rename(tmp, cache);
+    }
+
+    mapped_cache::mapped_cache(const std::filesystem::path& cache)
+    {
+#       ifdef JWMIDI_HAVE_MMAP
+        const int fd = ::open(cache.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) throw std::system_error { errno, std::system_category(), "open" };
+        struct stat st;
+        if (::fstat(fd, &st) != 0)
+        {
+            const int e = errno;
+            ::close(fd);
+            throw std::system_error { e, std::system_category(), "fstat" };
+        }
+        if (st.st_size > 0)
+        {
+            void* const p = ::mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                const int e = errno;
+                ::close(fd);
+                throw std::system_error { e, std::system_category(), "mmap" };
+            }
+            map = p;
+            map_size = st.st_size;
+        }
+        ::close(fd);
+        static_cast<cache_view&>(*this) = cache_view { { static_cast<const byte*>(map), map_size } };
+#       else
+        std::ifstream in { cache, std::ios::in | std::ios::binary };
+        in.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
+        const std::size_t size = std::filesystem::file_size(cache);
+        buffer.reset(new std::uint64_t[(size + 7) / 8]);
+        in.read(reinterpret_cast<char*>(buffer.get()), size);
+        static_cast<cache_view&>(*this) = cache_view { { reinterpret_cast<const byte*>(buffer.get()), size } };
+#       endif
+    }
+
+    mapped_cache::~mapped_cache()
+    {
+#       ifdef JWMIDI_HAVE_MMAP
+        if (map != nullptr) ::munmap(map, map_size);
+#       endif
+    }
+
+    mapped_cache::mapped_cache(mapped_cache&& other) noexcept
+        : cache_view { other }, map { std::exchange(other.map, nullptr) },
+          map_size { std::exchange(other.map_size, 0) }, buffer { std::move(other.buffer) }
+    {
+        static_cast<cache_view&>(other) = { };
+    }
+
+    mapped_cache& mapped_cache::operator=(mapped_cache&& other) noexcept
+    {
+        std::swap(static_cast<cache_view&>(*this), static_cast<cache_view&>(other));
+        std::swap(map, other.map);
+        std::swap(map_size, other.map_size);
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+}
@@ -0,0 +1,331 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <bit>
+#include <stdexcept>
+#include <jw/midi/clock_generator.h>
+#include "spin.h"
+
+namespace jw::midi
+{
+    static double real_fps(unsigned fps) noexcept
+    {
+        return fps == 29 ? 30000.0 / 1001.0 : fps;
+    }
+
+    struct timecode
+    {
+        unsigned hours, minutes, seconds, frames;
+    };
+
+    // Convert a frame count to hh:mm:ss:ff.  For 29.97 fps, frame numbers
+    // 0 and 1 are skipped at the start of each minute, except every tenth.
+    static timecode to_timecode(std::uint64_t frame, unsigned fps) noexcept
+    {
+        unsigned nominal = fps;
+        if (fps == 29)
+        {
+            nominal = 30;
+            const auto d = frame / 17982;
+            const auto m = frame % 17982;
+            frame += 18 * d + (m > 1 ? 2 * ((m - 2) / 1798) : 0);
+        }
+        timecode tc;
+        tc.frames = frame % nominal;
+        frame /= nominal;
+        tc.seconds = frame % 60;
+        frame /= 60;
+        tc.minutes = frame % 60;
+        frame /= 60;
+        tc.hours = frame % 24;
+        return tc;
+    }
+
+    static byte rate_code(unsigned fps) noexcept
+    {
+        switch (fps)
+        {
+        case 24: return 0;
+        case 25: return 1;
+        case 29: return 2;
+        default: return 3;
+        }
+    }
+
+    static clock_generator::clock::duration to_duration(std::chrono::duration<double, std::nano> d) noexcept
+    {
+        return std::chrono::duration_cast<clock_generator::clock::duration>(d);
+    }
+
+    clock_generator::clock_generator(std::ostream& o, double bpm, std::chrono::nanoseconds spin)
+        : out { o }, spin_time { spin }, tick_interval { 60e9 / (bpm * 24) }
+    {
+        if (not (bpm > 0)) throw std::invalid_argument { "invalid tempo" };
+        thread = std::thread { [this] { run(); } };
+    }
+
+    clock_generator::~clock_generator()
+    {
+        {
+            std::unique_lock lock { mutex };
+            quit = true;
+            ++generation;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void clock_generator::tempo(double bpm)
+    {
+        if (not (bpm > 0)) throw std::invalid_argument { "invalid tempo" };
+        {
+            std::unique_lock lock { mutex };
+            // Re-anchor at the last tick sent, so the next one follows it
+            // after exactly one new interval.
+            if (ticks > 0)
+            {
+                tick_anchor += to_duration(tick_interval * (ticks - 1));
+                ticks = 1;
+            }
+            tick_interval = interval_t { 60e9 / (bpm * 24) };
+            ++generation;
+        }
+        cv.notify_one();
+    }
+
+    double clock_generator::tempo() const
+    {
+        std::unique_lock lock { mutex };
+        return 60e9 / (tick_interval.count() * 24);
+    }
+
+    void clock_generator::enable_mtc(file::smpte_format rate)
+    {
+        switch (rate.frames_per_second)
+        {
+        case 24: case 25: case 29: case 30: break;
+        default: throw std::invalid_argument { "invalid SMPTE frame rate" };
+        }
+        {
+            std::unique_lock lock { mutex };
+            if (mtc_rate) mtc_origin = mtc_frame();
+            else mtc_origin = (song_clocks * tick_interval).count() * 1e-9 * real_fps(rate.frames_per_second);
+            mtc_rate = rate;
+            qf_interval = interval_t { 1e9 / (real_fps(rate.frames_per_second) * 4) };
+            qf_anchor = clock::now();
+            quarter_frames = 0;
+            send_full_frame();
+            ++generation;
+        }
+        cv.notify_one();
+    }
+
+    void clock_generator::disable_mtc()
+    {
+        std::unique_lock lock { mutex };
+        mtc_rate.reset();
+        ++generation;
+    }
+
+    void clock_generator::start()
+    {
+        {
+            std::unique_lock lock { mutex };
+            song_clocks = 0;
+            mtc_origin = 0;
+            quarter_frames = 0;
+            if (mtc_rate) send_full_frame();
+            emit(out, untimed_message { realtime::clock_start });
+            is_running = true;
+            restart_schedule(clock::now());
+        }
+        cv.notify_one();
+    }
+
+    void clock_generator::stop()
+    {
+        std::unique_lock lock { mutex };
+        if (not is_running) return;
+        emit(out, untimed_message { realtime::clock_stop });
+        mtc_origin = mtc_frame();
+        quarter_frames = 0;
+        is_running = false;
+        ++generation;
+    }
+
+    void clock_generator::resume()
+    {
+        {
+            std::unique_lock lock { mutex };
+            if (is_running) return;
+            emit(out, untimed_message { realtime::clock_continue });
+            is_running = true;
+            restart_schedule(clock::now());
+        }
+        cv.notify_one();
+    }
+
+    bool clock_generator::running() const
+    {
+        std::unique_lock lock { mutex };
+        return is_running;
+    }
+
+    void clock_generator::locate(unsigned beats)
+    {
+        beats &= 0x3fff;
+        std::unique_lock lock { mutex };
+        if (is_running)
+        {
+            emit(out, untimed_message { realtime::clock_stop });
+            is_running = false;
+        }
+        song_clocks = beats * 6;
+        emit(out, untimed_message { song_position { { beats & 0x7f, beats >> 7 } } });
+        if (mtc_rate)
+        {
+            mtc_origin = (song_clocks * tick_interval).count() * 1e-9 * real_fps(mtc_rate->frames_per_second);
+            quarter_frames = 0;
+            send_full_frame();
+        }
+        ++generation;
+    }
+
+    std::uint64_t clock_generator::position() const
+    {
+        std::unique_lock lock { mutex };
+        return song_clocks;
+    }
+
+    clock_statistics clock_generator::statistics() const
+    {
+        std::unique_lock lock { mutex };
+        return
+        {
+            num_events, max_lateness,
+            num_events > 0 ? total_lateness / static_cast<std::int64_t>(num_events) : std::chrono::nanoseconds { 0 },
+            lateness
+        };
+    }
+
+    void clock_generator::reset_statistics()
+    {
+        std::unique_lock lock { mutex };
+        num_events = 0;
+        total_lateness = max_lateness = std::chrono::nanoseconds { 0 };
+        lateness = { };
+    }
+
+    std::uint64_t clock_generator::mtc_frame() const noexcept
+    {
+        return mtc_origin + quarter_frames / 4;
+    }
+
+    void clock_generator::restart_schedule(clock::time_point now)
+    {
+        tick_anchor = now;
+        ticks = 0;
+        mtc_origin = mtc_frame();
+        qf_anchor = now;
+        quarter_frames = 0;
+        ++generation;
+    }
+
+    void clock_generator::send_full_frame()
+    {
+        const unsigned fps = mtc_rate->frames_per_second;
+        const auto tc = to_timecode(mtc_frame(), fps);
+        std::vector<byte> data
+        {
+            0xf0, 0x7f, 0x7f, 0x01, 0x01,
+            static_cast<byte>(tc.hours | (rate_code(fps) << 5)),
+            static_cast<byte>(tc.minutes), static_cast<byte>(tc.seconds), static_cast<byte>(tc.frames),
+            0xf7
+        };
+        emit(out, untimed_message { sysex { std::move(data) } });
+    }
+
+    void clock_generator::record(clock::time_point deadline)
+    {
+        const auto late = std::max(std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - deadline),
+                                   std::chrono::nanoseconds { 0 });
+        const std::size_t i = late.count() == 0 ? 0 : std::bit_width(static_cast<std::uint64_t>(late.count())) - 1;
+        ++lateness.buckets[std::min(i, lateness.buckets.size() - 1)];
+        ++num_events;
+        total_lateness += late;
+        max_lateness = std::max(max_lateness, late);
+    }
+
+    void clock_generator::send_tick(clock::time_point deadline)
+    {
+        record(deadline);
+        emit(out, untimed_message { realtime::clock_tick });
+        ++ticks;
+        ++song_clocks;
+    }
+
+    // Quarter frames 0 - 7 carry the time of the frame at which piece 0
+    // was sent, and span two frames.
+    void clock_generator::send_quarter_frame(clock::time_point deadline)
+    {
+        const unsigned fps = mtc_rate->frames_per_second;
+        const unsigned piece = quarter_frames % 8;
+        const auto tc = to_timecode(mtc_origin + (quarter_frames / 8) * 2, fps);
+        unsigned value;
+        switch (piece)
+        {
+        case 0: value = tc.frames & 0x0f; break;
+        case 1: value = tc.frames >> 4; break;
+        case 2: value = tc.seconds & 0x0f; break;
+        case 3: value = tc.seconds >> 4; break;
+        case 4: value = tc.minutes & 0x0f; break;
+        case 5: value = tc.minutes >> 4; break;
+        case 6: value = tc.hours & 0x0f; break;
+        default: value = (tc.hours >> 4) | (rate_code(fps) << 1); break;
+        }
+        record(deadline);
+        emit(out, untimed_message { mtc_quarter_frame { (piece << 4) | value } });
+        ++quarter_frames;
+    }
+
+    void clock_generator::wait_until(std::unique_lock<std::mutex>& lock, clock::time_point deadline)
+    {
+        const auto gen = generation;
+        while (gen == generation)
+        {
+            const auto now = clock::now();
+            if (now >= deadline) return;
+            if (deadline - now > spin_time)
+            {
+                cv.wait_until(lock, deadline - spin_time);
+                continue;
+            }
+            lock.unlock();
+            while (clock::now() < deadline) cpu_relax();
+            lock.lock();
+            return;
+        }
+    }
+
+    void clock_generator::run()
+    {
+        std::unique_lock lock { mutex };
+        while (not quit)
+        {
+            if (not is_running)
+            {
+                cv.wait(lock);
+                continue;
+            }
+
+            const auto gen = generation;
+            const auto tick = next_tick();
+            const auto qf = mtc_rate ? next_quarter_frame() : clock::time_point::max();
+            wait_until(lock, std::min(tick, qf));
+            if (gen != generation) continue;
+
+            if (tick <= qf) send_tick(tick);
+            if (mtc_rate and qf <= tick) send_quarter_frame(qf);
+        }
+    }
+}
@@ -0,0 +1,211 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+#include <jw/midi/coalescing_streambuf.h>
+
+namespace jw::midi
+{
+    // Background thread that flushes coalescing_streambufs when their
+    // deadline expires.  Started on first use.
+    struct coalescing_flusher
+    {
+        using clock = coalescing_streambuf::clock;
+
+        static coalescing_flusher& instance()
+        {
+            static coalescing_flusher f { };
+            return f;
+        }
+
+        // Called with the streambuf's mutex held.
+        void schedule(coalescing_streambuf* buf, clock::time_point deadline)
+        {
+            {
+                std::unique_lock lock { mutex };
+                if (buf->scheduled) return;
+                buf->scheduled = true;
+                pending.push_back({ deadline, buf });
+            }
+            cv.notify_one();
+        }
+
+        // Remove all pending deadlines for this streambuf, and wait until it
+        // is not being flushed.
+        void cancel(coalescing_streambuf* buf)
+        {
+            std::unique_lock lock { mutex };
+            idle_cv.wait(lock, [this, buf] { return active != buf; });
+            std::erase_if(pending, [buf](const auto& e) { return e.buf == buf; });
+            buf->scheduled = false;
+        }
+
+    private:
+        struct entry
+        {
+            clock::time_point deadline;
+            coalescing_streambuf* buf;
+        };
+
+        coalescing_flusher() : thread { [this] { run(); } } { }
+
+        ~coalescing_flusher()
+        {
+            {
+                std::unique_lock lock { mutex };
+                stop = true;
+            }
+            cv.notify_one();
+            thread.join();
+        }
+
+        void run()
+        {
+            std::unique_lock lock { mutex };
+            while (not stop)
+            {
+                if (pending.empty())
+                {
+                    cv.wait(lock);
+                    continue;
+                }
+
+                auto i = std::min_element(pending.begin(), pending.end(),
+                                          [](const auto& a, const auto& b) { return a.deadline < b.deadline; });
+                if (clock::now() < i->deadline)
+                {
+                    cv.wait_until(lock, i->deadline);
+                    continue;
+                }
+
+                auto* const buf = i->buf;
+                pending.erase(i);
+                buf->scheduled = false;
+                active = buf;
+                lock.unlock();
+                buf->timed_flush();
+                lock.lock();
+                active = nullptr;
+                idle_cv.notify_all();
+            }
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::condition_variable idle_cv;
+        std::vector<entry> pending;
+        coalescing_streambuf* active { nullptr };
+        bool stop { false };
+        std::thread thread;
+    };
+
+    coalescing_streambuf::coalescing_streambuf(std::streambuf* t, std::size_t size, std::chrono::nanoseconds latency)
+        : target { t }, rt_target { dynamic_cast<io::realtime_streambuf*>(t) },
+          threshold { std::max<std::size_t>(size, 1) }, max_latency { latency }
+    {
+        buffer.reserve(threshold);
+        setp(nullptr, nullptr);
+    }
+
+    coalescing_streambuf::~coalescing_streambuf()
+    {
+        coalescing_flusher::instance().cancel(this);
+        try
+        {
+            std::unique_lock lock { mutex };
+            write_buffer();
+        }
+        catch (...) { }
+    }
+
+    void coalescing_streambuf::check_error()
+    {
+        if (failed.load(std::memory_order_acquire)) [[unlikely]]
+        {
+            failed.store(false, std::memory_order_relaxed);
+            std::rethrow_exception(std::exchange(error, nullptr));
+        }
+    }
+
+    void coalescing_streambuf::write_buffer()
+    {
+        if (buffer.empty()) return;
+        const std::streamsize n = buffer.size();
+        num_writes.fetch_add(1, std::memory_order_relaxed);
+        const auto written = target->sputn(buffer.data(), n);
+        buffer.clear();
+        if (written != n) throw io::failure { "write failed" };
+        target->pubsync();
+    }
+
+    void coalescing_streambuf::timed_flush()
+    {
+        std::unique_lock lock { mutex };
+        if (buffer.empty()) return;
+        if (clock::now() < deadline)
+        {
+            // Flushed and refilled since this deadline was set.
+            coalescing_flusher::instance().schedule(this, deadline);
+            return;
+        }
+        try { write_buffer(); }
+        catch (...)
+        {
+            error = std::current_exception();
+            failed.store(true, std::memory_order_release);
+        }
+    }
+
+    // Errors from earlier buffered writes are not reported here, only by
+    // the next buffered operation.
+    void coalescing_streambuf::put_realtime(char_type c)
+    {
+        if (rt_target != nullptr) return rt_target->put_realtime(c);
+        std::unique_lock lock { mutex };
+        num_writes.fetch_add(1, std::memory_order_relaxed);
+        if (traits_type::eq_int_type(target->sputc(c), traits_type::eof())) throw io::failure { "write failed" };
+        target->pubsync();
+    }
+
+    std::streamsize coalescing_streambuf::xsputn(const char_type* s, std::streamsize n)
+    {
+        std::unique_lock lock { mutex };
+        check_error();
+        if (buffer.size() + n > threshold) write_buffer();
+        if (static_cast<std::size_t>(n) >= threshold)
+        {
+            num_writes.fetch_add(1, std::memory_order_relaxed);
+            const auto result = target->sputn(s, n);
+            target->pubsync();
+            return result;
+        }
+
+        if (buffer.empty())
+        {
+            deadline = clock::now() + max_latency;
+            coalescing_flusher::instance().schedule(this, deadline);
+        }
+        buffer.insert(buffer.end(), s, s + n);
+        if (buffer.size() >= threshold) write_buffer();
+        return n;
+    }
+
+    coalescing_streambuf::int_type coalescing_streambuf::overflow(int_type c)
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        const char_type ch = traits_type::to_char_type(c);
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    int coalescing_streambuf::sync()
+    {
+        std::unique_lock lock { mutex };
+        check_error();
+        write_buffer();
+        return 0;
+    }
+}
@@ -0,0 +1,199 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Internal helpers for decoding MIDI byte streams, shared between
+// translation units.  Not part of the public interface.
+
+#pragma once
+#include <array>
+#include <vector>
+#include <optional>
+#include <jw/midi/message.h>
+#include <jw/midi/detail/decode.h>
+
+namespace jw::midi
+{
+    using namespace detail;
+
+    // Big-endian integers and variable-length quantities, as used in SMF.
+    // The derived class provides read() and read_8().
+    template<typename D>
+    struct smf_reader
+    {
+        std::uint32_t read_32()
+        {
+            union
+            {
+                std::array<byte, 4> raw;
+                std::uint32_t value;
+            };
+            self().read(raw.data(), 4);
+            return __builtin_bswap32(value);
+        }
+
+        std::uint32_t read_24()
+        {
+            union
+            {
+                std::array<byte, 4> raw;
+                std::uint32_t value;
+            };
+            raw[0] = 0;
+            self().read(raw.data() + 1, 3);
+            return __builtin_bswap32(value);
+        }
+
+        std::uint16_t read_16()
+        {
+            union
+            {
+                std::array<byte, 2> raw;
+                std::uint16_t value;
+            };
+            self().read(raw.data(), 2);
+            return __builtin_bswap16(value);
+        }
+
+        std::uint32_t read_vlq()
+        {
+            std::uint32_t value { };
+            byte b;
+            do
+            {
+                b = self().read_8();
+                value <<= 7;
+                value |= b & 0x7f;
+            } while ((b & 0x80) != 0);
+            return value;
+        }
+
+    private:
+        D& self() noexcept { return *static_cast<D*>(this); }
+    };
+
+    // Bounds-checked reader over a chunk of SMF data in memory.
+    struct chunk_reader : smf_reader<chunk_reader>
+    {
+        chunk_reader(const byte* begin, const byte* end) noexcept : i { begin }, last { end } { }
+
+        template<typename T>
+        void read(T* dst, std::size_t n)
+        {
+            if (n > remaining()) throw io::failure { "read past end of chunk" };
+            for (unsigned j = 0; j < n; ++j)
+                reinterpret_cast<byte*>(dst)[j] = i[j];
+            i += n;
+            return;
+        }
+
+        std::uint8_t read_8()
+        {
+            if (i == last) throw io::failure { "read past end of chunk" };
+            return *i++;
+        }
+
+        const byte* position() const noexcept { return i; }
+        std::size_t remaining() const noexcept { return last - i; }
+
+    protected:
+        const byte* i;
+        const byte* last;
+    };
+
+    inline auto text_type(byte type) noexcept
+    {
+        switch (type)
+        {
+        case 0x01: return meta::text::any;
+        case 0x02: return meta::text::copyright;
+        case 0x03: return meta::text::track_name;
+        case 0x04: return meta::text::instrument_name;
+        case 0x05: return meta::text::lyric;
+        case 0x06: return meta::text::marker;
+        case 0x07: return meta::text::cue_point;
+        default: __builtin_unreachable();
+        }
+    }
+
+    // Decode the body of a meta event of the given type and size.  Channel
+    // prefix (0x20) and end-of-track (0x2f) events are handled by the caller.
+    template<typename R>
+    untimed_message read_meta(byte type, std::size_t size, R& buf, decltype(meta::channel) ch)
+    {
+        std::array<byte, 8> v;
+        switch (type)
+        {
+        case 0x00:
+            if (size != 2) throw io::failure { "incorrect message size" };
+            return { ch, meta::sequence_number { buf.read_16() } };
+
+        case 0x01: case 0x02: case 0x03: case 0x04:
+        case 0x05: case 0x06: case 0x07:
+            {
+                meta::text msg { text_type(type), { } };
+                msg.text.resize(size);
+                buf.read(msg.text.data(), size);
+                return { ch, std::move(msg) };
+            }
+
+        case 0x51:
+            if (size != 3) throw io::failure { "incorrect message size" };
+            return { ch, meta::tempo_change { std::chrono::microseconds { buf.read_24() } } };
+
+        case 0x54:
+            if (size != 5) throw io::failure { "incorrect message size" };
+            buf.read(v.data(), 5);
+            return { ch, meta::smpte_offset { v[0], v[1], v[2], v[3], v[4] } };
+
+        case 0x58:
+            if (size != 4) throw io::failure { "incorrect message size" };
+            buf.read(v.data(), 4);
+            return { ch, meta::time_signature { v[0], v[1], v[2], v[3] } };
+
+        case 0x59:
+            if (size != 2) throw io::failure { "incorrect message size" };
+            buf.read(v.data(), 2);
+            return { ch, meta::key_signature { v[0], v[1] != 0 } };
+
+        default:
+            {
+                meta::unknown msg { type, { } };
+                msg.data.resize(size);
+                buf.read(msg.data.data(), size);
+                return { ch, std::move(msg) };
+            }
+        }
+    }
+
+    // Inverse of read_meta().  Appends the body of a meta event to 'out',
+    // and returns its type.
+    inline byte write_meta(const meta& msg, std::vector<byte>& out)
+    {
+        struct
+        {
+            std::vector<byte>& out;
+
+            byte operator()(const meta::sequence_number& m) { out.insert(out.end(), { byte(m.num >> 8), byte(m.num) }); return 0x00; }
+            byte operator()(const meta::text& m) { out.insert(out.end(), m.text.begin(), m.text.end()); return m.type + 1; }
+            byte operator()(const meta::tempo_change& m)
+            {
+                const std::uint32_t us = m.quarter_note.count();
+                out.insert(out.end(), { byte(us >> 16), byte(us >> 8), byte(us) });
+                return 0x51;
+            }
+            byte operator()(const meta::smpte_offset& m)
+            {
+                out.insert(out.end(), { byte(m.hour), byte(m.minute), byte(m.second), byte(m.frame), byte(m.fractional_frame) });
+                return 0x54;
+            }
+            byte operator()(const meta::time_signature& m)
+            {
+                out.insert(out.end(), { byte(m.numerator), byte(m.denominator), byte(m.clocks_per_metronome_click), byte(m.notated_32nd_notes_per_24_clocks) });
+                return 0x58;
+            }
+            byte operator()(const meta::key_signature& m) { out.insert(out.end(), { byte(m.num_sharps), byte(m.major_key) }); return 0x59; }
+            byte operator()(const meta::unknown& m) { out.insert(out.end(), m.data.begin(), m.data.end()); return m.type; }
+        } visitor { out };
+        return std::visit(visitor, msg.message);
+    }
+}
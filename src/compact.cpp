@@ -0,0 +1,240 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <algorithm>
+#include <jw/midi/compact.h>
+#include <jw/midi/encode.h>
+#include "codec.h"
+
+namespace jw::midi
+{
+    // Event encoding differs from SMF in the following ways: delta times and
+    // sysex sizes may exceed 32 bits, sysex data is stored as-is after 0xf0
+    // and its size, and meta events use the undefined status bytes 0xf4 (no
+    // channel prefix) and 0xf5 (followed by the channel), then the type,
+    // size and body.  Running status is not cleared by non-channel
+    // messages.
+    static constexpr byte meta_tag = 0xf4;
+    static constexpr byte meta_channel_tag = 0xf5;
+
+    static void write_vlq(std::vector<byte>& out, std::uint64_t value)
+    {
+        std::array<byte, 10> buf;
+        std::size_t n = 0;
+        do
+        {
+            buf[n++] = value & 0x7f;
+            value >>= 7;
+        } while (value != 0);
+        while (n > 1) out.push_back(buf[--n] | 0x80);
+        out.push_back(buf[0]);
+    }
+
+    static std::uint64_t read_vlq(chunk_reader& buf)
+    {
+        std::uint64_t value { };
+        byte b;
+        do
+        {
+            b = buf.read_8();
+            value <<= 7;
+            value |= b & 0x7f;
+        } while ((b & 0x80) != 0);
+        return value;
+    }
+
+    struct compact_encoder
+    {
+        std::vector<byte>& out;
+        std::vector<byte>& scratch;
+        byte& running_status;
+
+        void put(std::span<const byte> data) { out.insert(out.end(), data.begin(), data.end()); }
+
+        void operator()(std::monostate) { throw io::failure { "invalid message" }; }
+        void operator()(realtime msg) { put(encode(msg).span()); }
+
+        void operator()(const channel_message& msg)
+        {
+            const auto encoded = encode(msg);
+            auto bytes = encoded.span();
+            if (bytes[0] == running_status) bytes = bytes.subspan(1);
+            else running_status = bytes[0];
+            put(bytes);
+        }
+
+        void operator()(const system_message& msg)
+        {
+            if (auto* const s = std::get_if<sysex>(&msg.message))
+            {
+                out.push_back(0xf0);
+                write_vlq(out, s->data.size());
+                put(s->data);
+            }
+            else std::visit([this](const auto& m)
+            {
+                if constexpr (not std::is_same_v<std::remove_cvref_t<decltype(m)>, sysex>)
+                    put(encode(m).span());
+            }, msg.message);
+        }
+
+        void operator()(const meta_message& msg)
+        {
+            if (msg->channel)
+            {
+                out.push_back(meta_channel_tag);
+                out.push_back(*msg->channel);
+            }
+            else out.push_back(meta_tag);
+            scratch.clear();
+            out.push_back(write_meta(*msg, scratch));
+            write_vlq(out, scratch.size());
+            put(scratch);
+        }
+    };
+
+    compact_track::compact_track(const file::track& trk)
+    {
+        std::vector<byte> scratch;
+        std::uint64_t prev_tick = 0;
+        byte running_status = 0;
+        for (const auto& [tick, msgs] : trk)
+        {
+            for (const auto& msg : msgs)
+            {
+                if (num_events % block_size == 0) [[unlikely]]
+                {
+                    index.push_back({ tick, data.size() });
+                    prev_tick = tick;
+                    running_status = 0;
+                }
+                write_vlq(data, tick - prev_tick);
+                prev_tick = tick;
+                std::visit(compact_encoder { data, scratch, running_status }, msg.category);
+                ++num_events;
+            }
+        }
+        if (not trk.empty()) last_tick = trk.rbegin()->first;
+        data.shrink_to_fit();
+        index.shrink_to_fit();
+    }
+
+    void compact_track::iterator::next()
+    {
+        if (i >= trk->num_events) return;
+        if (i % block_size == 0) [[unlikely]]
+        {
+            const auto& b = trk->index[i / block_size];
+            pos = b.offset;
+            current.tick = b.tick;
+            running_status = 0;
+        }
+
+        const byte* const base = trk->data.data();
+        chunk_reader buf { base + pos, base + trk->data.size() };
+        current.tick += read_vlq(buf);
+
+        byte status = buf.read_8();
+        std::array<byte, 2> bytes;
+        if (not is_status(status))
+        {
+            if (running_status == 0) [[unlikely]] throw io::failure { "no running status" };
+            bytes[0] = status;
+            status = running_status;
+            buf.read(bytes.data() + 1, msg_size(status) - 1);
+            current.message = make_msg(status, bytes.data());
+        }
+        else if (status < 0xf0)
+        {
+            running_status = status;
+            buf.read(bytes.data(), msg_size(status));
+            current.message = make_msg(status, bytes.data());
+        }
+        else if (status == 0xf0)
+        {
+            const auto size = read_vlq(buf);
+            if (size > buf.remaining()) throw io::failure { "read past end of chunk" };
+            current.message = sysex { { buf.position(), buf.position() + size } };
+            pos = buf.position() + size - base;
+            return;
+        }
+        else if (status == meta_tag or status == meta_channel_tag)
+        {
+            decltype(meta::channel) ch { };
+            if (status == meta_channel_tag) ch = buf.read_8();
+            const byte type = buf.read_8();
+            const auto size = read_vlq(buf);
+            current.message = read_meta(type, size, buf, ch);
+        }
+        else if (is_realtime(status)) current.message = realtime_msg(status);
+        else
+        {
+            buf.read(bytes.data(), msg_size(status));
+            current.message = make_msg(status, bytes.data());
+        }
+        pos = buf.position() - base;
+    }
+
+    compact_track::iterator compact_track::seek(std::size_t i) const
+    {
+        if (i >= num_events) return end();
+        iterator it { this, i - i % block_size };
+        it.next();
+        while (it.i < i) ++it;
+        return it;
+    }
+
+    compact_track::iterator compact_track::lower_bound(std::uint64_t tick) const
+    {
+        // The block before the first one that starts at or after 'tick' may
+        // still contain events at that tick.
+        const auto b = std::partition_point(index.begin(), index.end(), [tick](const block& x) { return x.tick < tick; });
+        const std::size_t first = b == index.begin() ? 0 : (b - index.begin() - 1) * block_size;
+        auto it = seek(first);
+        while (it != end() and it->tick < tick) ++it;
+        return it;
+    }
+
+    std::size_t compact_track::memory_usage() const noexcept
+    {
+        return sizeof(*this) + data.capacity() + index.capacity() * sizeof(block);
+    }
+
+    file::track compact_track::decode() const
+    {
+        file::track trk;
+        for (auto i = begin(); i != end(); ++i)
+        {
+            if (trk.empty() or trk.rbegin()->first != i->tick)
+                trk.emplace_hint(trk.end(), std::piecewise_construct, std::make_tuple(i->tick), std::make_tuple());
+            trk.rbegin()->second.push_back(std::move(i.current.message));
+        }
+        if (last_tick and (trk.empty() or trk.rbegin()->first < *last_tick))
+            trk.emplace_hint(trk.end(), std::piecewise_construct, std::make_tuple(*last_tick), std::make_tuple());
+        return trk;
+    }
+
+    compact_file::compact_file(const file& f)
+        : asynchronous_tracks { f.asynchronous_tracks }, time_division { f.time_division }
+    {
+        tracks.reserve(f.tracks.size());
+        for (const auto& t : f.tracks) tracks.emplace_back(t);
+    }
+
+    std::size_t compact_file::memory_usage() const noexcept
+    {
+        std::size_t n = sizeof(*this) + (tracks.capacity() - tracks.size()) * sizeof(compact_track);
+        for (const auto& t : tracks) n += t.memory_usage();
+        return n;
+    }
+
+    file compact_file::decode() const
+    {
+        file f { };
+        f.asynchronous_tracks = asynchronous_tracks;
+        f.time_division = time_division;
+        f.tracks.reserve(tracks.size());
+        for (const auto& t : tracks) f.tracks.push_back(t.decode());
+        return f;
+    }
+}
@@ -0,0 +1,152 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <span>
+#include <array>
+#include <iterator>
+#include <algorithm>
+#include <stdexcept>
+#include <jw/midi/convert.h>
+
+namespace jw::midi
+{
+    // Track is either 'const file::track' (copy messages) or 'file::track'
+    // (move messages).
+    template<typename Track>
+    static auto take(auto& x)
+    {
+        if constexpr (std::is_const_v<Track>) return x;
+        else return std::move(x);
+    }
+
+    // Append a new tick to the end of the track, or return the last one if
+    // it is at the same tick.
+    static std::vector<untimed_message>& back_at(file::track& trk, std::uint64_t tick)
+    {
+        if (trk.empty() or trk.rbegin()->first != tick) [[likely]]
+            return trk.emplace_hint(trk.end(), tick, std::vector<untimed_message> { })->second;
+        return trk.rbegin()->second;
+    }
+
+    static void end_at(file::track& trk, std::uint64_t tick)
+    {
+        if (trk.empty() or trk.rbegin()->first < tick) trk.emplace_hint(trk.end(), tick, std::vector<untimed_message> { });
+    }
+
+    // K-way merge over all tracks, via a heap ordered by tick and then by
+    // track number.  Each tick of each track is visited once.
+    template<typename Track>
+    static file::track merge(std::span<Track> tracks)
+    {
+        using iterator = decltype(std::declval<Track&>().begin());
+        struct cursor
+        {
+            iterator it, end;
+            std::size_t track;
+        };
+        auto later = [](const cursor& a, const cursor& b)
+        {
+            if (a.it->first != b.it->first) return a.it->first > b.it->first;
+            return a.track > b.track;
+        };
+
+        std::vector<cursor> heap;
+        heap.reserve(tracks.size());
+        std::uint64_t end_tick = 0;
+        for (std::size_t i = 0; i < tracks.size(); ++i)
+        {
+            if (tracks[i].empty()) continue;
+            heap.push_back({ tracks[i].begin(), tracks[i].end(), i });
+            end_tick = std::max(end_tick, tracks[i].rbegin()->first);
+        }
+        std::make_heap(heap.begin(), heap.end(), later);
+
+        file::track out;
+        while (not heap.empty())
+        {
+            std::pop_heap(heap.begin(), heap.end(), later);
+            auto& c = heap.back();
+            auto& [tick, msgs] = *c.it;
+            if (not msgs.empty())
+            {
+                auto& v = back_at(out, tick);
+                if (v.empty()) v = take<Track>(msgs);
+                else if constexpr (std::is_const_v<Track>) v.insert(v.end(), msgs.begin(), msgs.end());
+                else v.insert(v.end(), std::make_move_iterator(msgs.begin()), std::make_move_iterator(msgs.end()));
+            }
+            if (++c.it == c.end) heap.pop_back();
+            else std::push_heap(heap.begin(), heap.end(), later);
+        }
+        if (not tracks.empty()) end_at(out, end_tick);
+        return out;
+    }
+
+    static bool is_conductor_event(const meta& m) noexcept
+    {
+        return std::holds_alternative<meta::tempo_change>(m.message)
+            or std::holds_alternative<meta::time_signature>(m.message)
+            or std::holds_alternative<meta::key_signature>(m.message)
+            or std::holds_alternative<meta::smpte_offset>(m.message);
+    }
+
+    template<typename Track>
+    static std::vector<file::track> split(Track& trk)
+    {
+        std::array<file::track, 17> buckets;   // Conductor, then channels 0 - 15.
+        for (auto& [tick, msgs] : trk)
+        {
+            for (auto& msg : msgs)
+            {
+                std::size_t b = 0;
+                if (auto* c = std::get_if<channel_message>(&msg.category))
+                    b = 1 + c->channel;
+                else if (auto* m = std::get_if<meta_message>(&msg.category))
+                    if (*m and (*m)->channel and not is_conductor_event(**m)) b = 1 + *(*m)->channel;
+                back_at(buckets[b], tick).push_back(take<Track>(msg));
+            }
+        }
+
+        std::vector<file::track> out;
+        for (std::size_t b = 0; b < buckets.size(); ++b)
+        {
+            if (b > 0 and buckets[b].empty()) continue;
+            if (not trk.empty()) end_at(buckets[b], trk.rbegin()->first);
+            out.push_back(std::move(buckets[b]));
+        }
+        return out;
+    }
+
+    template<typename F>
+    static file merge_tracks_impl(F&& f)
+    {
+        if (f.asynchronous_tracks and f.tracks.size() > 1)
+            throw std::invalid_argument { "can not merge asynchronous tracks" };
+
+        file out;
+        out.asynchronous_tracks = false;
+        out.time_division = f.time_division;
+        out.tracks.push_back(merge(std::span { f.tracks }));
+        return out;
+    }
+
+    template<typename F>
+    static file split_channels_impl(F&& f)
+    {
+        file out;
+        if (f.tracks.size() > 1) out = merge_tracks(std::forward<F>(f));
+        else
+        {
+            out.time_division = f.time_division;
+            if (not f.tracks.empty()) out.tracks.push_back(take<std::remove_reference_t<F>>(f.tracks.front()));
+        }
+        out.asynchronous_tracks = false;
+        if (out.tracks.empty()) out.tracks.emplace_back();
+        out.tracks = split(out.tracks.front());
+        return out;
+    }
+
+    file merge_tracks(const file& f) { return merge_tracks_impl(f); }
+    file merge_tracks(file&& f) { return merge_tracks_impl(std::move(f)); }
+    file split_channels(const file& f) { return split_channels_impl(f); }
+    file split_channels(file&& f) { return split_channels_impl(std::move(f)); }
+}
@@ -0,0 +1,199 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <mutex>
+#include <atomic>
+#include <istream>
+#include <algorithm>
+#include <cxxabi.h>
+#include <condition_variable>
+#include <jw/midi/corpus.h>
+#include "thread_pool.h"
+
+namespace jw::midi
+{
+    // Read-only streambuf over a memory buffer, with seek support as
+    // required by file::read().
+    struct memory_streambuf final : std::streambuf
+    {
+        memory_streambuf(char* begin, std::size_t size) { setg(begin, begin, begin + size); }
+
+    protected:
+        virtual pos_type seekoff(off_type off, std::ios::seekdir dir, std::ios::openmode which) override
+        {
+            if ((which & std::ios::in) == 0) return pos_type(off_type(-1));
+            off_type pos = off;
+            if (dir == std::ios::cur) pos += gptr() - eback();
+            else if (dir == std::ios::end) pos += egptr() - eback();
+            if (pos < 0 or pos > egptr() - eback()) return pos_type(off_type(-1));
+            setg(eback(), eback() + pos, egptr());
+            return pos_type(pos);
+        }
+
+        virtual pos_type seekpos(pos_type pos, std::ios::openmode which) override
+        {
+            return seekoff(off_type(pos), std::ios::beg, which);
+        }
+    };
+
+    // Limits the total size of files in flight.
+    struct byte_budget
+    {
+        explicit byte_budget(std::uint64_t max) : available { max }, max { max } { }
+
+        std::uint64_t acquire(std::uint64_t n)
+        {
+            n = std::min(n, max);
+            std::unique_lock lock { mutex };
+            cv.wait(lock, [this, n] { return available >= n; });
+            available -= n;
+            return n;
+        }
+
+        void release(std::uint64_t n)
+        {
+            {
+                std::unique_lock lock { mutex };
+                available += n;
+            }
+            cv.notify_all();
+        }
+
+    private:
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::uint64_t available;
+        const std::uint64_t max;
+    };
+
+    struct corpus_loader
+    {
+        corpus_loader(const corpus_callback& cb, const corpus_options& opt)
+            : callback { cb }, budget { std::max<std::uint64_t>(opt.max_bytes_in_flight, 1) }, pool { opt.threads } { }
+
+        void submit(const std::filesystem::path& path, std::uint64_t size)
+        {
+            if (stop.load(std::memory_order_relaxed)) return;
+            const auto reserved = budget.acquire(size);
+            pool.submit([this, path, size, reserved]
+            {
+                struct release_on_exit
+                {
+                    byte_budget& budget;
+                    std::uint64_t n;
+                    ~release_on_exit() { budget.release(n); }
+                } release { budget, reserved };
+                if (stop.load(std::memory_order_relaxed)) return;
+                load(path, size);
+            });
+        }
+
+        corpus_statistics finish()
+        {
+            try { pool.wait(); }
+            catch (...)
+            {
+                stop.store(true, std::memory_order_relaxed);
+                throw;
+            }
+            corpus_statistics s { };
+            s.files = files.load(std::memory_order_relaxed);
+            s.failed = failed.load(std::memory_order_relaxed);
+            s.bytes = bytes.load(std::memory_order_relaxed);
+            s.events = events.load(std::memory_order_relaxed);
+            s.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+            return s;
+        }
+
+    private:
+        void load(const std::filesystem::path& path, std::uint64_t size)
+        {
+            corpus_entry entry { path, size, { }, nullptr };
+            try
+            {
+                std::ifstream f { path, std::ios::in | std::ios::binary };
+                f.exceptions(std::ios::badbit | std::ios::failbit);
+                std::unique_ptr<char[]> buf { new char[size] };
+                f.read(buf.get(), size);
+
+                memory_streambuf mem { buf.get(), size };
+                std::istream in { &mem };
+                in.exceptions(std::ios::badbit | std::ios::failbit | std::ios::eofbit);
+                entry.data = file::read(in);
+
+                std::uint64_t n = 0;
+                for (const auto& trk : entry.data.tracks)
+                    for (const auto& [tick, msgs] : trk)
+                        n += msgs.size();
+
+                files.fetch_add(1, std::memory_order_relaxed);
+                bytes.fetch_add(size, std::memory_order_relaxed);
+                events.fetch_add(n, std::memory_order_relaxed);
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...)
+            {
+                entry.data = { };
+                entry.error = std::current_exception();
+                failed.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            try { callback(entry); }
+            catch (...)
+            {
+                stop.store(true, std::memory_order_relaxed);
+                throw;
+            }
+        }
+
+        const corpus_callback& callback;
+        byte_budget budget;
+        std::atomic<bool> stop { false };
+        std::atomic<std::uint64_t> files { 0 };
+        std::atomic<std::uint64_t> failed { 0 };
+        std::atomic<std::uint64_t> bytes { 0 };
+        std::atomic<std::uint64_t> events { 0 };
+        const std::chrono::steady_clock::time_point start { std::chrono::steady_clock::now() };
+        thread_pool pool;   // Must be destroyed first.
+    };
+
+    corpus_statistics load_corpus(std::span<const std::filesystem::path> files, const corpus_callback& callback, const corpus_options& options)
+    {
+        corpus_loader loader { callback, options };
+        for (const auto& path : files)
+        {
+            // If this fails, the error is reported when opening the file.
+            std::error_code ec;
+            const auto size = std::filesystem::file_size(path, ec);
+            loader.submit(path, ec ? 0 : size);
+        }
+        return loader.finish();
+    }
+
+    corpus_statistics load_corpus(const std::filesystem::path& directory, const corpus_callback& callback, const corpus_options& options)
+    {
+        corpus_loader loader { callback, options };
+        auto visit = [&](const std::filesystem::directory_entry& e)
+        {
+            std::error_code ec;
+            if (not e.is_regular_file(ec)) return;
+            if (not options.extensions.empty())
+            {
+                const auto ext = e.path().extension();
+                if (std::find(options.extensions.begin(), options.extensions.end(), ext) == options.extensions.end())
+                    return;
+            }
+            const auto size = e.file_size(ec);
+            loader.submit(e.path(), ec ? 0 : size);
+        };
+
+        if (options.recursive)
+            for (const auto& e : std::filesystem::recursive_directory_iterator { directory, std::filesystem::directory_options::skip_permission_denied })
+                visit(e);
+        else
+            for (const auto& e : std::filesystem::directory_iterator { directory, std::filesystem::directory_options::skip_permission_denied })
+                visit(e);
+
+        return loader.finish();
+    }
+}
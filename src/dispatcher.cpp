@@ -0,0 +1,112 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <algorithm>
+#include <jw/midi/dispatcher.h>
+
+namespace jw::midi
+{
+    std::size_t dispatcher::route_key(const untimed_message& msg) noexcept
+    {
+        switch (msg.category.index())
+        {
+        case untimed_message::index_of<channel_message>():
+            {
+                const auto& m = *std::get_if<channel_message>(&msg.category);
+                return m.message.index() * 16 + m.channel;
+            }
+        case untimed_message::index_of<system_message>():
+            return 6 * 16 + std::get_if<system_message>(&msg.category)->message.index();
+        case untimed_message::index_of<realtime_message>():
+            return 6 * 16 + 5;
+        case untimed_message::index_of<meta_message>():
+            return 6 * 16 + 6;
+        default:
+            return num_keys;
+        }
+    }
+
+    bool dispatcher::matches(const message_filter& filter, std::size_t key) noexcept
+    {
+        if (key < 6 * 16)
+            return (filter.kinds & (1u << (key / 16))) != 0 and (filter.channels & (1u << (key % 16))) != 0;
+        return (filter.kinds & (1u << (key - 6 * 16 + 6))) != 0;
+    }
+
+    void dispatcher::add_routes(std::size_t i)
+    {
+        for (std::size_t key = 0; key < num_keys; ++key)
+            if (matches(subscribers[i].filter, key)) routes[key].push_back(i);
+    }
+
+    std::size_t dispatcher::subscribe(message_filter filter, callback f)
+    {
+        subscribers.push_back({ filter, std::move(f), nullptr, 0, true });
+        add_routes(subscribers.size() - 1);
+        return subscribers.size() - 1;
+    }
+
+    std::size_t dispatcher::subscribe(message_filter filter, message_queue& queue)
+    {
+        subscribers.push_back({ filter, { }, &queue, 0, true });
+        add_routes(subscribers.size() - 1);
+        return subscribers.size() - 1;
+    }
+
+    void dispatcher::unsubscribe(std::size_t i)
+    {
+        auto& s = subscribers[i];
+        if (not s.active) return;
+        s.active = false;
+        s.function = nullptr;
+        s.queue = nullptr;
+        for (auto& r : routes) std::erase(r, i);
+    }
+
+    std::size_t dispatcher::dispatch(const message& msg)
+    {
+        const auto key = route_key(msg);
+        if (key >= num_keys) [[unlikely]] return 0;
+        const auto& route = routes[key];
+        std::size_t n = route.size();
+        for (const auto i : route)
+        {
+            auto& s = subscribers[i];
+            if (s.queue != nullptr)
+            {
+                if (not s.queue->try_push(msg)) [[unlikely]]
+                {
+                    ++s.dropped;
+                    --n;
+                }
+            }
+            else s.function(msg);
+        }
+        return n;
+    }
+
+    std::size_t dispatcher::poll(std::istream& in, std::size_t max_messages)
+    {
+        std::size_t n = 0;
+        message msg;
+        while (n < max_messages)
+        {
+            const auto status = try_extract(in, msg);
+            if (status == extract_status::ok)
+            {
+                ++n;
+                dispatch(msg);
+                continue;
+            }
+            if (status == extract_status::would_block) break;
+            if (status == extract_status::invalid_status or status == extract_status::unexpected_status)
+            {
+                ++num_errors;
+                continue;
+            }
+            is_active = false;
+            break;
+        }
+        return n;
+    }
+}
@@ -0,0 +1,161 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/epoll_reactor.h>
+#if __has_include(<sys/epoll.h>)
+#include <jw/midi/fd_streambuf.h>
+#include <atomic>
+#include <algorithm>
+#include <climits>
+#include <system_error>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+
+namespace jw::midi
+{
+    [[noreturn]] static void throw_errno(const char* what)
+    {
+        throw std::system_error { errno, std::system_category(), what };
+    }
+
+    static int check(int result, const char* what)
+    {
+        if (result < 0) throw_errno(what);
+        return result;
+    }
+
+    static int wait_events(int epfd, epoll_event* events, int max, std::chrono::nanoseconds timeout)
+    {
+        if (timeout.count() < 0) return ::epoll_wait(epfd, events, max, -1);
+#       ifdef SYS_epoll_pwait2
+        static std::atomic<bool> have_pwait2 { true };
+        if (have_pwait2.load(std::memory_order_relaxed))
+        {
+            const auto s = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+            const timespec ts { static_cast<time_t>(s.count()), static_cast<long>((timeout - s).count()) };
+            const int n = ::syscall(SYS_epoll_pwait2, epfd, events, max, &ts, nullptr, 0);
+            if (n >= 0 or errno != ENOSYS) return n;
+            have_pwait2.store(false, std::memory_order_relaxed);
+        }
+#       endif
+        const auto ms = std::chrono::ceil<std::chrono::milliseconds>(timeout).count();
+        return ::epoll_wait(epfd, events, max, static_cast<int>(std::min<decltype(ms)>(ms, INT_MAX)));
+    }
+
+    epoll_reactor::epoll_reactor()
+        : epoll_fd { check(::epoll_create1(EPOLL_CLOEXEC), "epoll_create1") },
+          wake_fd { check(::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), "eventfd") },
+          events(64)
+    {
+        epoll_event e { };
+        e.events = EPOLLIN;
+        e.data.ptr = nullptr;
+        check(::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &e), "epoll_ctl");
+    }
+
+    epoll_reactor::~epoll_reactor()
+    {
+        ::close(wake_fd);
+        ::close(epoll_fd);
+    }
+
+    void epoll_reactor::watch(int fd, callback cb, std::uint32_t evts, bool oneshot)
+    {
+        auto p = std::make_unique<entry>(fd, oneshot, false, std::move(cb));
+        epoll_event e { };
+        e.events = evts;
+        e.data.ptr = p.get();
+        const bool exists = watches.contains(fd);
+        check(::epoll_ctl(epoll_fd, exists ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &e), "epoll_ctl");
+        auto& slot = watches[fd];
+        if (slot)
+        {
+            slot->removed = true;
+            removed.push_back(std::move(slot));
+        }
+        slot = std::move(p);
+    }
+
+    void epoll_reactor::watch(std::istream& in, message_handler handler)
+    {
+        auto* const buf = dynamic_cast<fd_streambuf*>(in.rdbuf());
+        if (buf == nullptr) throw std::invalid_argument { "rdbuf() is not an fd_streambuf" };
+        const int fd = buf->fd();
+        watch(fd, [this, &in, fd, handler = std::move(handler)](std::uint32_t)
+        {
+            // Drain everything, including bytes already buffered in the
+            // streambuf, since epoll only reports new data on the descriptor.
+            while (true)
+            {
+                message msg;
+                switch (try_extract(in, msg))
+                {
+                case extract_status::ok:
+                    handler(std::move(msg));
+                    continue;
+                case extract_status::invalid_status:
+                case extract_status::unexpected_status:
+                    continue;
+                case extract_status::would_block:
+                    return;
+                case extract_status::end_of_file:
+                case extract_status::stream_error:
+                    unwatch(fd);
+                    return;
+                }
+            }
+        });
+    }
+
+    void epoll_reactor::unwatch(int fd)
+    {
+        auto i = watches.find(fd);
+        if (i == watches.end()) return;
+        ::epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        i->second->removed = true;
+        removed.push_back(std::move(i->second));
+        watches.erase(i);
+    }
+
+    std::size_t epoll_reactor::run_once(std::chrono::nanoseconds timeout)
+    {
+        int n;
+        do n = wait_events(epoll_fd, events.data(), events.size(), timeout);
+        while (n < 0 and errno == EINTR);
+        if (n < 0) throw_errno("epoll_wait");
+
+        std::size_t dispatched = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            auto* const e = static_cast<entry*>(events[i].data.ptr);
+            if (e == nullptr)
+            {
+                std::uint64_t value;
+                while (::read(wake_fd, &value, sizeof(value)) > 0) { }
+                continue;
+            }
+            if (e->removed) continue;
+            if (e->oneshot) unwatch(e->fd);
+            e->cb(events[i].events);
+            ++dispatched;
+        }
+        if (static_cast<std::size_t>(n) == events.size()) events.resize(events.size() * 2);
+        removed.clear();
+        return dispatched;
+    }
+
+    void epoll_reactor::run()
+    {
+        stopped.store(false, std::memory_order_relaxed);
+        while (not stopped.load(std::memory_order_relaxed)) run_once();
+    }
+
+    void epoll_reactor::stop()
+    {
+        stopped.store(true, std::memory_order_relaxed);
+        const std::uint64_t one = 1;
+        [[maybe_unused]] auto _ = ::write(wake_fd, &one, sizeof(one));
+    }
+}
+#endif
@@ -0,0 +1,168 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <array>
+#include <mutex>
+#include <cxxabi.h>
+#include <jw/io/realtime_streambuf.h>
+#include <jw/midi/fanout.h>
+#include <jw/midi/encode.h>
+
+namespace jw::midi
+{
+    template<typename F>
+    static void visit_encoded(const untimed_message& msg, F&& f)
+    {
+        if (not msg.valid() or msg.is_meta_message()) [[unlikely]] return;
+        if (auto* t = std::get_if<channel_message>(&msg.category)) return f(encode(*t).span());
+        if (auto* t = std::get_if<realtime>(&msg.category)) return f(encode(*t).span());
+        if (auto* t = std::get_if<system_message>(&msg.category))
+        {
+            std::visit([&f](const auto& m)
+            {
+                if constexpr (std::is_same_v<std::remove_cvref_t<decltype(m)>, sysex>) f(std::span<const byte> { m.data });
+                else f(encode(m).span());
+            }, t->message);
+        }
+    }
+
+    encoded_message::kind encoded_message::kind_of(const untimed_message& msg) noexcept
+    {
+        if (msg.is_channel_message()) return encoded_message::kind::channel;
+        if (msg.is_realtime_message()) return encoded_message::kind::realtime;
+        return encoded_message::kind::other;
+    }
+
+    shared_encoded_message encode_shared(untimed_message&& msg)
+    {
+        auto result = std::make_shared<encoded_message>();
+        if (not msg.valid() or msg.is_meta_message()) [[unlikely]] return result;
+        if (auto* t = std::get_if<system_message>(&msg.category))
+        {
+            if (auto* s = std::get_if<sysex>(&t->message))
+            {
+                result->data = std::move(s->data);
+                return result;
+            }
+        }
+        result->type = encoded_message::kind_of(msg);
+        visit_encoded(msg, [&result](std::span<const byte> b) { result->data.assign(b.begin(), b.end()); });
+        return result;
+    }
+
+    shared_encoded_message encode_shared(const untimed_message& msg)
+    {
+        auto result = std::make_shared<encoded_message>();
+        result->type = encoded_message::kind_of(msg);
+        visit_encoded(msg, [&result](std::span<const byte> b) { result->data.assign(b.begin(), b.end()); });
+        return result;
+    }
+
+    std::size_t fanout_router::add(std::ostream& out)
+    {
+        outputs.push_back({ &out, &detail::tx_state<default_policy>(out) });
+        return outputs.size() - 1;
+    }
+
+    void fanout_router::send(const untimed_message& msg)
+    {
+        const auto type = encoded_message::kind_of(msg);
+        visit_encoded(msg, [this, type](std::span<const byte> b) { send_bytes(b, type); });
+    }
+
+    void fanout_router::send_realtime(byte b)
+    {
+        for (auto& o : outputs)
+        {
+            if (o.out == nullptr) continue;
+            auto& tx = *o.tx;
+            const auto start = tx.stats.latency.start();
+            std::ostream::sentry sentry { *o.out };
+            if (not sentry) [[unlikely]] continue;
+            try
+            {
+                auto* const rdbuf = o.out->rdbuf();
+                io::realtime_streambuf* rtbuf;
+                if constexpr (default_policy::rdbuf_never_changes)
+                    rtbuf = tx.realtime ? static_cast<io::realtime_streambuf*>(rdbuf) : nullptr;
+                else
+                    rtbuf = dynamic_cast<io::realtime_streambuf*>(rdbuf);
+
+                if (rtbuf != nullptr)
+                {
+                    rtbuf->put_realtime(b);
+                    ++tx.stats.realtime_bytes;
+                }
+                else
+                {
+                    rdbuf->sputc(b);
+                    ++tx.stats.bytes;
+                }
+                ++tx.stats.realtime_messages;
+                tx.stats.latency.stop(start);
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...)
+            {
+                ++tx.stats.errors;
+                o.out->_M_setstate(std::ios::badbit);
+            }
+        }
+    }
+
+    // Channel messages are sent as emit() would, with running status.  Any
+    // other block is written as-is, and scanned for status bytes in the
+    // same way as emit() does for sysex data.
+    void fanout_router::send_bytes(std::span<const byte> msg, encoded_message::kind type)
+    {
+        if (msg.empty()) [[unlikely]] return;
+        const byte status = msg[0];
+        if (type == encoded_message::kind::realtime) return send_realtime(status);
+
+        const bool is_channel = type == encoded_message::kind::channel;
+        const bool is_note_off = is_channel and (status & 0xf0) == 0x80 and msg.size() == 3
+                                 and (default_policy::optimize_note_off or msg[2] == 0x40);
+        const std::array<byte, 2> note_off_as_on { is_note_off ? msg[1] : byte { 0 }, 0x00 };
+
+        for (auto& o : outputs)
+        {
+            if (o.out == nullptr) continue;
+            auto& tx = *o.tx;
+            const auto start = tx.stats.latency.start();
+            std::unique_lock lock { tx.mutex };
+            std::ostream::sentry sentry { *o.out };
+            if (not sentry) [[unlikely]] continue;
+            try
+            {
+                auto bytes = msg;
+                if (is_channel)
+                {
+                    if (is_note_off and tx.last_status == (status | 0x10)) bytes = note_off_as_on;
+                    else
+                    {
+                        const bool running_status = tx.last_status == status;
+                        bytes = bytes.subspan(running_status);
+                        tx.last_status = status;
+                    }
+                    tx.stats.running_status += bytes.size() < msg.size();
+                    ++tx.stats.channel_messages;
+                }
+                else
+                {
+                    detail::update_status(tx.last_status, msg.begin(), msg.end());
+                    ++tx.stats.system_messages;
+                }
+
+                o.out->rdbuf()->sputn(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+                tx.stats.bytes += bytes.size();
+                tx.stats.latency.stop(start);
+            }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...)
+            {
+                ++tx.stats.errors;
+                o.out->_M_setstate(std::ios::badbit);
+            }
+        }
+    }
+}
@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/fd_streambuf.h>
+#if __has_include(<unistd.h>) and __has_include(<poll.h>)
+#include <system_error>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+
+namespace jw::midi
+{
+    [[noreturn]] static void throw_errno(const char* what)
+    {
+        throw std::system_error { errno, std::system_category(), what };
+    }
+
+    static void wait_for(int fd, short events)
+    {
+        pollfd p { fd, events, 0 };
+        while (::poll(&p, 1, -1) < 0)
+            if (errno != EINTR) throw_errno("poll");
+    }
+
+    fd_streambuf::fd_streambuf(int fd, bool take_ownership, std::size_t rx_buffer_size, std::size_t tx_buffer_size)
+        : file { fd }, owned { take_ownership }, rx_size { rx_buffer_size }, tx_size { tx_buffer_size },
+          rx_buf { new char_type[rx_size] }, tx_buf { tx_size > 0 ? new char_type[tx_size] : nullptr }
+    {
+        setg(rx_buf.get(), rx_buf.get(), rx_buf.get());
+        setp(tx_buf.get(), tx_buf.get() + tx_size);
+    }
+
+    fd_streambuf::~fd_streambuf()
+    {
+        try { sync(); }
+        catch (...) { }
+        if (owned) ::close(file);
+    }
+
+    void fd_streambuf::put_realtime(char_type c)
+    {
+        write_all(&c, 1);
+    }
+
+    fd_streambuf::int_type fd_streambuf::underflow()
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        while (true)
+        {
+            const auto n = ::read(file, rx_buf.get(), rx_size);
+            if (n > 0)
+            {
+                setg(rx_buf.get(), rx_buf.get(), rx_buf.get() + n);
+                return traits_type::to_int_type(*gptr());
+            }
+            if (n == 0) return traits_type::eof();
+            if (errno == EAGAIN or errno == EWOULDBLOCK) wait_for(file, POLLIN);
+            else if (errno != EINTR) throw_errno("read");
+        }
+    }
+
+    std::streamsize fd_streambuf::showmanyc()
+    {
+        int n;
+        if (::ioctl(file, FIONREAD, &n) == 0 and n > 0) return n;
+
+        // Distinguish "no data yet" from end-of-file.
+        pollfd p { file, POLLIN, 0 };
+        if (::poll(&p, 1, 0) > 0)
+        {
+            if ((p.revents & POLLIN) != 0) return 1;
+            if ((p.revents & (POLLHUP | POLLERR)) != 0) return -1;
+        }
+        return 0;
+    }
+
+    fd_streambuf::int_type fd_streambuf::overflow(int_type c)
+    {
+        write_all(pbase(), pptr() - pbase());
+        setp(tx_buf.get(), tx_buf.get() + tx_size);
+        if (not traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            const char_type ch = traits_type::to_char_type(c);
+            if (tx_size == 0) write_all(&ch, 1);
+            else
+            {
+                *pptr() = ch;
+                pbump(1);
+            }
+        }
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize fd_streambuf::xsputn(const char_type* s, std::streamsize n)
+    {
+        if (n <= epptr() - pptr())
+        {
+            std::memcpy(pptr(), s, n);
+            pbump(n);
+            return n;
+        }
+        overflow(traits_type::eof());
+        if (static_cast<std::size_t>(n) >= tx_size) write_all(s, n);
+        else
+        {
+            std::memcpy(pptr(), s, n);
+            pbump(n);
+        }
+        return n;
+    }
+
+    int fd_streambuf::sync()
+    {
+        overflow(traits_type::eof());
+        return 0;
+    }
+
+    void fd_streambuf::write_all(const char_type* s, std::size_t n)
+    {
+        while (n > 0)
+        {
+            const auto written = ::write(file, s, n);
+            if (written >= 0)
+            {
+                s += written;
+                n -= written;
+            }
+            else if (errno == EAGAIN or errno == EWOULDBLOCK) wait_for(file, POLLOUT);
+            else if (errno != EINTR) throw_errno("write");
+        }
+    }
+}
+#endif
@@ -0,0 +1,142 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <numeric>
+#include <jw/midi/file_index.h>
+
+namespace jw::midi
+{
+    // Collects entries for one column_group in file order, then sorts them
+    // into columns.
+    template<typename V>
+    struct column_builder
+    {
+        explicit column_builder(std::size_t keys) : num_keys { keys } { }
+
+        void add(std::size_t key, std::uint64_t tick, std::size_t track, V value)
+        {
+            entries.push_back({ tick, static_cast<std::uint32_t>(key), static_cast<std::uint16_t>(track), std::move(value) });
+        }
+
+        column_group<V> finish()
+        {
+            column_group<V> g;
+            g.offsets.assign(num_keys + 1, 0);
+            for (const auto& e : entries) ++g.offsets[e.key + 1];
+            std::partial_sum(g.offsets.begin(), g.offsets.end(), g.offsets.begin());
+
+            // Counting sort by key keeps file order within each column.
+            // Tracks are added one after another, so a column only needs to
+            // be sorted by tick if more than one track contributed to it.
+            std::vector<std::uint32_t> pos { g.offsets.begin(), g.offsets.end() - 1 };
+            std::vector<std::uint32_t> order(entries.size());
+            for (std::uint32_t i = 0; i < entries.size(); ++i)
+                order[pos[entries[i].key]++] = i;
+
+            auto by_tick = [this](std::uint32_t a, std::uint32_t b) { return entries[a].tick < entries[b].tick; };
+            for (std::size_t k = 0; k < num_keys; ++k)
+            {
+                const auto first = order.begin() + g.offsets[k];
+                const auto last = order.begin() + g.offsets[k + 1];
+                if (not std::is_sorted(first, last, by_tick)) std::stable_sort(first, last, by_tick);
+            }
+
+            g.ticks.reserve(entries.size());
+            g.values.reserve(entries.size());
+            g.tracks.reserve(entries.size());
+            for (const auto i : order)
+            {
+                auto& e = entries[i];
+                g.ticks.push_back(e.tick);
+                g.values.push_back(std::move(e.value));
+                g.tracks.push_back(e.track);
+            }
+            entries.clear();
+            return g;
+        }
+
+    private:
+        struct entry
+        {
+            std::uint64_t tick;
+            std::uint32_t key;
+            std::uint16_t track;
+            V value;
+        };
+
+        const std::size_t num_keys;
+        std::vector<entry> entries;
+    };
+
+    file_index::file_index(const file& f)
+    {
+        column_builder<note_value> note_on { 16 }, note_off { 16 }, key_pressure { 16 };
+        column_builder<byte> control { 16 * 128 }, program { 16 }, channel_pressure { 16 };
+        column_builder<std::uint16_t> pitch { 16 };
+        column_builder<std::chrono::microseconds> tempo { 1 };
+        column_builder<meta::time_signature> time_signature { 1 };
+        column_builder<meta::key_signature> key_signature { 1 };
+        column_builder<meta::smpte_offset> smpte { 1 };
+        column_builder<std::string> text { meta::text::cue_point + 1 };
+
+        for (std::size_t t = 0; t < f.tracks.size(); ++t)
+        {
+            for (const auto& [tick, msgs] : f.tracks[t])
+            {
+                for (const auto& msg : msgs)
+                {
+                    if (auto* c = std::get_if<channel_message>(&msg.category))
+                    {
+                        const unsigned ch = c->channel;
+                        std::visit([&](const auto& m)
+                        {
+                            using T = std::remove_cvref_t<decltype(m)>;
+                            if constexpr (std::is_same_v<T, note_event>)
+                                (m.on ? note_on : note_off).add(ch, tick, t, { static_cast<byte>(m.note), static_cast<byte>(m.velocity) });
+                            else if constexpr (std::is_same_v<T, midi::key_pressure>)
+                                key_pressure.add(ch, tick, t, { static_cast<byte>(m.note), static_cast<byte>(m.value) });
+                            else if constexpr (std::is_same_v<T, control_change>)
+                                control.add(ch * 128 + m.control, tick, t, m.value);
+                            else if constexpr (std::is_same_v<T, program_change>)
+                                program.add(ch, tick, t, m.value);
+                            else if constexpr (std::is_same_v<T, midi::channel_pressure>)
+                                channel_pressure.add(ch, tick, t, m.value);
+                            else if constexpr (std::is_same_v<T, pitch_change>)
+                                pitch.add(ch, tick, t, (m.value.hi << 7) | m.value.lo);
+                        }, c->message);
+                    }
+                    else if (auto* m = std::get_if<meta_message>(&msg.category))
+                    {
+                        std::visit([&](const auto& m)
+                        {
+                            using T = std::remove_cvref_t<decltype(m)>;
+                            if constexpr (std::is_same_v<T, meta::tempo_change>)
+                                tempo.add(0, tick, t, m.quarter_note);
+                            else if constexpr (std::is_same_v<T, meta::time_signature>)
+                                time_signature.add(0, tick, t, m);
+                            else if constexpr (std::is_same_v<T, meta::key_signature>)
+                                key_signature.add(0, tick, t, m);
+                            else if constexpr (std::is_same_v<T, meta::smpte_offset>)
+                                smpte.add(0, tick, t, m);
+                            else if constexpr (std::is_same_v<T, meta::text>)
+                                text.add(m.type, tick, t, m.text);
+                        }, (*m)->message);
+                    }
+                }
+            }
+        }
+
+        note_on_group = note_on.finish();
+        note_off_group = note_off.finish();
+        key_pressure_group = key_pressure.finish();
+        control_group = control.finish();
+        program_group = program.finish();
+        channel_pressure_group = channel_pressure.finish();
+        pitch_group = pitch.finish();
+        tempo_group = tempo.finish();
+        time_signature_group = time_signature.finish();
+        key_signature_group = key_signature.finish();
+        smpte_group = smpte.finish();
+        text_group = text.finish();
+    }
+}
@@ -0,0 +1,143 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/merge.h>
+#include <algorithm>
+#include <thread>
+#if __has_include(<sys/epoll.h>)
+#include <jw/midi/epoll_reactor.h>
+#include <jw/midi/fd_streambuf.h>
+#define JWMIDI_HAVE_EPOLL
+#else
+namespace jw::midi { struct epoll_reactor { }; }
+#endif
+
+namespace jw::midi
+{
+    input_merger::input_merger(clock::duration w, clock::duration p)
+        : window { w }, poll_interval { p } { }
+
+    input_merger::~input_merger() = default;
+    input_merger::input_merger(input_merger&&) noexcept = default;
+
+    std::size_t input_merger::add(std::istream& in)
+    {
+        int fd = -1;
+#       ifdef JWMIDI_HAVE_EPOLL
+        if (auto* const buf = dynamic_cast<fd_streambuf*>(in.rdbuf()))
+        {
+            if (not reactor) reactor = std::make_unique<epoll_reactor>();
+            fd = buf->fd();
+            // Only used to wake up wait(), the data is read by poll().
+            reactor->watch(fd, [](std::uint32_t) { });
+        }
+#       endif
+        sources.push_back({ &in, 0, fd, true });
+        ++active_sources;
+        if (fd < 0) ++polled_sources;
+        return sources.size() - 1;
+    }
+
+    void input_merger::deactivate(source& src)
+    {
+        src.active = false;
+        --active_sources;
+        if (src.fd < 0) --polled_sources;
+#       ifdef JWMIDI_HAVE_EPOLL
+        else reactor->unwatch(src.fd);
+#       endif
+    }
+
+    std::size_t input_merger::poll(std::size_t max_per_source)
+    {
+        std::size_t n = 0;
+        backlog = false;
+        for (std::size_t i = 0; i < sources.size(); ++i)
+        {
+            auto& src = sources[i];
+            if (not src.active) continue;
+            std::size_t j = 0;
+            for (; j < max_per_source; ++j)
+            {
+                message msg;
+                const auto status = try_extract(*src.stream, msg);
+                if (status == extract_status::ok)
+                {
+                    ++n;
+                    if (msg.is_realtime_message())
+                        realtime_queue.push_back({ i, std::move(msg) });
+                    else
+                    {
+                        heap.push_back({ sequence++, { i, std::move(msg) } });
+                        std::push_heap(heap.begin(), heap.end(), later);
+                    }
+                    continue;
+                }
+                if (status == extract_status::would_block) break;
+                if (status == extract_status::invalid_status or status == extract_status::unexpected_status)
+                {
+                    ++src.errors;
+                    continue;
+                }
+                deactivate(src);
+                break;
+            }
+            // Remaining bytes may already be buffered in the streambuf, where
+            // epoll can not see them.
+            if (j == max_per_source) backlog = true;
+        }
+        return n;
+    }
+
+    std::optional<input_merger::merged_message> input_merger::try_get()
+    {
+        if (not realtime_queue.empty())
+        {
+            auto msg = std::move(realtime_queue.front());
+            realtime_queue.pop_front();
+            return { std::move(msg) };
+        }
+        if (heap.empty()) return std::nullopt;
+        if (window > clock::duration::zero() and heap.front().msg.msg.time + window > clock::now())
+            return std::nullopt;
+        std::pop_heap(heap.begin(), heap.end(), later);
+        auto msg = std::move(heap.back().msg);
+        heap.pop_back();
+        return { std::move(msg) };
+    }
+
+    // Sleep until new input may be available, or the first held-back
+    // message is due.
+    void input_merger::wait()
+    {
+        if (backlog) return;
+        auto delay = clock::duration::max();
+        if (not heap.empty())
+        {
+            delay = heap.front().msg.msg.time + window - clock::now();
+            if (delay <= clock::duration::zero()) return;
+        }
+        if (polled_sources > 0) delay = std::min(delay, poll_interval);
+
+#       ifdef JWMIDI_HAVE_EPOLL
+        if (reactor)
+        {
+            reactor->run_once(delay == clock::duration::max() ? std::chrono::nanoseconds { -1 }
+                                                              : std::chrono::ceil<std::chrono::nanoseconds>(delay));
+            return;
+        }
+#       endif
+        std::this_thread::sleep_for(delay);
+    }
+
+    std::optional<input_merger::merged_message> input_merger::get()
+    {
+        while (true)
+        {
+            poll();
+            if (auto msg = try_get()) return msg;
+            if (active_sources == 0 and heap.empty()) return std::nullopt;
+            wait();
+        }
+    }
+}
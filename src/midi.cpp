@@ -3,514 +3,120 @@
 
 #include <jw/midi/message.h>
 #include <jw/midi/file.h>
-#include <jw/io/realtime_streambuf.h>
+#include <jw/midi/statistics.h>
+#include <jw/midi/encode.h>
+#include <jw/midi/policy.h>
+#include "codec.h"
 #include <list>
 #include <mutex>
 #include <cxxabi.h>
 
 namespace jw::midi
 {
-    struct istream_info
-    {
-        config::rx_mutex mutex { };
-        std::vector<byte> pending_msg { };
-        clock::time_point pending_msg_time;
-        byte last_status { 0 };
-    };
-    struct ostream_info
-    {
-        config::tx_mutex mutex { };
-        byte last_status { 0 };
-        bool realtime { false };
-    };
-
-    template<typename T>
-    static void delete_pword(std::ios_base::event e, std::ios_base& stream, int i)
-    {
-        if (e != std::ios_base::erase_event) return;
-        void*& p = stream.pword(i);
-        if (p == nullptr) return;
-        delete static_cast<T*>(p);
-        p = nullptr;
-    }
-
-    template <typename T, typename S>
-    static T* get_pword(int i, S& stream)
-    {
-        void*& p = stream.pword(i);
-        if (p == nullptr) [[unlikely]]
-        {
-            p = new T { };
-            if (stream.iword(i)++ == 0) stream.register_callback(delete_pword<T>, i);
-            if constexpr (config::rdbuf_never_changes and std::is_same_v<T, ostream_info>)
-                if (dynamic_cast<io::realtime_streambuf*>(stream.rdbuf()) != nullptr)
-                    static_cast<ostream_info*>(p)->realtime = true;
-        }
-        return static_cast<T*>(p);
-    }
+    istream_statistics rx_statistics(std::istream& stream) { return rx_statistics<default_policy>(stream); }
+    ostream_statistics tx_statistics(std::ostream& stream) { return tx_statistics<default_policy>(stream); }
+    void reset_statistics(std::istream& stream) { reset_statistics<default_policy>(stream); }
+    void reset_statistics(std::ostream& stream) { reset_statistics<default_policy>(stream); }
 
-    static istream_info& rx_state(std::istream& stream)
-    {
-        static const int i = std::ios_base::xalloc();
-        return *get_pword<istream_info>(i, stream);
-    }
+    std::ostream& clear_status(std::ostream& stream) { return clear_status<default_policy>(stream); }
 
-    static ostream_info& tx_state(std::ostream& stream)
-    {
-        static const int i = std::ios_base::xalloc();
-        return *get_pword<ostream_info>(i, stream);
-    }
+    void emit(std::ostream& out, const untimed_message& msg) { emit<default_policy>(out, msg); }
+    void emit_bytes(std::ostream& out, std::span<const byte> data) { emit_bytes<default_policy>(out, data); }
 
-    std::ostream& clear_status(std::ostream& stream)
-    {
-        auto& tx = tx_state(stream);
-        std::unique_lock lock { tx.mutex };
-        tx.last_status = 0;
-        return stream;
-    }
-
-    static constexpr bool is_status(byte b) { return (b & 0x80) != 0; }
-    static constexpr bool is_realtime(byte b) { return b >= 0xf8; }
-    static constexpr bool is_system(byte b) { return b >= 0xf0; }
+    message extract(std::istream& in) { return extract<default_policy>(in); }
+    message try_extract(std::istream& in) { return try_extract<default_policy>(in); }
+    extract_status extract(std::istream& in, message& out) { return extract<default_policy>(in, out); }
+    extract_status try_extract(std::istream& in, message& out) { return try_extract<default_policy>(in, out); }
 
-    struct midi_out
+    struct file_buffer : chunk_reader
     {
-        static constexpr std::size_t buffer_size = 4;
-
-        midi_out(std::ostream& o) : out { o }, rdbuf { o.rdbuf() }, tx { tx_state(o) } { }
-
-        void emit(const untimed_message& in)
+        file_buffer(std::streambuf* buf, std::size_t size)
+            : chunk_reader { nullptr, nullptr }, data { new byte[size] }
         {
-            if (not in.valid() or in.is_meta_message()) [[unlikely]] return;
-            std::unique_lock lock { tx.mutex, std::defer_lock };
-            if (not in.is_realtime_message()) lock.lock();
-            std::ostream::sentry sentry { out };
-            if (not sentry) [[unlikely]] return;
-            try
-            {
-                const auto* begin = data.cbegin();
-                if (auto* t = std::get_if<realtime>(&in.category))
-                {
-                    put_realtime(static_cast<byte>(*t) + 0xf8);
-                    return;
-                }
-                else if (auto* t = std::get_if<channel_message>(&in.category))
-                {
-                    visit([this, t](auto&& msg) { (*this)(t->channel, msg); }, t->message);
-                    bool running_status = tx.last_status == data[0];
-                    begin += running_status;
-                    size -= running_status;
-                    tx.last_status = data[0];
-                }
-                else if (auto* t = std::get_if<system_message>(&in.category))
-                {
-                    visit(*this, t->message);
-                    if (size > 0) tx.last_status = 0;
-                }
-
-                if (size > 0) [[likely]]
-                    rdbuf->sputn(reinterpret_cast<const char*>(begin), size);
-            }
-            catch (const abi::__forced_unwind&) { throw; }
-            catch (...) { out._M_setstate(std::ios::badbit); }
-        }
-
-        void operator()(byte ch, const note_event& msg)
-        {
-            const byte on = 0x90 | ch;
-            const byte off = 0x80 | ch;
-            if ((config::optimize_note_off or msg.velocity == 0x40) and not msg.on and tx.last_status == on)
-                put(on, msg.note, 0x00);
-            else
-                put(msg.on ? on : off, msg.note, msg.velocity);
-        }
-
-        void operator()(byte ch, const key_pressure& msg)
-        {
-            put(0xa0 | ch, msg.note, msg.value);
-        }
-
-        void operator()(byte ch, const control_change& msg)
-        {
-            put(0xb0 | ch, msg.control, msg.value);
-        }
-
-        void operator()(byte ch, const program_change& msg)
-        {
-            put(0xc0 | ch, msg.value);
-        }
-
-        void operator()(byte ch, const channel_pressure& msg)
-        {
-            put(0xd0 | ch, msg.value);
-        }
-
-        void operator()(byte ch, const pitch_change& msg)
-        {
-            put(0xe0 | ch, msg.value.lo, msg.value.hi);
-        }
-
-        void operator()(const sysex& msg)
-        {
-            bool in_sysex = false;
-            auto i = msg.data.cbegin();
-            const auto end = msg.data.cend();
-            while (true)
-            {
-                if (not in_sysex)
-                {
-                    for (; i != end; ++i)
-                    {
-                        if (not is_status(*i)) continue;
-                        if (is_realtime(*i)) continue;
-                        if (*i == 0xf0) break;
-                        if (is_system(*i)) tx.last_status = 0;
-                        else tx.last_status = *i;
-                    }
-                }
-                else i = std::find(i, end, 0xf7);
-                if (i == end) break;
-                in_sysex ^= true;
-            }
-            rdbuf->sputn(reinterpret_cast<const char*>(msg.data.data()), msg.data.size());
-            size = 0;
-        }
-
-        void operator()(const mtc_quarter_frame& msg)
-        {
-            put(0xf1, msg.data);
-        }
-
-        void operator()(const song_position& msg)
-        {
-            put(0xf2, msg.value.lo, msg.value.hi);
-        }
-
-        void operator()(const song_select& msg)
-        {
-            put(0xf3, msg.value);
-        }
-
-        void operator()(const tune_request&)
-        {
-            put(0xf6);
+            i = data.get();
+            last = data.get() + size;
+            const std::size_t bytes_read = buf->sgetn(reinterpret_cast<char*>(data.get()), size);
+            if (bytes_read < size) throw io::end_of_file { };
         }
 
     private:
-        void put_realtime(byte a)
-        {
-            if constexpr (config::rdbuf_never_changes)
-            {
-                if (tx.realtime) return static_cast<jw::io::realtime_streambuf*>(rdbuf)->put_realtime(a);
-            }
-            else if (auto* rtbuf = dynamic_cast<io::realtime_streambuf*>(rdbuf))
-            {
-                return rtbuf->put_realtime(a);
-            }
-            rdbuf->sputc(a);
-        }
-
-        template<unsigned I = 0, typename... T>
-        void put(std::uint8_t v, T... list)
-        {
-            data[I] = v;
-            put<I + 1>(list...);
-        }
-
-        template<unsigned I> void put()
-        {
-            static_assert(I <= buffer_size);
-            size = I;
-        }
-
-        std::ostream& out;
-        std::streambuf* const rdbuf;
-        ostream_info& tx;
-        std::size_t size;
-        std::array<byte, buffer_size> data;
+        std::unique_ptr<byte[]> data;
     };
 
-    void emit(std::ostream& out, const untimed_message& msg)
+    // Reads SMF data from a streambuf through a fixed-size window.  Reads
+    // are bounded by the size of the current chunk.
+    struct window_reader : smf_reader<window_reader>
     {
-        midi_out { out }.emit(msg);
-    }
-
-    struct unexpected_status { };
+        window_reader(std::streambuf* buf, byte* window, std::size_t size) noexcept
+            : rdbuf { buf }, first { window }, window_size { size }, i { window }, last { window } { }
 
-    static constexpr std::size_t msg_size(byte status)
-    {
-        switch (status & 0xf0)
+        template<typename T>
+        void read(T* dst, std::size_t n)
         {
-        case 0x80:
-        case 0x90: return 2;
-        case 0xa0: return 2;
-        case 0xb0: return 2;
-        case 0xc0: return 1;
-        case 0xd0: return 1;
-        case 0xe0: return 2;
-        case 0xf0:
-            switch (status)
+            if (n > chunk_left) throw io::failure { "read past end of chunk" };
+            chunk_left -= n;
+            auto* out = reinterpret_cast<byte*>(dst);
+            while (n > 0)
             {
-            case 0xf0: return -2;
-            case 0xf1: return 1;
-            case 0xf2: return 2;
-            case 0xf3: return 1;
-            case 0xf6: return 0;
-            case 0xf4:
-            case 0xf5:
-            case 0xf7:
-            case 0xf9:
-            case 0xfd: throw io::failure { "invalid status byte" };
-            default: return 0;
+                if (i == last) refill();
+                const std::size_t k = std::min<std::size_t>(n, last - i);
+                std::copy_n(i, k, out);
+                i += k;
+                out += k;
+                n -= k;
             }
-        default: __builtin_unreachable();
         }
-    }
 
-    static untimed_message realtime_msg(byte status)
-    {
-        switch (status)
+        std::uint8_t read_8()
         {
-        case 0xf8:
-        case 0xfa:
-        case 0xfb:
-        case 0xfc:
-        case 0xfe:
-        case 0xff: return { static_cast<realtime>(status - 0xf8) };
-        case 0xf9:
-        case 0xfd: throw io::failure { "invalid status byte" };
-        default: __builtin_unreachable();
+            if (chunk_left == 0) throw io::failure { "read past end of chunk" };
+            --chunk_left;
+            if (i == last) refill();
+            return *i++;
         }
-    }
 
-    template<typename I>
-    static untimed_message make_msg(byte status, I i)
-    {
-        const unsigned ch = status & 0x0f;
-        switch (status & 0xf0)
+        // Skip chunks until one with the given id is found.
+        void find_chunk(std::string_view want)
         {
-        case 0x80:
-        case 0x90:
-            {
-                byte vel = i[1];
-                bool on = (status & 0x10) != 0;
-                if (on and vel == 0)
-                {
-                    on = false;
-                    vel = 0x40;
-                }
-                return { ch, note_event { i[0], vel, on } };
-            }
-        case 0xa0: return { ch, key_pressure     { i[0], i[1] } };
-        case 0xb0: return { ch, control_change   { i[0], i[1] } };
-        case 0xc0: return { ch, program_change   { i[0] } };
-        case 0xd0: return { ch, channel_pressure { i[0] } };
-        case 0xe0: return { ch, pitch_change     { { i[0], i[1] } } };
-        case 0xf0:
-            switch (status)
+            std::array<char, 4> id;
+            do
             {
-            case 0xf0: __builtin_unreachable();
-            case 0xf1: return { mtc_quarter_frame { i[0] } };
-            case 0xf2: return { song_position     { { i[0], i[1] } } };
-            case 0xf3: return { song_select       { i[0] } };
-            case 0xf6: return { tune_request      { } };
-            case 0xf4:
-            case 0xf5:
-            case 0xf7: throw io::failure { "invalid status byte" };
-            default: return realtime_msg(status);
-            }
-        default: __builtin_unreachable();
+                chunk_left = 8;
+                read(id.data(), 4);
+                const std::size_t size = read_32();
+                chunk_left = size;
+                if (std::string_view { id.data(), 4 } == want) return;
+                skip_chunk();
+            } while (true);
         }
-    }
-
-    template<bool dont_block>
-    static message do_extract(std::istream& in)
-    {
-        auto& rx { rx_state(in) };
-        std::unique_lock lock { rx.mutex };
-        auto* const buf { in.rdbuf() };
-        std::istream::sentry sentry { in, true };
-        if (not sentry) return { };
 
-        auto peek = [&]() -> std::optional<byte>
+        // Discard the remainder of the current chunk.
+        void skip_chunk()
         {
-            if (dont_block and buf->in_avail() == 0)
-            {
-                buf->pubsync();
-                if (buf->in_avail() == 0) return { };
-            }
-            auto b = buf->sgetc();
-            if (b == std::char_traits<char>::eof()) throw io::end_of_file { };
-            return { static_cast<byte>(b) };
-        };
-
-        auto get = [&]
-        {
-            auto b = peek();
-            if (b)
-            {
-                buf->sbumpc();
-                if (not is_realtime(*b)) rx.pending_msg.push_back(*b);
-            }
-            return b;
-        };
-
-        try
-        {
-            byte status = rx.last_status;
-
-            // Wait for data to arrive
-            if (rx.pending_msg.empty())
-            {
-                // Discard data until the first status byte
-                if (status == 0) while (true)
-                {
-                    const auto b = peek();
-                    if (not b) return { };
-                    if (is_status(*b) and *b != 0xf7) break;
-                    buf->sbumpc();
-                }
-                const auto b = get();
-                if (not b) return { };
-                rx.pending_msg_time = clock::now();
-                if (is_realtime(*b)) return message { realtime_msg(*b), rx.pending_msg_time };
-            }
-
-            // Check for new status byte
-            bool new_status = false;
-            if (is_status(rx.pending_msg.front()))
+            while (chunk_left > 0)
             {
-                status = rx.pending_msg.front();
-                new_status = true;
+                if (i == last) refill();
+                const std::size_t k = std::min<std::size_t>(chunk_left, last - i);
+                i += k;
+                chunk_left -= k;
             }
-
-            // Read bytes from streambuf
-            const bool is_sysex = status == 0xf0;
-            while (rx.pending_msg.size() < msg_size(status) + new_status)
-            {
-                const auto b = get();
-                if (not b) return { };
-                if (is_realtime(*b)) return message { realtime_msg(*b), clock::now() };
-                if (is_status(*b))
-                {
-                    if (is_sysex and *b == 0xf7) break;
-                    rx.pending_msg_time = clock::now();
-                    rx.pending_msg.clear();
-                    rx.pending_msg.push_back(*b);
-                    throw unexpected_status { };
-                }
-            }
-
-            // Store running status
-            if (is_system(status)) rx.last_status = 0;
-            else rx.last_status = status;
-
-            local_destructor clear_pending_on_return { [&rx] { rx.pending_msg.clear(); } };
-
-            // Construct the message
-            if (is_sysex) return { sysex { { rx.pending_msg.cbegin(), rx.pending_msg.cend() } }, rx.pending_msg_time };
-            else return message { make_msg(status, rx.pending_msg.cbegin() + new_status), rx.pending_msg_time };
-        }
-        catch (const io::failure&)
-        {
-            rx.pending_msg.clear();
-            rx.last_status = 0;
-            in._M_setstate(std::ios::failbit);
-        }
-        catch (const unexpected_status&)
-        {
-            try { in._M_setstate(std::ios::failbit); }
-            catch (const unexpected_status&) { }
-            throw io::failure { "unexpected status byte" };
-        }
-        catch (const io::end_of_file&) { in._M_setstate(std::ios::eofbit); }
-        catch (const abi::__forced_unwind&) { throw; }
-        catch (...) { in._M_setstate(std::ios::badbit); }
-        return { };
-    }
-
-    message extract(std::istream& in) { return do_extract<false>(in); }
-    message try_extract(std::istream& in) { return do_extract<true>(in); }
-
-    struct file_buffer
-    {
-        file_buffer(std::streambuf* buf, std::size_t s)
-            : size { s }, data { new byte[size] }, i { begin() }
-        {
-            const std::size_t bytes_read = buf->sgetn(reinterpret_cast<char*>(data.get()), size);
-            if (bytes_read < size) throw io::end_of_file { };
-        }
-
-        template<typename T>
-        void read(T* dst, std::size_t n)
-        {
-            if (i + n > end()) throw io::failure { "read past end of chunk" };
-            for (unsigned j = 0; j < n; ++j)
-                reinterpret_cast<byte*>(dst)[j] = i[j];
-            i += n;
-            return;
-        }
-
-        std::uint32_t read_32()
-        {
-            union
-            {
-                std::array<byte, 4> raw;
-                std::uint32_t value;
-            };
-            read(raw.data(), 4);
-            return __builtin_bswap32(value);
-        }
-
-        std::uint32_t read_24()
-        {
-            union
-            {
-                std::array<byte, 4> raw;
-                std::uint32_t value;
-            };
-            raw[0] = 0;
-            read(raw.data() + 1, 3);
-            return __builtin_bswap32(value);
-        }
-
-        std::uint16_t read_16()
-        {
-            union
-            {
-                std::array<byte, 2> raw;
-                std::uint16_t value;
-            };
-            read(raw.data(), 2);
-            return __builtin_bswap16(value);
-        }
-
-        std::uint8_t read_8()
-        {
-            if (i == end()) throw io::failure { "read past end of chunk" };
-            return *i++;
         }
 
-        std::uint32_t read_vlq()
+    private:
+        void refill()
         {
-            std::uint32_t value { };
-            byte b;
-            do
-            {
-                b = read_8();
-                value <<= 7;
-                value |= b & 0x7f;
-            } while ((b & 0x80) != 0);
-            return value;
+            const auto n = rdbuf->sgetn(reinterpret_cast<char*>(first), window_size);
+            if (n <= 0) throw io::end_of_file { };
+            i = first;
+            last = first + n;
         }
 
-        const byte* begin() const noexcept { return data.get(); }
-        const byte* end() const noexcept { return data.get() + size; }
-
-    private:
-        const std::size_t size;
-        std::unique_ptr<byte[]> data;
+        std::streambuf* const rdbuf;
+        byte* const first;
+        const std::size_t window_size;
         const byte* i;
+        const byte* last;
+        std::size_t chunk_left { 0 };
     };
 
     static std::size_t find_chunk(std::streambuf* buf, std::string_view want)
@@ -544,33 +150,95 @@ namespace jw::midi
         } while (true);
     }
 
-    static auto text_type(byte type) noexcept
+    // Total size of the 0xf7 continuation events that directly follow an
+    // unterminated sysex, up to the one that terminates it.  Only used to
+    // preallocate the reassembly buffer, so this gives up on anything
+    // unexpected.
+    static std::size_t sysex_continuation_size(chunk_reader scan) noexcept
     {
-        switch (type)
+        std::size_t total = 0;
+        try
         {
-        case 0x01: return meta::text::any;
-        case 0x02: return meta::text::copyright;
-        case 0x03: return meta::text::track_name;
-        case 0x04: return meta::text::instrument_name;
-        case 0x05: return meta::text::lyric;
-        case 0x06: return meta::text::marker;
-        case 0x07: return meta::text::cue_point;
-        default: __builtin_unreachable();
+            while (scan.remaining() > 0)
+            {
+                scan.read_vlq();
+                if (scan.read_8() != 0xf7) break;
+                const std::size_t size = scan.read_vlq();
+                if (size > scan.remaining()) break;
+                total += size;
+                const byte* const next = scan.position() + size;
+                if (size > 0 and next[-1] == 0xf7) break;
+                scan = chunk_reader { next, next + (scan.remaining() - size) };
+            }
         }
+        catch (const io::failure&) { }
+        return total;
     }
 
-    static void read_track(file::track& trk, file_buffer& buf)
+    // Decode a track chunk.  For each event, at(tick) returns a container
+    // to which the decoded messages are appended.  If 'reassemble' is set,
+    // the container must be a std::vector<untimed_message> with stable
+    // address, and the packet layout of each joined sysex is appended to
+    // 'layouts'.
+    template<bool reassemble = false, typename R, typename F>
+    static void decode_track(R& buf, F&& at, std::vector<file::sysex_layout>* layouts = nullptr)
     {
         std::array<byte, 8> v;
+        std::vector<byte> packet;
         bool in_sysex = false;
         byte last_status = 0;
         std::uint64_t time = 0;
         decltype(meta::channel) meta_ch { };
 
+        // Sysex message currently being joined.
+        std::vector<untimed_message>* open_where = nullptr;
+        file::sysex_layout open_layout { };
+
+        auto open_data = [&]() -> std::vector<byte>&
+        {
+            auto& msg = (*open_where)[open_layout.index];
+            return std::get_if<sysex>(&std::get_if<system_message>(&msg.category)->message)->data;
+        };
+
+        auto close_sysex = [&]
+        {
+            if (open_where == nullptr) return;
+            if (open_layout.packets.size() > 1) layouts->push_back(std::move(open_layout));
+            open_where = nullptr;
+            open_layout = { };
+        };
+
+        auto open_sysex = [&](std::vector<untimed_message>& where)
+        {
+            open_where = &where;
+            open_layout = { time, where.size() - 1, { { 0, 0 } } };
+        };
+
+        // Append one piece of sysex data.  'first' is true if it begins with
+        // 0xf0.  in_sysex must be updated before calling this.
+        auto put_sysex = [&](auto& pos, const byte* begin, const byte* end, bool first)
+        {
+            if constexpr (reassemble)
+            {
+                if (first) close_sysex();
+                else if (open_where != nullptr)
+                {
+                    auto& data = open_data();
+                    open_layout.packets.push_back({ data.size(), time - open_layout.tick });
+                    data.insert(data.end(), begin, end);
+                    if (not in_sysex) close_sysex();
+                    return;
+                }
+            }
+            pos.emplace_back(sysex { { begin, end } });
+            if constexpr (reassemble)
+                if (first and in_sysex) open_sysex(pos);
+        };
+
         while (true)
         {
             time += buf.read_vlq();
-            auto& pos = trk.emplace_hint(trk.end(), std::piecewise_construct, std::make_tuple(time), std::make_tuple())->second;
+            auto& pos = at(time);
             const byte b = buf.read_8();
             switch (b)
             {
@@ -581,21 +249,6 @@ namespace jw::midi
                     const std::size_t size = buf.read_vlq();
                     switch (type)
                     {
-                    case 0x00:
-                        if (size != 2) throw io::failure { "incorrect message size" };
-                        pos.emplace_back(meta_ch, meta::sequence_number { buf.read_16() });
-                        break;
-
-                    case 0x01: case 0x02: case 0x03: case 0x04:
-                    case 0x05: case 0x06: case 0x07:
-                        {
-                            meta::text msg { text_type(type), { } };
-                            msg.text.resize(size);
-                            buf.read(msg.text.data(), size);
-                            pos.emplace_back(meta_ch, std::move(msg));
-                            break;
-                        }
-
                     case 0x20:
                         {
                             if (size != 1) throw io::failure { "incorrect message size" };
@@ -606,45 +259,11 @@ namespace jw::midi
                         }
 
                     case 0x2f:
+                        if constexpr (reassemble) close_sysex();
                         return;
 
-                    case 0x51:
-                        if (size != 3) throw io::failure { "incorrect message size" };
-                        pos.emplace_back(meta_ch, meta::tempo_change { std::chrono::microseconds { buf.read_24() } });
-                        break;
-
-                    case 0x54:
-                        {
-                            if (size != 5) throw io::failure { "incorrect message size" };
-                            buf.read(v.data(), 5);
-                            pos.emplace_back(meta_ch, meta::smpte_offset { v[0], v[1], v[2], v[3], v[4] });
-                            break;
-                        }
-
-                    case 0x58:
-                        {
-                            if (size != 4) throw io::failure { "incorrect message size" };
-                            buf.read(v.data(), 4);
-                            pos.emplace_back(meta_ch, meta::time_signature { v[0], v[1], v[2], v[3] });
-                            break;
-                        }
-
-                    case 0x59:
-                        {
-                            if (size != 2) throw io::failure { "incorrect message size" };
-                            buf.read(v.data(), 2);
-                            pos.emplace_back(meta_ch, meta::key_signature { v[0], v[1] != 0 });
-                            break;
-                        }
-
                     default:
-                        {
-                            meta::unknown msg { type, { } };
-                            msg.data.resize(size);
-                            buf.read(msg.data.data(), size);
-                            pos.emplace_back(meta_ch, std::move(msg));
-                            break;
-                        }
+                        pos.push_back(read_meta(type, size, buf, meta_ch));
                     }
                     break;
                 }
@@ -653,64 +272,80 @@ namespace jw::midi
                 {
                     last_status = 0;
                     meta_ch.reset();
-                    std::vector<byte> data { };
                     const std::size_t size = buf.read_vlq();
-                    data.reserve(size);
-                    for (unsigned i = 0; i < size; ++i)
-                    {
-                        const byte b = buf.read_8();
-                        data.push_back(b);
 
-                        switch (b)
+                    // Continuation of a sysex being joined: read straight
+                    // into its buffer.  Anything after the terminating 0xf7
+                    // is moved out again, and decoded as an escape sequence.
+                    if constexpr (reassemble)
+                    {
+                        if (in_sysex and open_where != nullptr and size > 0)
                         {
-                        case 0xf0:
-                            last_status = 0;
-                            in_sysex = true;
-                            for (; i < size; ++i)
-                            {
-                                const byte b = buf.read_8();
-                                data.push_back(b);
-                                if (b == 0xf7) break;
-                            }
-                            if (i == size) break;
-                            [[fallthrough]];
-                        case 0xf7:
-                            pos.emplace_back(sysex { std::move(data) });
-                            if (i < size)
+                            auto& data = open_data();
+                            const std::size_t offset = data.size();
+                            data.resize(offset + size);
+                            buf.read(data.data() + offset, size);
+                            const auto end = std::find(data.begin() + offset, data.end(), 0xf7);
+                            packet.clear();
+                            if (end != data.end())
                             {
-                                data = { };
-                                data.reserve(size - i);
+                                packet.assign(end + 1, data.end());
+                                data.erase(end + 1, data.end());
+                                in_sysex = false;
                             }
-                            last_status = 0;
-                            in_sysex = false;
-                            break;
+                            open_layout.packets.push_back({ offset, time - open_layout.tick });
+                            if (not in_sysex) close_sysex();
+                        }
+                        else
+                        {
+                            packet.resize(size);
+                            buf.read(packet.data(), size);
+                        }
+                    }
+                    else
+                    {
+                        packet.resize(size);
+                        buf.read(packet.data(), size);
+                    }
 
-                        default:
-                            if (not in_sysex)
-                            {
-                                byte status = last_status;
-                                if (is_status(b)) status = b;
-                                if (status == 0) throw io::failure { "no status byte" };
-
-                                for (unsigned j = not is_status(b); j < msg_size(status); ++i, ++j)
-                                {
-                                    if (i == size) throw io::failure { "message extends past end of escape" };
-                                    const byte b = buf.read_8();
-                                    data.push_back(b);
-                                }
-
-                                if (not is_realtime(status))
-                                {
-                                    if (is_system(status)) last_status = 0;
-                                    else last_status = status;
-                                }
-
-                                pos.emplace_back(make_msg(status, data.data() + is_status(b)));
-                                data.clear();
-                            }
+                    const byte* p = packet.data();
+                    const byte* const end = p + packet.size();
+                    while (p != end)
+                    {
+                        if (in_sysex or *p == 0xf0)
+                        {
+                            // Sysex data, up to and including 0xf7.
+                            const bool first = not in_sysex;
+                            const byte* q = std::find(p, end, 0xf7);
+                            if (q != end) ++q;
+                            in_sysex = q[-1] != 0xf7;
+                            put_sysex(pos, p, q, first);
+                            p = q;
+                            continue;
+                        }
+
+                        if (*p == 0xf7)
+                        {
+                            pos.emplace_back(sysex { { p, p + 1 } });
+                            ++p;
+                            continue;
+                        }
+
+                        byte status = last_status;
+                        if (is_status(*p)) status = *p++;
+                        if (status == 0) throw io::failure { "no status byte" };
+                        const std::size_t n = msg_size(status);
+                        if (static_cast<std::size_t>(end - p) < n) throw io::failure { "message extends past end of escape" };
+
+                        if (not is_realtime(status))
+                        {
+                            if (is_system(status)) last_status = 0;
+                            else last_status = status;
                         }
+
+                        pos.emplace_back(make_msg(status, p));
+                        p += n;
                     }
-                    if (data.size() > 0) pos.emplace_back(sysex { std::move(data) });
                     last_status = 0;
                     break;
                 }
@@ -721,18 +356,30 @@ namespace jw::midi
                     meta_ch.reset();
                     const std::size_t size = buf.read_vlq();
                     sysex msg { };
+                    if constexpr (reassemble and std::is_base_of_v<chunk_reader, R>)
+                    {
+                        close_sysex();
+                        if (size > 0 and size <= buf.remaining() and buf.position()[size - 1] != 0xf7)
+                        {
+                            const byte* const next = buf.position() + size;
+                            msg.data.reserve(size + 1 + sysex_continuation_size({ next, next + (buf.remaining() - size) }));
+                        }
+                    }
                     msg.data.resize(size + 1);
                     msg.data[0] = 0xf0;
                     buf.read(msg.data.data() + 1, size);
                     in_sysex = true;
                     if (msg.data.back() == 0xf7) in_sysex = false;
                     pos.emplace_back(std::move(msg));
+                    if constexpr (reassemble)
+                        if (in_sysex) open_sysex(pos);
                     break;
                 }
 
             default:    // Channel message
                 {
                     in_sysex = false;
+                    if constexpr (reassemble) close_sysex();
                     meta_ch.reset();
                     auto* i = v.data();
                     byte status = last_status;
@@ -754,14 +401,47 @@ namespace jw::midi
                         else last_status = status;
                     }
 
-                    pos.emplace_back(make_msg(status, i));
+                    pos.emplace_back(make_msg(status, v.data()));
                     break;
                 }
             }
         }
     }
 
-    file file::read(std::istream& in)
+    static void read_track(file::track& trk, chunk_reader& buf, std::vector<file::sysex_layout>* layouts = nullptr)
+    {
+        auto at = [&trk](std::uint64_t time) -> auto&
+        {
+            return trk.emplace_hint(trk.end(), std::piecewise_construct, std::make_tuple(time), std::make_tuple())->second;
+        };
+        if (layouts != nullptr) decode_track<true>(buf, at, layouts);
+        else decode_track(buf, at);
+    }
+
+    template<typename R>
+    static std::size_t read_header(R& buf, bool& asynchronous_tracks, decltype(file::time_division)& time_division)
+    {
+        const std::uint16_t format = buf.read_16();
+        const std::size_t num_tracks = buf.read_16();
+        const split_uint16_t division = buf.read_16();
+
+        if (format == 0 and num_tracks != 1) throw io::failure { "incorrect number of tracks" };
+        if (format > 2) throw io::failure { "invalid format" };
+        asynchronous_tracks = format == 2;
+
+        if ((division & 0x8000) == 0) time_division.emplace<unsigned>(division);
+        else time_division.emplace<file::smpte_format>(-static_cast<int8_t>(division.hi), division.lo);
+
+        return num_tracks;
+    }
+
+    static std::size_t read_header(std::streambuf* rdbuf, bool& asynchronous_tracks, decltype(file::time_division)& time_division)
+    {
+        file_buffer buf { rdbuf, find_chunk(rdbuf, "MThd") };
+        return read_header(buf, asynchronous_tracks, time_division);
+    }
+
+    file file::read(std::istream& in, const read_options& options)
     {
         file output { };
         auto* const rdbuf { in.rdbuf() };
@@ -770,29 +450,160 @@ namespace jw::midi
 
         try
         {
-            file_buffer buf { rdbuf, find_chunk(rdbuf, "MThd") };
-            const std::uint16_t format = buf.read_16();
-            const std::size_t num_tracks = buf.read_16();
-            const split_uint16_t division = buf.read_16();
+            output.tracks.resize(read_header(rdbuf, output.asynchronous_tracks, output.time_division));
+            if (options.reassemble_sysex) output.sysex_layouts.resize(output.tracks.size());
+
+            for (std::size_t i = 0; i < output.tracks.size(); ++i)
+            {
+                file_buffer buf { rdbuf, find_chunk(rdbuf, "MTrk") };
+                read_track(output.tracks[i], buf, options.reassemble_sysex ? &output.sysex_layouts[i] : nullptr);
+            }
+        }
+        catch (const io::failure&) { in._M_setstate(std::ios::failbit); }
+        catch (const io::end_of_file&) { in._M_setstate(std::ios::eofbit); }
+        catch (const abi::__forced_unwind&) { throw; }
+        catch (...) { in._M_setstate(std::ios::badbit); }
+        return output;
+    }
 
-            if (format == 0 and num_tracks != 1) throw io::failure { "incorrect number of tracks" };
-            if (format > 2) throw io::failure { "invalid format" };
-            output.asynchronous_tracks = format == 2;
-            output.tracks.resize(num_tracks);
+    // Passes messages from decode_track() to a file_parser callback.
+    struct parser_sink
+    {
+        const file_parser::callback& cb;
+        const std::size_t track;
+        std::uint64_t tick;
 
-            if ((division & 0x8000) == 0) output.time_division.emplace<unsigned>(division);
-            else output.time_division.emplace<smpte_format>(-static_cast<int8_t>(division.hi), division.lo);
+        void push_back(untimed_message&& msg) { cb(track, tick, std::move(msg)); }
 
-            for (auto& trk : output.tracks)
+        template<typename... A>
+        void emplace_back(A&&... args) { cb(track, tick, untimed_message { std::forward<A>(args)... }); }
+    };
+
+    void file_parser::parse(std::istream& in, const callback& cb)
+    {
+        std::istream::sentry sentry { in, true };
+        if (not sentry) return;
+
+        try
+        {
+            window_reader buf { in.rdbuf(), window.get(), size };
+            buf.find_chunk("MThd");
+            num_tracks = read_header(buf, asynchronous_tracks, time_division);
+            buf.skip_chunk();
+
+            for (std::size_t i = 0; i < num_tracks; ++i)
             {
-                file_buffer buf { rdbuf, find_chunk(rdbuf, "MTrk") };
-                read_track(trk, buf);
+                buf.find_chunk("MTrk");
+                parser_sink sink { cb, i, 0 };
+                decode_track(buf, [&sink](std::uint64_t time) -> auto& { sink.tick = time; return sink; });
+                buf.skip_chunk();
+            }
+        }
+        catch (const io::failure&) { in._M_setstate(std::ios::failbit); }
+        catch (const io::end_of_file&) { in._M_setstate(std::ios::eofbit); }
+        catch (const abi::__forced_unwind&) { throw; }
+        catch (...) { in._M_setstate(std::ios::badbit); }
+    }
+
+    lazy_file::lazy_file(std::istream& in) : stream { &in }
+    {
+        auto* const rdbuf { in.rdbuf() };
+        std::istream::sentry sentry { in, true };
+        if (not sentry) return;
+
+        try
+        {
+            const std::size_t num_tracks = read_header(rdbuf, asynchronous_tracks, time_division);
+            tracks.reserve(num_tracks);
+
+            for (unsigned i = 0; i < num_tracks; ++i)
+            {
+                auto trk = std::make_unique<lazy_track>();
+                trk->size = find_chunk(rdbuf, "MTrk");
+                trk->offset = rdbuf->pubseekoff(0, std::ios::cur, std::ios::in);
+                if (trk->offset < 0) throw io::failure { "stream is not seekable" };
+                if (i + 1 < num_tracks)
+                    if (rdbuf->pubseekoff(trk->size, std::ios::cur, std::ios::in) < 0)
+                        throw io::end_of_file { };
+                tracks.push_back(std::move(trk));
             }
         }
         catch (const io::failure&) { in._M_setstate(std::ios::failbit); }
         catch (const io::end_of_file&) { in._M_setstate(std::ios::eofbit); }
         catch (const abi::__forced_unwind&) { throw; }
         catch (...) { in._M_setstate(std::ios::badbit); }
+    }
+
+    lazy_file::~lazy_file()
+    {
+        std::unique_lock lock { prefetch_mutex };
+        prefetch_cv.wait(lock, [this] { return num_prefetching == 0; });
+    }
+
+    std::future<void> lazy_file::prefetch(std::size_t i)
+    {
+        {
+            std::unique_lock lock { prefetch_mutex };
+            ++num_prefetching;
+        }
+        return std::async(std::launch::async, [this, i]
+        {
+            struct done_t
+            {
+                lazy_file* self;
+                ~done_t()
+                {
+                    std::unique_lock lock { self->prefetch_mutex };
+                    --self->num_prefetching;
+                    self->prefetch_cv.notify_all();
+                }
+            } done { this };
+            track(i);
+        });
+    }
+
+    // If the decoder throws, call_once() does not complete, and the next
+    // call to track() tries again.
+    const file::track& lazy_file::track(std::size_t i)
+    {
+        auto& trk = *tracks.at(i);
+        std::call_once(trk.once, [this, &trk]
+        {
+            try
+            {
+                trk.track.clear();
+                // Only reading the chunk requires exclusive stream access.
+                std::optional<file_buffer> buf;
+                {
+                    std::unique_lock lock { *mutex };
+                    auto* const rdbuf { stream->rdbuf() };
+                    if (rdbuf->pubseekpos(trk.offset, std::ios::in) != trk.offset)
+                        throw io::failure { "seek failed" };
+                    buf.emplace(rdbuf, trk.size);
+                }
+                read_track(trk.track, *buf);
+            }
+            catch (const io::failure&) { std::unique_lock lock { *mutex }; stream->_M_setstate(std::ios::failbit); throw; }
+            catch (const io::end_of_file&) { std::unique_lock lock { *mutex }; stream->_M_setstate(std::ios::eofbit); throw; }
+            catch (const abi::__forced_unwind&) { throw; }
+            catch (...) { std::unique_lock lock { *mutex }; stream->_M_setstate(std::ios::badbit); throw; }
+            trk.loaded.store(true, std::memory_order_release);
+        });
+        return trk.track;
+    }
+
+    file lazy_file::load() &&
+    {
+        file output { };
+        output.asynchronous_tracks = asynchronous_tracks;
+        output.time_division = time_division;
+        output.tracks.reserve(tracks.size());
+        for (unsigned i = 0; i < tracks.size(); ++i)
+        {
+            track(i);
+            output.tracks.push_back(std::move(tracks[i]->track));
+        }
+        tracks.clear();
         return output;
     }
 }
@@ -0,0 +1,245 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <array>
+#include <algorithm>
+#include <thread>
+#include <cstring>
+#include <jw/midi/record.h>
+
+namespace jw::midi
+{
+    static constexpr std::array<char, 4> log_magic { 'J', 'W', 'M', 'L' };
+
+    static std::int64_t to_ns(clock::time_point t) noexcept
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+    }
+
+    static clock::time_point from_ns(std::int64_t ns) noexcept
+    {
+        return clock::time_point { std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds { ns }) };
+    }
+
+    log_writer::log_writer(std::ostream& o, std::size_t buffer_size)
+        : out { o }, size { std::max<std::size_t>(buffer_size, 1) }
+    {
+        buffer.reserve(size);
+        spare.reserve(size);
+        thread = std::thread { [this] { run(); } };
+    }
+
+    log_writer::~log_writer()
+    {
+        try { flush(); }
+        catch (...) { }
+        {
+            std::unique_lock lock { mutex };
+            quit = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    void log_writer::put_varint(std::uint64_t value)
+    {
+        do
+        {
+            byte b = value & 0x7f;
+            value >>= 7;
+            if (value != 0) b |= 0x80;
+            buffer.push_back(b);
+        } while (value != 0);
+    }
+
+    void log_writer::record(clock::time_point time, std::span<const byte> data)
+    {
+        if (data.empty()) return;
+        const auto ns = to_ns(time);
+        {
+            std::unique_lock lock { mutex };
+            if (not started) [[unlikely]]
+            {
+                started = true;
+                last_time = ns;
+                const auto v = log_version;
+                buffer.insert(buffer.end(), log_magic.begin(), log_magic.end());
+                for (unsigned i = 0; i < 4; ++i) buffer.push_back(v >> (i * 8));
+                for (unsigned i = 0; i < 8; ++i) buffer.push_back(static_cast<std::uint64_t>(ns) >> (i * 8));
+            }
+
+            put_varint(ns > last_time ? ns - last_time : 0);
+            put_varint(data.size());
+            buffer.insert(buffer.end(), data.begin(), data.end());
+            if (ns > last_time) last_time = ns;
+
+            if (buffer.size() < size or writing) [[likely]] return;
+            start_write();
+        }
+        cv.notify_one();
+    }
+
+    // Called with the mutex held, when the background thread is idle.
+    void log_writer::start_write()
+    {
+        buffer.swap(spare);
+        writing = true;
+    }
+
+    void log_writer::flush()
+    {
+        {
+            std::unique_lock lock { mutex };
+            done_cv.wait(lock, [this] { return not writing; });
+            if (not buffer.empty())
+            {
+                start_write();
+                cv.notify_one();
+                done_cv.wait(lock, [this] { return not writing; });
+            }
+            if (error) std::rethrow_exception(std::exchange(error, nullptr));
+        }
+        std::unique_lock lock { output_mutex };
+        out.flush();
+    }
+
+    void log_writer::run()
+    {
+        std::unique_lock lock { mutex };
+        while (true)
+        {
+            cv.wait(lock, [this] { return writing or quit; });
+            if (not writing) return;
+
+            lock.unlock();
+            std::exception_ptr e;
+            try
+            {
+                std::unique_lock out_lock { output_mutex };
+                out.write(reinterpret_cast<const char*>(spare.data()), spare.size());
+            }
+            catch (...) { e = std::current_exception(); }
+            spare.clear();
+            lock.lock();
+
+            if (e and not error) error = e;
+            writing = false;
+            done_cv.notify_all();
+        }
+    }
+
+    capture_streambuf::capture_streambuf(std::streambuf* source, log_writer& l, std::size_t buffer_size)
+        : src { source }, log { l }, buf(buffer_size > 0 ? buffer_size : 1)
+    {
+        setg(buf.data(), buf.data(), buf.data());
+    }
+
+    std::streambuf::int_type capture_streambuf::underflow()
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+
+        // Take only what is available, and block for a single byte if there
+        // is nothing, so that the timing of each byte is preserved.
+        std::streamsize n = src->in_avail();
+        if (n > 0) n = src->sgetn(buf.data(), std::min<std::streamsize>(n, buf.size()));
+        else
+        {
+            const auto c = src->sbumpc();
+            if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::eof();
+            buf[0] = traits_type::to_char_type(c);
+            n = 1;
+        }
+        if (n <= 0) return traits_type::eof();
+
+        log.record(clock::now(), { reinterpret_cast<const byte*>(buf.data()), static_cast<std::size_t>(n) });
+        setg(buf.data(), buf.data(), buf.data() + n);
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize capture_streambuf::showmanyc()
+    {
+        return src->in_avail();
+    }
+
+    log_reader::log_reader(std::istream& i) : in { i }
+    {
+        // A log_writer that recorded nothing leaves an empty file.
+        if (in.rdbuf()->sgetc() == std::char_traits<char>::eof()) return;
+
+        std::array<char, 4> magic;
+        std::array<byte, 12> hdr;
+        in.read(magic.data(), 4);
+        in.read(reinterpret_cast<char*>(hdr.data()), hdr.size());
+        if (not in or magic != log_magic) throw io::failure { "not a MIDI log" };
+        std::uint32_t version = 0;
+        std::uint64_t ns = 0;
+        for (unsigned i = 0; i < 4; ++i) version |= std::uint32_t { hdr[i] } << (i * 8);
+        for (unsigned i = 0; i < 8; ++i) ns |= std::uint64_t { hdr[4 + i] } << (i * 8);
+        if (version != log_version) throw io::failure { "unsupported log version" };
+        start = last = from_ns(ns);
+    }
+
+    std::uint64_t log_reader::get_varint()
+    {
+        std::uint64_t value = 0;
+        for (unsigned shift = 0; shift < 64; shift += 7)
+        {
+            const auto c = in.rdbuf()->sbumpc();
+            if (c == std::char_traits<char>::eof()) throw io::end_of_file { };
+            value |= std::uint64_t { static_cast<byte>(c) & 0x7fu } << shift;
+            if ((c & 0x80) == 0) return value;
+        }
+        throw io::failure { "invalid varint" };
+    }
+
+    bool log_reader::next(log_record& out)
+    {
+        if (in.rdbuf()->sgetc() == std::char_traits<char>::eof()) return false;
+        try
+        {
+            const auto delta = get_varint();
+            const auto size = get_varint();
+            buf.resize(size);
+            if (in.rdbuf()->sgetn(reinterpret_cast<char*>(buf.data()), size) != static_cast<std::streamsize>(size))
+                throw io::end_of_file { };
+            last += std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds { delta });
+        }
+        catch (const io::end_of_file&) { throw io::failure { "truncated log record" }; }
+        out = { last, buf };
+        return true;
+    }
+
+    replay_streambuf::replay_streambuf(std::istream& log, mode_t m)
+        : reader { log }, mode { m }, replay_start { clock::now() }
+    {
+        setg(nullptr, nullptr, nullptr);
+    }
+
+    bool replay_streambuf::load()
+    {
+        if (have_pending) return true;
+        if (end) return false;
+        have_pending = reader.next(pending);
+        end = not have_pending;
+        return have_pending;
+    }
+
+    std::streambuf::int_type replay_streambuf::underflow()
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (not load()) return traits_type::eof();
+        if (mode == original_timing) std::this_thread::sleep_until(due());
+
+        buf.assign(pending.data.begin(), pending.data.end());
+        have_pending = false;
+        setg(buf.data(), buf.data(), buf.data() + buf.size());
+        return traits_type::to_int_type(*gptr());
+    }
+
+    std::streamsize replay_streambuf::showmanyc()
+    {
+        if (not load()) return -1;
+        if (mode == original_timing and clock::now() < due()) return 0;
+        return pending.data.size();
+    }
+}
@@ -0,0 +1,424 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/shm_ring.h>
+#if __has_include(<linux/futex.h>) and __has_include(<sys/mman.h>)
+#include <new>
+#include <bit>
+#include <atomic>
+#include <cstring>
+#include <system_error>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "spin.h"
+
+namespace jw::midi
+{
+    // Layout of the shared memory region.  The ring data follows the header,
+    // and the realtime lane follows the ring.  Positions are free-running
+    // counters, capacities are powers of two.
+    struct shm_ring_header
+    {
+        static constexpr std::uint32_t magic_value = 0x4d524a57;    // "WJRM"
+        static constexpr std::uint32_t version_value = 2;
+
+        std::atomic<std::uint32_t> magic;
+        std::uint32_t version;
+        std::uint32_t capacity;
+        std::uint32_t rt_capacity;
+
+        // Written by the producer.
+        alignas(64) std::atomic<std::uint32_t> head;
+        std::atomic<std::uint32_t> rt_head;
+        std::atomic<std::uint32_t> closed;
+
+        // Written by the consumer.
+        alignas(64) std::atomic<std::uint32_t> tail;
+        std::atomic<std::uint32_t> rt_tail;
+
+        // Futex words, and flags indicating if either side is sleeping.  The
+        // realtime lane may be written while the main lane is blocked, so
+        // each lane has its own writer flag.
+        alignas(64) std::atomic<std::uint32_t> data_seq;
+        std::atomic<std::uint32_t> reader_waiting;
+        std::atomic<std::uint32_t> space_seq;
+        std::atomic<std::uint32_t> writer_waiting;
+        std::atomic<std::uint32_t> rt_space_seq;
+        std::atomic<std::uint32_t> rt_writer_waiting;
+    };
+
+    static_assert(std::atomic<std::uint32_t>::is_always_lock_free);
+
+    [[noreturn]] static void throw_errno(const char* what)
+    {
+        throw std::system_error { errno, std::system_category(), what };
+    }
+
+    static std::uint32_t* futex_addr(std::atomic<std::uint32_t>& a) noexcept
+    {
+        return reinterpret_cast<std::uint32_t*>(&a);
+    }
+
+    static void futex_wait(std::atomic<std::uint32_t>& a, std::uint32_t expected, const timespec* timeout) noexcept
+    {
+        ::syscall(SYS_futex, futex_addr(a), FUTEX_WAIT, expected, timeout, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<std::uint32_t>& a) noexcept
+    {
+        ::syscall(SYS_futex, futex_addr(a), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+    }
+
+    static std::string shm_name(const std::string& name)
+    {
+        return name.starts_with('/') ? name : '/' + name;
+    }
+
+    shm_ring shm_ring::create(const std::string& name, std::size_t capacity, std::size_t realtime_capacity)
+    {
+        return shm_ring { name, true, capacity, realtime_capacity };
+    }
+
+    shm_ring shm_ring::open(const std::string& name)
+    {
+        return shm_ring { name, false, 0, 0 };
+    }
+
+    shm_ring::shm_ring(const std::string& n, bool creator, std::size_t capacity, std::size_t realtime_capacity)
+        : name { shm_name(n) }, owner { creator }
+    {
+        int fd;
+        if (creator)
+        {
+            capacity = std::bit_ceil(std::max<std::size_t>(capacity, 16));
+            realtime_capacity = std::bit_ceil(std::max<std::size_t>(realtime_capacity, 1));
+            if (capacity > 0x80000000 or realtime_capacity > 0x80000000)
+                throw std::system_error { std::make_error_code(std::errc::invalid_argument), "shm_ring" };
+            map_size = sizeof(shm_ring_header) + capacity + realtime_capacity;
+
+            ::shm_unlink(name.c_str());
+            fd = ::shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0) throw_errno("shm_open");
+            if (::ftruncate(fd, map_size) != 0)
+            {
+                const int e = errno;
+                ::close(fd);
+                ::shm_unlink(name.c_str());
+                throw std::system_error { e, std::system_category(), "ftruncate" };
+            }
+        }
+        else
+        {
+            fd = ::shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0);
+            if (fd < 0) throw_errno("shm_open");
+            struct stat st;
+            if (::fstat(fd, &st) != 0)
+            {
+                const int e = errno;
+                ::close(fd);
+                throw std::system_error { e, std::system_category(), "fstat" };
+            }
+            map_size = st.st_size;
+        }
+
+        void* const p = ::mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        const int e = errno;
+        ::close(fd);
+        if (p == MAP_FAILED)
+        {
+            if (creator) ::shm_unlink(name.c_str());
+            throw std::system_error { e, std::system_category(), "mmap" };
+        }
+        hdr = static_cast<shm_ring_header*>(p);
+
+        if (creator)
+        {
+            new (hdr) shm_ring_header { };
+            hdr->version = shm_ring_header::version_value;
+            hdr->capacity = capacity;
+            hdr->rt_capacity = realtime_capacity;
+            hdr->magic.store(shm_ring_header::magic_value, std::memory_order_release);
+        }
+        else
+        {
+            const bool ok = map_size >= sizeof(shm_ring_header)
+                and hdr->magic.load(std::memory_order_acquire) == shm_ring_header::magic_value
+                and hdr->version == shm_ring_header::version_value
+                and std::has_single_bit(hdr->capacity) and std::has_single_bit(hdr->rt_capacity)
+                and map_size >= sizeof(shm_ring_header) + hdr->capacity + hdr->rt_capacity;
+            if (not ok)
+            {
+                release();
+                throw std::system_error { std::make_error_code(std::errc::invalid_argument), "shm_ring: invalid header" };
+            }
+        }
+
+        data = reinterpret_cast<byte*>(hdr + 1);
+        rt_data = data + hdr->capacity;
+    }
+
+    void shm_ring::release() noexcept
+    {
+        if (hdr != nullptr) ::munmap(hdr, map_size);
+        if (owner) ::shm_unlink(name.c_str());
+        hdr = nullptr;
+        owner = false;
+    }
+
+    shm_ring::~shm_ring()
+    {
+        release();
+    }
+
+    shm_ring::shm_ring(shm_ring&& other) noexcept
+        : hdr { std::exchange(other.hdr, nullptr) }, data { other.data }, rt_data { other.rt_data },
+          map_size { other.map_size }, name { std::move(other.name) }, owner { std::exchange(other.owner, false) } { }
+
+    shm_ring& shm_ring::operator=(shm_ring&& other) noexcept
+    {
+        std::swap(hdr, other.hdr);
+        std::swap(data, other.data);
+        std::swap(rt_data, other.rt_data);
+        std::swap(map_size, other.map_size);
+        std::swap(name, other.name);
+        std::swap(owner, other.owner);
+        return *this;
+    }
+
+    void shm_ring::wake_reader() noexcept
+    {
+        if (hdr->reader_waiting.load()) [[unlikely]]
+        {
+            hdr->data_seq.fetch_add(1);
+            futex_wake(hdr->data_seq);
+        }
+    }
+
+    std::size_t shm_ring::try_write(std::span<const byte> src)
+    {
+        const std::uint32_t cap = hdr->capacity;
+        const std::uint32_t head = hdr->head.load(std::memory_order_relaxed);
+        const std::uint32_t tail = hdr->tail.load(std::memory_order_acquire);
+        const std::size_t n = std::min<std::size_t>(src.size(), cap - (head - tail));
+        if (n == 0) return 0;
+
+        const std::size_t offset = head & (cap - 1);
+        const std::size_t first = std::min(n, cap - offset);
+        std::memcpy(data + offset, src.data(), first);
+        std::memcpy(data, src.data() + first, n - first);
+        hdr->head.store(head + n);
+        wake_reader();
+        return n;
+    }
+
+    void shm_ring::write(std::span<const byte> src)
+    {
+        while (true)
+        {
+            src = src.subspan(try_write(src));
+            if (src.empty()) return;
+
+            // Ring is full, wait for the consumer.
+            hdr->writer_waiting.store(1);
+            const auto seq = hdr->space_seq.load();
+            const std::uint32_t used = hdr->head.load(std::memory_order_relaxed) - hdr->tail.load();
+            if (used == hdr->capacity) futex_wait(hdr->space_seq, seq, nullptr);
+            hdr->writer_waiting.store(0);
+        }
+    }
+
+    void shm_ring::put_realtime(byte b)
+    {
+        const std::uint32_t cap = hdr->rt_capacity;
+        const std::uint32_t head = hdr->rt_head.load(std::memory_order_relaxed);
+        while (true)
+        {
+            if (head - hdr->rt_tail.load(std::memory_order_acquire) < cap) break;
+            hdr->rt_writer_waiting.store(1);
+            const auto seq = hdr->rt_space_seq.load();
+            if (head - hdr->rt_tail.load() == cap) futex_wait(hdr->rt_space_seq, seq, nullptr);
+            hdr->rt_writer_waiting.store(0);
+        }
+        rt_data[head & (cap - 1)] = b;
+        hdr->rt_head.store(head + 1);
+        wake_reader();
+    }
+
+    void shm_ring::close()
+    {
+        hdr->closed.store(1);
+        hdr->data_seq.fetch_add(1);
+        futex_wake(hdr->data_seq);
+    }
+
+    std::span<const byte> shm_ring::peek() const noexcept
+    {
+        const std::uint32_t cap = hdr->capacity;
+        const std::uint32_t tail = hdr->tail.load(std::memory_order_relaxed);
+        const std::uint32_t head = hdr->head.load(std::memory_order_acquire);
+        const std::size_t offset = tail & (cap - 1);
+        return { data + offset, std::min<std::size_t>(head - tail, cap - offset) };
+    }
+
+    void shm_ring::consume(std::size_t n) noexcept
+    {
+        hdr->tail.store(hdr->tail.load(std::memory_order_relaxed) + n);
+        if (hdr->writer_waiting.load()) [[unlikely]]
+        {
+            hdr->space_seq.fetch_add(1);
+            futex_wake(hdr->space_seq);
+        }
+    }
+
+    int shm_ring::get_realtime() noexcept
+    {
+        const std::uint32_t tail = hdr->rt_tail.load(std::memory_order_relaxed);
+        if (tail == hdr->rt_head.load(std::memory_order_acquire)) return -1;
+        const byte b = rt_data[tail & (hdr->rt_capacity - 1)];
+        hdr->rt_tail.store(tail + 1);
+        if (hdr->rt_writer_waiting.load()) [[unlikely]]
+        {
+            hdr->rt_space_seq.fetch_add(1);
+            futex_wake(hdr->rt_space_seq);
+        }
+        return b;
+    }
+
+    std::ptrdiff_t shm_ring::available() const noexcept
+    {
+        const std::uint32_t n = (hdr->head.load(std::memory_order_acquire) - hdr->tail.load(std::memory_order_relaxed))
+                              + (hdr->rt_head.load(std::memory_order_acquire) - hdr->rt_tail.load(std::memory_order_relaxed));
+        if (n == 0 and hdr->closed.load(std::memory_order_acquire)) return -1;
+        return n;
+    }
+
+    bool shm_ring::wait(std::chrono::nanoseconds timeout)
+    {
+        using steady = std::chrono::steady_clock;
+        const bool forever = timeout == std::chrono::nanoseconds::max();
+        const auto deadline = forever ? steady::time_point::max() : steady::now() + timeout;
+
+        // Spin briefly before going to sleep.
+        for (unsigned i = 0; i < 256; ++i)
+        {
+            if (available() != 0) return true;
+            cpu_relax();
+        }
+
+        while (true)
+        {
+            // The fence orders the flag store before the loads in
+            // available(), pairing with the store to head followed by the
+            // load of reader_waiting in wake_reader().
+            hdr->reader_waiting.store(1);
+            const auto seq = hdr->data_seq.load();
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (available() != 0)
+            {
+                hdr->reader_waiting.store(0);
+                return true;
+            }
+
+            timespec ts;
+            const timespec* tp = nullptr;
+            if (not forever)
+            {
+                const auto left = deadline - steady::now();
+                if (left <= steady::duration::zero())
+                {
+                    hdr->reader_waiting.store(0);
+                    return false;
+                }
+                const auto s = std::chrono::duration_cast<std::chrono::seconds>(left);
+                ts.tv_sec = s.count();
+                ts.tv_nsec = std::chrono::duration_cast<std::chrono::nanoseconds>(left - s).count();
+                tp = &ts;
+            }
+            futex_wait(hdr->data_seq, seq, tp);
+            hdr->reader_waiting.store(0);
+        }
+    }
+
+    shm_streambuf::shm_streambuf(shm_ring* r, shm_ring* t) : rx { r }, tx { t }
+    {
+        setg(nullptr, nullptr, nullptr);
+        setp(nullptr, nullptr);
+    }
+
+    shm_streambuf::~shm_streambuf()
+    {
+        release_segment();
+        if (tx != nullptr) tx->close();
+    }
+
+    void shm_streambuf::release_segment() noexcept
+    {
+        if (segment == 0) return;
+        rx->consume(segment);
+        segment = 0;
+        setg(nullptr, nullptr, nullptr);
+    }
+
+    void shm_streambuf::put_realtime(char_type c)
+    {
+        if (tx == nullptr) return;
+        tx->put_realtime(static_cast<byte>(c));
+    }
+
+    shm_streambuf::int_type shm_streambuf::underflow()
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (rx == nullptr) return traits_type::eof();
+        release_segment();
+        while (true)
+        {
+            const int rt = rx->get_realtime();
+            if (rt >= 0)
+            {
+                rt_byte = traits_type::to_char_type(rt);
+                setg(&rt_byte, &rt_byte, &rt_byte + 1);
+                return rt;
+            }
+
+            const auto s = rx->peek();
+            if (not s.empty())
+            {
+                auto* const p = reinterpret_cast<char_type*>(const_cast<byte*>(s.data()));
+                segment = s.size();
+                setg(p, p, p + s.size());
+                return traits_type::to_int_type(*p);
+            }
+
+            if (rx->available() < 0) return traits_type::eof();
+            rx->wait();
+        }
+    }
+
+    std::streamsize shm_streambuf::showmanyc()
+    {
+        if (rx == nullptr) return -1;
+        release_segment();
+        return rx->available();
+    }
+
+    shm_streambuf::int_type shm_streambuf::overflow(int_type c)
+    {
+        if (tx == nullptr) return traits_type::eof();
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        const byte b = traits_type::to_char_type(c);
+        tx->write({ &b, 1 });
+        return c;
+    }
+
+    std::streamsize shm_streambuf::xsputn(const char_type* s, std::streamsize n)
+    {
+        if (tx == nullptr) return 0;
+        tx->write({ reinterpret_cast<const byte*>(s), static_cast<std::size_t>(n) });
+        return n;
+    }
+}
+#endif
@@ -0,0 +1,18 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Busy-wait helper, shared between translation units.  Not part of the
+// public interface.
+
+#pragma once
+
+namespace jw::midi
+{
+    // Hint to the CPU that we are in a spin loop.
+    inline void cpu_relax() noexcept
+    {
+#       if defined(__i386__) or defined(__x86_64__)
+        __builtin_ia32_pause();
+#       endif
+    }
+}
@@ -0,0 +1,177 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Work-stealing thread pool, shared between translation units.  Not part of
+// the public interface.
+
+#pragma once
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <memory>
+#include <exception>
+#include <cxxabi.h>
+#include <functional>
+#include <condition_variable>
+
+namespace jw::midi
+{
+    // Each worker has its own task queue.  Tasks submitted from a worker go
+    // to the back of its own queue, and are taken from there (LIFO).  Other
+    // tasks are distributed round-robin.  Idle workers steal from the front
+    // of other queues.  If a task throws, the first exception is rethrown
+    // from wait().
+    struct thread_pool
+    {
+        explicit thread_pool(unsigned num_threads = 0)
+        {
+            if (num_threads == 0) num_threads = std::thread::hardware_concurrency();
+            if (num_threads == 0) num_threads = 1;
+            queues.reserve(num_threads);
+            for (unsigned i = 0; i < num_threads; ++i)
+                queues.push_back(std::make_unique<queue>());
+            threads.reserve(num_threads);
+            for (unsigned i = 0; i < num_threads; ++i)
+                threads.emplace_back([this, i] { worker(i); });
+        }
+
+        ~thread_pool()
+        {
+            {
+                std::unique_lock lock { mutex };
+                stop = true;
+            }
+            work_cv.notify_all();
+            for (auto& t : threads) t.join();
+        }
+
+        thread_pool(const thread_pool&) = delete;
+        thread_pool& operator=(const thread_pool&) = delete;
+
+        std::size_t size() const noexcept { return threads.size(); }
+
+        template<typename F>
+        void submit(F&& func)
+        {
+            const unsigned i = current == this ? current_index : next++ % queues.size();
+            {
+                std::unique_lock lock { mutex };
+                ++pending;
+                ++queued;
+            }
+            {
+                auto& q = *queues[i];
+                std::unique_lock lock { q.mutex };
+                q.tasks.emplace_back(std::forward<F>(func));
+            }
+            work_cv.notify_one();
+        }
+
+        // Block until all submitted tasks have completed.  Must not be called
+        // from within a task.
+        void wait()
+        {
+            std::unique_lock lock { mutex };
+            done_cv.wait(lock, [this] { return pending == 0; });
+            if (error) std::rethrow_exception(std::exchange(error, nullptr));
+        }
+
+        // Call func(begin, end) for consecutive ranges in [0, n), in
+        // parallel, and wait for completion.
+        template<typename F>
+        void parallel_for(std::size_t n, std::size_t grain, F&& func)
+        {
+            if (grain == 0) grain = 1;
+            for (std::size_t i = 0; i < n; i += grain)
+                submit([&func, i, end = std::min(n, i + grain)] { func(i, end); });
+            wait();
+        }
+
+    private:
+        struct queue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        bool try_pop(unsigned self, std::function<void()>& task)
+        {
+            {
+                auto& q = *queues[self];
+                std::unique_lock lock { q.mutex };
+                if (not q.tasks.empty())
+                {
+                    task = std::move(q.tasks.back());
+                    q.tasks.pop_back();
+                    return true;
+                }
+            }
+            for (unsigned j = 1; j < queues.size(); ++j)
+            {
+                auto& q = *queues[(self + j) % queues.size()];
+                std::unique_lock lock { q.mutex, std::try_to_lock };
+                if (lock and not q.tasks.empty())
+                {
+                    task = std::move(q.tasks.front());
+                    q.tasks.pop_front();
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        void worker(unsigned self)
+        {
+            current = this;
+            current_index = self;
+            std::function<void()> task;
+            while (true)
+            {
+                if (try_pop(self, task))
+                {
+                    {
+                        std::unique_lock lock { mutex };
+                        --queued;
+                    }
+                    std::exception_ptr e;
+                    try { task(); }
+                    catch (const abi::__forced_unwind&) { throw; }
+                    catch (...) { e = std::current_exception(); }
+                    task = nullptr;
+
+                    std::unique_lock lock { mutex };
+                    if (e and not error) error = e;
+                    if (--pending == 0) done_cv.notify_all();
+                    continue;
+                }
+
+                std::unique_lock lock { mutex };
+                if (stop and pending == 0) return;
+                if (queued > 0)
+                {
+                    // Another queue is locked, or a task is being pushed.
+                    lock.unlock();
+                    std::this_thread::yield();
+                    continue;
+                }
+                work_cv.wait(lock, [this] { return queued > 0 or (stop and pending == 0); });
+            }
+        }
+
+        inline static thread_local thread_pool* current { nullptr };
+        inline static thread_local unsigned current_index { 0 };
+
+        std::vector<std::unique_ptr<queue>> queues;
+        std::vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable work_cv;
+        std::condition_variable done_cv;
+        std::size_t pending { 0 };
+        std::size_t queued { 0 };
+        std::atomic<unsigned> next { 0 };
+        std::exception_ptr error;
+        bool stop { false };
+    };
+}
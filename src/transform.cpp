@@ -0,0 +1,263 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <jw/midi/transform.h>
+#include "thread_pool.h"
+
+namespace jw::midi
+{
+    // Track contents in flat arrays, for operations that change time stamps.
+    struct flat_track
+    {
+        std::vector<std::uint64_t> ticks;
+        std::vector<untimed_message> msgs;
+        std::vector<std::uint64_t> markers;     // Ticks without messages (eg. end of track)
+
+        explicit flat_track(file::track& trk)
+        {
+            std::size_t n = 0;
+            for (const auto& [tick, v] : trk) n += v.size();
+            ticks.reserve(n);
+            msgs.reserve(n);
+            for (auto& [tick, v] : trk)
+            {
+                if (v.empty()) markers.push_back(tick);
+                for (auto& msg : v)
+                {
+                    ticks.push_back(tick);
+                    msgs.push_back(std::move(msg));
+                }
+            }
+            trk.clear();
+        }
+
+        std::size_t size() const noexcept { return msgs.size(); }
+
+        // Rebuild a track from messages in the given order.  Time stamps
+        // must be non-decreasing in this order.
+        template<typename I>
+        void rebuild(file::track& trk, I order_begin, I order_end)
+        {
+            for (auto i = order_begin; i != order_end; ++i)
+            {
+                const auto tick = ticks[*i];
+                auto pos = trk.end();
+                if (trk.empty() or std::prev(pos)->first != tick)
+                    pos = trk.emplace_hint(pos, std::piecewise_construct, std::make_tuple(tick), std::make_tuple());
+                else --pos;
+                pos->second.push_back(std::move(msgs[*i]));
+            }
+            for (auto tick : markers)
+                trk.try_emplace(tick);
+        }
+
+        void rebuild(file::track& trk)
+        {
+            std::vector<std::uint32_t> order(size());
+            std::iota(order.begin(), order.end(), 0);
+            rebuild(trk, order.begin(), order.end());
+        }
+    };
+
+    static note_event* get_note(untimed_message& msg, std::uint16_t channels, unsigned* ch = nullptr)
+    {
+        auto* const c = std::get_if<channel_message>(&msg.category);
+        if (c == nullptr or (channels & (1 << c->channel)) == 0) return nullptr;
+        if (ch != nullptr) *ch = c->channel;
+        return std::get_if<note_event>(&c->message);
+    }
+
+    struct transform_visitor
+    {
+        file::track& trk;
+
+        // Apply func to every message, and remove those for which it returns
+        // false.  Ticks that become empty are removed as well.
+        template<typename F>
+        void for_each(F&& func)
+        {
+            for (auto i = trk.begin(); i != trk.end();)
+            {
+                auto& v = i->second;
+                if (v.empty()) { ++i; continue; }
+                std::erase_if(v, [&func](untimed_message& msg) { return not func(msg); });
+                if (v.empty()) i = trk.erase(i);
+                else ++i;
+            }
+        }
+
+        void operator()(const transform::transpose_step& s)
+        {
+            for_each([&s](untimed_message& msg)
+            {
+                auto* const c = std::get_if<channel_message>(&msg.category);
+                if (c == nullptr or (s.channels & (1 << c->channel)) == 0) return true;
+                auto shift = [&s](auto& m)
+                {
+                    const int note = static_cast<int>(m.note) + s.semitones;
+                    if (note < 0 or note > 127) return false;
+                    m.note = note;
+                    return true;
+                };
+                if (auto* const m = std::get_if<note_event>(&c->message)) return shift(*m);
+                if (auto* const m = std::get_if<key_pressure>(&c->message)) return shift(*m);
+                return true;
+            });
+        }
+
+        void operator()(const transform::velocity_step& s)
+        {
+            for_each([&s](untimed_message& msg)
+            {
+                auto* const m = get_note(msg, s.channels);
+                if (m == nullptr or not m->on) return true;
+                const long v = std::lround(m->velocity * s.factor);
+                m->velocity = std::clamp(v, 1l, 127l);
+                return true;
+            });
+        }
+
+        void operator()(const transform::remap_step& s)
+        {
+            for_each([&s](untimed_message& msg)
+            {
+                if (auto* const c = std::get_if<channel_message>(&msg.category))
+                    c->channel = s.map[c->channel] & 0x0f;
+                else if (auto* const m = std::get_if<meta_message>(&msg.category))
+                    if ((*m)->channel)
+                        (*m)->channel = s.map[*(*m)->channel] & 0x0f;
+                return true;
+            });
+        }
+
+        void operator()(const transform::stretch_step& s)
+        {
+            // Scaling is monotonic, so the original order is preserved.
+            flat_track f { trk };
+            const double factor = s.factor;
+            auto scale = [factor](std::uint64_t* p, std::size_t n)
+            {
+                for (std::size_t i = 0; i < n; ++i)
+                    p[i] = static_cast<std::uint64_t>(static_cast<double>(p[i]) * factor + 0.5);
+            };
+            scale(f.ticks.data(), f.ticks.size());
+            scale(f.markers.data(), f.markers.size());
+            f.rebuild(trk);
+        }
+
+        void operator()(const transform::quantize_step& s)
+        {
+            if (s.grid == 0) return;
+            flat_track f { trk };
+            const std::size_t n = f.size();
+            constexpr auto none = std::uint32_t(-1);
+
+            // Pair each note-off with the earliest open note-on on the same
+            // key, and collect the note-ons per key.
+            std::vector<std::uint32_t> partner(n, none);
+            std::vector<std::vector<std::uint32_t>> notes(16 * 128);
+            std::vector<std::vector<std::uint32_t>> open(16 * 128);
+            for (std::uint32_t i = 0; i < n; ++i)
+            {
+                unsigned ch;
+                auto* const m = get_note(f.msgs[i], s.channels, &ch);
+                if (m == nullptr) continue;
+                const unsigned key = ch * 128 + m->note;
+                if (m->on)
+                {
+                    notes[key].push_back(i);
+                    open[key].push_back(i);
+                }
+                else if (not open[key].empty())
+                {
+                    const auto on = open[key].front();
+                    open[key].erase(open[key].begin());
+                    partner[on] = i;
+                    partner[i] = on;
+                }
+            }
+
+            // Move note-ons, and their note-offs by the same amount.
+            std::vector<std::uint64_t> ticks = f.ticks;
+            const double grid = s.grid;
+            for (std::uint32_t i = 0; i < n; ++i)
+            {
+                auto* const m = get_note(f.msgs[i], s.channels);
+                if (m == nullptr or not m->on) continue;
+                const double t = f.ticks[i];
+                const double q = std::round(t / grid) * grid;
+                const auto moved = static_cast<std::int64_t>(std::llround(t + s.strength * (q - t)));
+                ticks[i] = std::max<std::int64_t>(moved, 0);
+                if (partner[i] != none)
+                {
+                    const std::int64_t off = f.ticks[partner[i]] + (static_cast<std::int64_t>(ticks[i]) - static_cast<std::int64_t>(f.ticks[i]));
+                    ticks[partner[i]] = std::max<std::int64_t>(off, ticks[i]);
+                }
+            }
+
+            // Shorten overlapping notes.  Note-ons on the same key remain in
+            // their original order, since quantization is monotonic.
+            for (const auto& v : notes)
+            {
+                for (std::size_t j = 0; j + 1 < v.size(); ++j)
+                {
+                    const auto off = partner[v[j]];
+                    if (off != none and ticks[off] > ticks[v[j + 1]])
+                        ticks[off] = std::max(ticks[v[j + 1]], ticks[v[j]]);
+                }
+            }
+
+            // Sort by time.  On the same tick, note-offs of notes that started
+            // earlier go first.  Otherwise, the original order is kept.
+            auto rank = [&](std::uint32_t i)
+            {
+                const auto on = partner[i];
+                const bool is_off = on != none and on < i;
+                return is_off and ticks[on] < ticks[i] ? 0 : 1;
+            };
+            std::vector<std::uint32_t> order(n);
+            std::iota(order.begin(), order.end(), 0);
+            std::stable_sort(order.begin(), order.end(), [&](std::uint32_t a, std::uint32_t b)
+            {
+                if (ticks[a] != ticks[b]) return ticks[a] < ticks[b];
+                return rank(a) < rank(b);
+            });
+
+            f.ticks = std::move(ticks);
+            f.rebuild(trk, order.begin(), order.end());
+        }
+    };
+
+    void transform::apply(file::track& track) const
+    {
+        for (const auto& s : steps)
+            std::visit(transform_visitor { track }, s);
+    }
+
+    void transform::apply(std::span<file> files, unsigned threads) const
+    {
+        std::vector<file::track*> tracks;
+        for (auto& f : files)
+            for (auto& t : f.tracks)
+                tracks.push_back(&t);
+
+        if (threads == 0) threads = std::thread::hardware_concurrency();
+        threads = std::min<std::size_t>(threads, tracks.size());
+        if (threads <= 1)
+        {
+            for (auto* t : tracks) apply(*t);
+            return;
+        }
+
+        thread_pool pool { threads };
+        const std::size_t grain = std::max<std::size_t>(1, tracks.size() / (threads * 8));
+        pool.parallel_for(tracks.size(), grain, [this, &tracks](std::size_t begin, std::size_t end)
+        {
+            for (std::size_t i = begin; i < end; ++i)
+                apply(*tracks[i]);
+        });
+    }
+}
@@ -0,0 +1,251 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+#include <jw/midi/ump.h>
+#include <jw/midi/encode.h>
+#include "codec.h"
+
+namespace jw::midi::ump
+{
+    static constexpr std::uint32_t header(unsigned type, unsigned group) noexcept
+    {
+        return (type << 28) | ((group & 0x0f) << 24);
+    }
+
+    static void put_bytes(std::vector<std::uint32_t>& out, unsigned type, unsigned group, const encoded_bytes<3>& msg)
+    {
+        out.push_back(header(type, group) | (msg.data[0] << 16) | (msg.data[1] << 8) | msg.data[2]);
+    }
+
+    struct midi2_encoder
+    {
+        std::vector<std::uint32_t>& out;
+        const std::uint32_t head;
+
+        void put(unsigned opcode, unsigned index, std::uint32_t data)
+        {
+            out.push_back(head | (opcode << 20) | index);
+            out.push_back(data);
+        }
+
+        void operator()(const note_event& m)       { put(m.on ? 0x9 : 0x8, m.note << 8, scale_up(m.velocity, 7, 16) << 16); }
+        void operator()(const key_pressure& m)     { put(0xa, m.note << 8, scale_up(m.value, 7, 32)); }
+        void operator()(const control_change& m)   { put(0xb, m.control << 8, scale_up(m.value, 7, 32)); }
+        void operator()(const program_change& m)   { put(0xc, 0, m.value << 24); }
+        void operator()(const channel_pressure& m) { put(0xd, 0, scale_up(m.value, 7, 32)); }
+        void operator()(const pitch_change& m)     { put(0xe, 0, scale_up(m.value, 14, 32)); }
+    };
+
+    static void encode_sysex(const std::vector<byte>& data, std::vector<std::uint32_t>& out, unsigned group)
+    {
+        auto i = data.cbegin();
+        auto end = data.cend();
+        if (i != end and *i == 0xf0) ++i;
+        if (i != end and end[-1] == 0xf7) --end;
+        std::size_t n = end - i;
+        bool first = true;
+        do
+        {
+            const std::size_t k = std::min<std::size_t>(n, 6);
+            const unsigned status = first ? (n <= 6 ? 0 : 1) : (n <= 6 ? 3 : 2);
+            std::array<byte, 6> b { };
+            std::copy_n(i, k, b.begin());
+            out.push_back(header(data64, group) | (status << 20) | (k << 16) | (b[0] << 8) | b[1]);
+            out.push_back((b[2] << 24) | (b[3] << 16) | (b[4] << 8) | b[5]);
+            i += k;
+            n -= k;
+            first = false;
+        } while (n > 0);
+    }
+
+    struct system_encoder
+    {
+        std::vector<std::uint32_t>& out;
+        const unsigned group;
+
+        void operator()(const sysex& m) { encode_sysex(m.data, out, group); }
+        template<typename T> void operator()(const T& m) { put_bytes(out, system, group, midi::encode(m)); }
+    };
+
+    void encode(const untimed_message& msg, std::vector<std::uint32_t>& out, unsigned group, protocol p)
+    {
+        if (auto* t = std::get_if<channel_message>(&msg.category))
+        {
+            if (p == protocol::midi1) put_bytes(out, midi1_channel_voice, group, midi::encode(*t));
+            else std::visit(midi2_encoder { out, header(midi2_channel_voice, group) | (t->channel << 16) }, t->message);
+        }
+        else if (auto* t = std::get_if<system_message>(&msg.category))
+        {
+            std::visit(system_encoder { out, group }, t->message);
+        }
+        else if (auto* t = std::get_if<realtime>(&msg.category))
+        {
+            put_bytes(out, system, group, midi::encode(*t));
+        }
+    }
+
+    void encode(std::span<const untimed_message> msgs, std::vector<std::uint32_t>& out, unsigned group, protocol p)
+    {
+        out.reserve(out.size() + msgs.size() * (p == protocol::midi2 ? 2 : 1));
+        for (const auto& msg : msgs) encode(msg, out, group, p);
+    }
+
+    // Translate a MIDI 2.0 channel voice message to one or more MIDI 1.0
+    // channel messages.  Each is passed to emit() as channel and message
+    // body, so that it can be constructed in place.
+    template<typename F>
+    static void translate_midi2(const packet& p, F&& emit)
+    {
+        const std::uint32_t w = p.word[0];
+        const std::uint32_t data = p.word[1];
+        const unsigned ch = (w >> 16) & 0x0f;
+        const unsigned index = (w >> 8) & 0x7f;
+        auto cc = [&](unsigned control, unsigned value) { emit(ch, control_change { control, value }); };
+        auto parameter = [&](unsigned msb, unsigned lsb)
+        {
+            const split_uint14_t value = scale_down(data, 32, 14);
+            cc(msb, index);
+            cc(lsb, w & 0x7f);
+            cc(0x06, value.hi);
+            cc(0x26, value.lo);
+        };
+
+        switch ((w >> 20) & 0x0f)
+        {
+        case 0x2: return parameter(0x65, 0x64);
+        case 0x3: return parameter(0x63, 0x62);
+        case 0x8: return emit(ch, note_event { index, scale_down(data >> 16, 16, 7), false });
+        case 0x9:
+            {
+                // Velocity 0 would mean note-off in MIDI 1.0.
+                const unsigned velocity = std::max(scale_down(data >> 16, 16, 7), 1u);
+                return emit(ch, note_event { index, velocity, true });
+            }
+        case 0xa: return emit(ch, key_pressure { index, scale_down(data, 32, 7) });
+        case 0xb: return emit(ch, control_change { index, scale_down(data, 32, 7) });
+        case 0xc:
+            if ((w & 1) != 0)
+            {
+                cc(0x00, (data >> 8) & 0x7f);
+                cc(0x20, data & 0x7f);
+            }
+            return emit(ch, program_change { (data >> 24) & 0x7f });
+        case 0xd: return emit(ch, channel_pressure { scale_down(data, 32, 7) });
+        case 0xe: return emit(ch, pitch_change { scale_down(data, 32, 14) });
+        default: return;
+        }
+    }
+
+    void decoder::decode(const packet& p, std::vector<untimed_message>& out)
+    {
+        const std::uint32_t w = p.word[0];
+        switch (p.type())
+        {
+        case system:
+        case midi1_channel_voice:
+            {
+                const byte status = w >> 16;
+                if (not is_valid_status(status) or status == 0xf0) return;
+                const std::array<byte, 2> data { static_cast<byte>((w >> 8) & 0x7f), static_cast<byte>(w & 0x7f) };
+                out.push_back(make_msg(status, data.data()));
+                return;
+            }
+
+        case data64:
+            {
+                const unsigned status = (w >> 20) & 0x0f;
+                const unsigned n = std::min((w >> 16) & 0x0f, 6u);
+                const std::array<byte, 6> b
+                {
+                    static_cast<byte>(w >> 8), static_cast<byte>(w),
+                    static_cast<byte>(p.word[1] >> 24), static_cast<byte>(p.word[1] >> 16),
+                    static_cast<byte>(p.word[1] >> 8), static_cast<byte>(p.word[1])
+                };
+                auto& buf = pending_sysex[p.group()];
+                if (status > 3) return;
+                if (status == 0 or status == 1) buf.assign(1, 0xf0);
+                else if (buf.empty()) return;
+                buf.insert(buf.end(), b.begin(), b.begin() + n);
+                if (status == 0 or status == 3)
+                {
+                    buf.push_back(0xf7);
+                    out.emplace_back(sysex { std::move(buf) });
+                    buf = { };
+                }
+                return;
+            }
+
+        case midi2_channel_voice:
+            translate_midi2(p, [&out](unsigned ch, const auto& msg) { out.emplace_back(ch, msg); });
+            return;
+
+        default:
+            return;
+        }
+    }
+
+    std::size_t decoder::decode(std::span<const std::uint32_t> words, std::vector<untimed_message>& out)
+    {
+        out.reserve(out.size() + words.size() / 2);
+        return for_each_packet(words, [this, &out](const packet& p) { decode(p, out); });
+    }
+
+    std::size_t decoder::decode(std::span<const std::uint32_t> words, std::vector<byte>& out)
+    {
+        // Worst case is a MIDI 2.0 (N)RPN message, which expands to 12 bytes
+        // from two words.
+        const std::size_t begin = out.size();
+        out.resize(begin + words.size() * 6);
+        byte* o = out.data() + begin;
+
+        const std::size_t n = for_each_packet(words, [&o](const packet& p)
+        {
+            const std::uint32_t w = p.word[0];
+            switch (p.type())
+            {
+            case system:
+            case midi1_channel_voice:
+                {
+                    const byte status = w >> 16;
+                    if (not is_valid_status(status) or status == 0xf0) return;
+                    o[0] = status;
+                    o[1] = (w >> 8) & 0x7f;
+                    o[2] = w & 0x7f;
+                    o += 1 + status_table[status].size;
+                    return;
+                }
+
+            case data64:
+                {
+                    const unsigned status = (w >> 20) & 0x0f;
+                    const unsigned n = std::min((w >> 16) & 0x0f, 6u);
+                    const std::array<byte, 6> b
+                    {
+                        static_cast<byte>(w >> 8), static_cast<byte>(w),
+                        static_cast<byte>(p.word[1] >> 24), static_cast<byte>(p.word[1] >> 16),
+                        static_cast<byte>(p.word[1] >> 8), static_cast<byte>(p.word[1])
+                    };
+                    if (status > 3) return;
+                    if (status == 0 or status == 1) *o++ = 0xf0;
+                    o = std::copy_n(b.begin(), n, o);
+                    if (status == 0 or status == 3) *o++ = 0xf7;
+                    return;
+                }
+
+            case midi2_channel_voice:
+                translate_midi2(p, [&o](unsigned ch, const auto& msg)
+                {
+                    const auto b = midi::encode(ch, msg);
+                    o = std::copy(b.begin(), b.end(), o);
+                });
+                return;
+
+            default:
+                return;
+            }
+        });
+
+        out.resize(o - out.data());
+        return n;
+    }
+}
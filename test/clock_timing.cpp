@@ -0,0 +1,138 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Measures drift and jitter of clock_generator over several thousand
+// ticks, against a plain sleep_for() loop at the same rate.  The arrival
+// time of each clock byte is taken in the streambuf.  Drift is the error
+// of the last tick relative to the first, jitter is the mean absolute
+// error of all ticks.
+
+#include <cmath>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+#include <ostream>
+#include <streambuf>
+#include <jw/midi/clock_generator.h>
+
+using namespace jw::midi;
+using namespace std::chrono_literals;
+using clock_type = clock_generator::clock;
+
+static constexpr std::size_t num_ticks = 5000;
+static constexpr double bpm = 2500;      // 1 ms per tick.
+static constexpr std::chrono::duration<double, std::nano> interval { 60e9 / (bpm * 24) };
+
+// Records the arrival time of each clock tick.
+struct tick_recorder final : std::streambuf
+{
+    tick_recorder() { times.resize(num_ticks); }
+
+    std::size_t count() const noexcept { return n.load(std::memory_order_acquire); }
+
+    std::vector<clock_type::time_point> times;
+
+protected:
+    virtual int_type overflow(int_type c) override
+    {
+        const auto now = clock_type::now();
+        if (c == 0xf8)
+        {
+            const auto i = n.load(std::memory_order_relaxed);
+            if (i < times.size())
+            {
+                times[i] = now;
+                n.store(i + 1, std::memory_order_release);
+            }
+        }
+        return traits_type::not_eof(c);
+    }
+
+private:
+    std::atomic<std::size_t> n { 0 };
+};
+
+struct result
+{
+    double drift_us;
+    double jitter_us;
+    double max_error_us;
+};
+
+static result measure(const std::vector<clock_type::time_point>& times)
+{
+    result r { 0, 0, 0 };
+    for (std::size_t i = 0; i < times.size(); ++i)
+    {
+        const std::chrono::duration<double, std::micro> error = (times[i] - times[0]) - interval * i;
+        r.jitter_us += std::abs(error.count());
+        r.max_error_us = std::max(r.max_error_us, std::abs(error.count()));
+        if (i == times.size() - 1) r.drift_us = error.count();
+    }
+    r.jitter_us /= times.size();
+    return r;
+}
+
+static void print(const char* name, const result& r)
+{
+    std::printf("%-16s drift %10.1f us, mean error %8.1f us, max error %8.1f us\n",
+                name, r.drift_us, r.jitter_us, r.max_error_us);
+}
+
+static unsigned failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    if (ok) return;
+    std::printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+int main()
+{
+    std::printf("%zu ticks at %.0f BPM\n", num_ticks, bpm);
+
+    tick_recorder gen_buf;
+    clock_statistics stats;
+    {
+        std::ostream out { &gen_buf };
+        clock_generator gen { out, bpm };
+        gen.start();
+        while (gen_buf.count() < num_ticks) std::this_thread::sleep_for(10ms);
+        gen.stop();
+        stats = gen.statistics();
+    }
+    const auto gen = measure(gen_buf.times);
+
+    tick_recorder sleep_buf;
+    {
+        std::ostream out { &sleep_buf };
+        for (std::size_t i = 0; i < num_ticks; ++i)
+        {
+            emit(out, untimed_message { realtime::clock_tick });
+            std::this_thread::sleep_for(std::chrono::duration_cast<clock_type::duration>(interval));
+        }
+    }
+    const auto sleep = measure(sleep_buf.times);
+
+    print("clock_generator", gen);
+    print("sleep_for", sleep);
+    std::printf("statistics(): %llu events, mean lateness %lld ns, max lateness %lld ns\n",
+                static_cast<unsigned long long>(stats.events),
+                static_cast<long long>(stats.mean_lateness.count()),
+                static_cast<long long>(stats.max_lateness.count()));
+
+    // Deadlines are absolute, so the error of the last tick must not have
+    // grown with the number of ticks.  The bounds leave room for a loaded
+    // machine.
+    check(std::abs(gen.drift_us) < 1000, "drift exceeds 1 ms");
+    check(gen.jitter_us < 250, "mean error exceeds 250 us");
+    check(std::abs(gen.drift_us) < std::abs(sleep.drift_us), "drift not lower than sleep_for() loop");
+    check(gen.jitter_us < sleep.jitter_us, "jitter not lower than sleep_for() loop");
+    check(stats.events >= num_ticks, "statistics() missed events");
+    check(stats.mean_lateness < 250us, "statistics() mean lateness exceeds 250 us");
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
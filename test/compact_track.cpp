@@ -0,0 +1,158 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks that compact_track decodes to the original track, and that seek()
+// and lower_bound() find the right event across block boundaries.
+
+#include <jw/midi/compact.h>
+#include "util.h"
+
+using namespace test;
+using namespace std::chrono_literals;
+
+// Deterministic pseudo-random numbers.
+struct lcg
+{
+    std::uint32_t operator()(std::uint32_t n) { state = state * 1664525 + 1013904223; return (state >> 8) % n; }
+    std::uint32_t state { 12345 };
+};
+
+static untimed_message random_message(lcg& rng)
+{
+    const unsigned ch = rng(16);
+    switch (rng(12))
+    {
+    case 0:
+    case 1:
+    case 2: return { ch, note_event { rng(128), rng(127) + 1, true } };
+    case 3: return { ch, note_event { rng(128), rng(128), false } };
+    case 4: return { ch, control_change { rng(128), rng(128) } };
+    case 5: return { ch, pitch_change { { rng(128), rng(128) } } };
+    case 6: return { ch, program_change { rng(128) } };
+    case 7:
+        {
+            std::vector<byte> data { 0xf0 };
+            const std::size_t n = rng(4) == 0 ? 200 : rng(10);
+            for (std::size_t i = 0; i < n; ++i) data.push_back(rng(128));
+            data.push_back(0xf7);
+            return { sysex { std::move(data) } };
+        }
+    case 8: return { meta::tempo_change { std::chrono::microseconds { 300000 + rng(400000) } } };
+    case 9: return { ch, meta::text { meta::text::lyric, std::string(rng(20), 'x') } };
+    case 10: return { realtime::clock_tick };
+    default: return { song_position { { rng(128), rng(128) } } };
+    }
+}
+
+static file::track make_track()
+{
+    lcg rng;
+    file::track trk;
+    std::uint64_t tick = 0;
+    for (unsigned i = 0; i < 60; ++i)
+    {
+        tick += rng(3) == 0 ? 0 : rng(4) == 0 ? 100000 : rng(200);
+        auto& v = trk[tick];
+        // Some ticks hold more events than one block.
+        const unsigned n = i == 20 ? 150 : 1 + rng(8);
+        for (unsigned j = 0; j < n; ++j) v.push_back(random_message(rng));
+    }
+    trk[tick + 50] = { };
+    return trk;
+}
+
+struct flat_event
+{
+    std::uint64_t tick;
+    std::string msg;
+};
+
+int main()
+{
+    const auto trk = make_track();
+    const compact_track c { trk };
+
+    std::vector<flat_event> events;
+    for (const auto& [tick, msgs] : trk)
+        for (const auto& msg : msgs) events.push_back({ tick, describe(msg) });
+    check(events.size() > 4 * compact_track::block_size, "track too short to test block boundaries");
+    check(c.size() == events.size(), "wrong size()");
+    check(c.end_tick() == trk.rbegin()->first, "wrong end_tick()");
+
+    compare("decode", describe(trk), describe(c.decode()));
+
+    // Iteration.
+    {
+        std::size_t i = 0;
+        bool ok = true;
+        for (auto it = c.begin(); it != c.end(); ++it, ++i)
+        {
+            ok &= i < events.size() and it.index() == i and it->tick == events[i].tick and describe(it->message) == events[i].msg;
+        }
+        check(ok and i == events.size(), "iteration");
+    }
+
+    // seek() to every event, in particular around block boundaries.
+    {
+        bool ok = true;
+        for (std::size_t i = 0; i < events.size(); ++i)
+        {
+            const auto it = c.seek(i);
+            ok &= it != c.end() and it.index() == i and it->tick == events[i].tick and describe(it->message) == events[i].msg;
+        }
+        check(ok, "seek");
+        check(c.seek(events.size()) == c.end(), "seek past end");
+    }
+
+    // lower_bound() for every tick up to past the end, including ticks
+    // that are not in the track.
+    {
+        std::vector<std::uint64_t> ticks;
+        for (const auto& e : events) for (std::uint64_t d : { 0, 1 }) ticks.push_back(e.tick + d);
+        ticks.push_back(0);
+        ticks.push_back(events.back().tick + 1000000);
+        bool ok = true;
+        for (const auto t : ticks)
+        {
+            std::size_t expected = 0;
+            while (expected < events.size() and events[expected].tick < t) ++expected;
+            const auto it = c.lower_bound(t);
+            if (expected == events.size()) ok &= it == c.end();
+            else ok &= it != c.end() and it.index() == expected;
+            if (not ok)
+            {
+                std::printf("  lower_bound(%llu): expected index %zu\n", static_cast<unsigned long long>(t), expected);
+                break;
+            }
+        }
+        check(ok, "lower_bound");
+    }
+
+    // Edge cases: no events, and only an end-of-track tick.
+    {
+        const compact_track empty { file::track { } };
+        check(empty.empty() and empty.begin() == empty.end() and not empty.end_tick(), "empty track");
+        check(empty.lower_bound(0) == empty.end(), "lower_bound on empty track");
+        file::track only_end;
+        only_end[480] = { };
+        const compact_track e { only_end };
+        check(e.empty() and e.end_tick() == 480u, "track with only an end tick");
+        compare("decode, only end tick", describe(only_end), describe(e.decode()));
+    }
+
+    // Whole file.
+    {
+        file f { };
+        f.asynchronous_tracks = false;
+        f.time_division = 480u;
+        f.tracks = { trk, { }, trk };
+        const compact_file cf { f };
+        const auto d = cf.decode();
+        check(d.tracks.size() == 3 and std::get<unsigned>(d.time_division) == 480, "compact_file header");
+        for (std::size_t i = 0; i < 3 and i < d.tracks.size(); ++i)
+            compare("compact_file track " + std::to_string(i), describe(f.tracks[i]), describe(d.tracks[i]));
+        check(cf.memory_usage() > 0, "memory_usage");
+    }
+
+    return result();
+}
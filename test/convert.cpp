@@ -0,0 +1,134 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks the ordering of messages at equal ticks, and the end-of-track
+// ticks, produced by merge_tracks() and split_channels().
+
+#include <stdexcept>
+#include <jw/midi/convert.h>
+#include "util.h"
+
+using namespace test;
+using namespace std::chrono_literals;
+
+static untimed_message note(unsigned ch, unsigned n, bool on) { return { ch, note_event { n, on ? 100u : 0x40u, on } }; }
+static untimed_message cc(unsigned ch, unsigned c, unsigned v) { return { ch, control_change { c, v } }; }
+static untimed_message marker(const char* s) { return { meta::text { meta::text::marker, s } }; }
+static untimed_message marker(unsigned ch, const char* s) { return { ch, meta::text { meta::text::marker, s } }; }
+static untimed_message tempo(std::chrono::microseconds t) { return { meta::tempo_change { t } }; }
+static untimed_message tempo(unsigned ch, std::chrono::microseconds t) { return { ch, meta::tempo_change { t } }; }
+
+static std::vector<std::string> describe(const file& f)
+{
+    std::vector<std::string> out;
+    for (std::size_t i = 0; i < f.tracks.size(); ++i)
+        for (auto& s : test::describe(f.tracks[i])) out.push_back(std::to_string(i) + "/" + s);
+    return out;
+}
+
+static file multi_track()
+{
+    file f { };
+    f.asynchronous_tracks = false;
+    f.time_division = 96u;
+    f.tracks.resize(4);
+    f.tracks[0][0] = { tempo(500000us), marker("start") };
+    f.tracks[0][96] = { marker("a") };
+    f.tracks[0][384] = { };
+    f.tracks[1][0] = { note(0, 60, true), note(0, 64, true) };
+    f.tracks[1][96] = { note(0, 60, false) };
+    f.tracks[1][192] = { };
+    f.tracks[2][0] = { untimed_message { 1u, program_change { 5 } } };
+    f.tracks[2][96] = { cc(1, 7, 100), cc(1, 10, 64) };
+    f.tracks[2][200] = { note(1, 62, true) };
+    f.tracks[2][480] = { };
+    // tracks[3] is left empty, without even an end-of-track tick.
+    return f;
+}
+
+static file single_track()
+{
+    file f { };
+    f.asynchronous_tracks = false;
+    f.time_division = 96u;
+    f.tracks.resize(1);
+    f.tracks[0][0] =
+    {
+        tempo(500000us),
+        marker(2, "piano"),
+        tempo(1, 400000us),
+        note(2, 60, true),
+        note(0, 48, true),
+        untimed_message { sysex { { 0xf0, 0x7e, 0x7f, 0x09, 0x01, 0xf7 } } },
+    };
+    f.tracks[0][96] = { note(2, 60, false), cc(0, 64, 127), marker(0, "x"), note(0, 48, false) };
+    f.tracks[0][384] = { };
+    return f;
+}
+
+int main()
+{
+    const std::vector<std::string> merged
+    {
+        "0/0: meta #3 500000",
+        "0/0: meta #2 start",
+        "0/0: 90 3c 64",
+        "0/0: 90 40 64",
+        "0/0: c1 05",
+        "0/96: meta #2 a",
+        "0/96: 80 3c 40",
+        "0/96: b1 07 64",
+        "0/96: b1 0a 40",
+        "0/200: 91 3e 64",
+        "0/480: -",
+    };
+    compare("merge_tracks", merged, describe(merge_tracks(multi_track())));
+    {
+        const auto f = multi_track();
+        const auto m = merge_tracks(f);
+        compare("merge_tracks, copy", merged, describe(m));
+        check(f.tracks[1].at(0).size() == 2, "merge_tracks modified a const source");
+        check(not m.asynchronous_tracks, "merge_tracks: format not 0");
+    }
+    {
+        auto f = multi_track();
+        f.asynchronous_tracks = true;
+        bool thrown = false;
+        try { merge_tracks(f); }
+        catch (const std::invalid_argument&) { thrown = true; }
+        check(thrown, "merge_tracks accepted asynchronous tracks");
+    }
+
+    const std::vector<std::string> split
+    {
+        "0/0: meta #3 500000",
+        "0/0: meta ch1 #3 400000",
+        "0/0: sysex f0 7e 7f 09 01 f7",
+        "0/384: -",
+        "1/0: 90 30 64",
+        "1/96: b0 40 7f",
+        "1/96: meta ch0 #2 x",
+        "1/96: 80 30 40",
+        "1/384: -",
+        "2/0: meta ch2 #2 piano",
+        "2/0: 92 3c 64",
+        "2/96: 82 3c 40",
+        "2/384: -",
+    };
+    compare("split_channels", split, describe(split_channels(single_track())));
+    {
+        const auto f = single_track();
+        compare("split_channels, copy", split, describe(split_channels(f)));
+    }
+
+    // A file with several tracks is merged first.
+    compare("split_channels, multiple tracks", describe(split_channels(merge_tracks(multi_track()))), describe(split_channels(multi_track())));
+    {
+        const auto f = split_channels(multi_track());
+        check(f.tracks.size() == 3, "split_channels: expected conductor and two channel tracks");
+        for (const auto& t : f.tracks)
+            check(not t.empty() and t.rbegin()->first == 480 and t.rbegin()->second.empty(), "split_channels: track does not end at 480");
+    }
+
+    return result();
+}
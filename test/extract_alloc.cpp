@@ -0,0 +1,162 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks that the non-throwing extract() and try_extract() overloads do not
+// allocate memory for messages other than sysex, once the stream has been
+// used for the first time.
+
+#include <new>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <istream>
+#include <streambuf>
+#include <jw/midi/message.h>
+
+static std::atomic<std::size_t> allocations { 0 };
+
+void* operator new(std::size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(n > 0 ? n : 1)) return p;
+    throw std::bad_alloc { };
+}
+
+void* operator new[](std::size_t n) { return operator new(n); }
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+
+using namespace jw::midi;
+using jw::byte;
+
+// Input buffer over a fixed array, of which only the first 'limit' bytes
+// are made available.  Past the limit, in_avail() returns 0, so that
+// try_extract() sees a message that has not been fully received yet.
+struct feed_streambuf final : std::streambuf
+{
+    feed_streambuf(const byte* data, std::size_t size)
+        : begin { reinterpret_cast<char*>(const_cast<byte*>(data)) }, end { begin + size } { rewind(); }
+
+    void rewind() { limit = begin; setg(begin, begin, begin); }
+    void feed(std::size_t n) { limit = std::min(limit + n, end); setg(begin, gptr(), limit); }
+    void feed_all() { feed(end - limit); }
+    bool done() const noexcept { return gptr() == end; }
+
+protected:
+    virtual int_type underflow() override
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        return traits_type::eof();
+    }
+
+    virtual std::streamsize showmanyc() override { return gptr() == end ? -1 : 0; }
+
+private:
+    char* const begin;
+    char* const end;
+    char* limit;
+};
+
+static constexpr byte input[]
+{
+    0x90, 0x3c, 0x64,           // Note on
+    0x3e, 0x64,                 // Running status
+    0xb0, 0x07, 0x7f,           // Control change
+    0xc0, 0x05,                 // Program change
+    0xe0, 0x00, 0x40,           // Pitch bend
+    0xf1, 0x12,                 // MTC quarter frame
+    0xf2, 0x00, 0x10,           // Song position
+    0xf3, 0x05,                 // Song select
+    0xf6,                       // Tune request
+    0xf8,                       // Clock
+    0x90, 0xfa, 0x3c, 0x64,     // Note on, interrupted by start
+    0xf4,                       // Invalid status
+    0x90, 0x3c, 0xb0, 0x07, 0x7f,   // Note on, interrupted by control change
+    0x80, 0x3c, 0x40,           // Note off
+};
+
+static unsigned failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    if (ok) return;
+    std::printf("FAIL: %s\n", what);
+    ++failures;
+}
+
+// Read everything with try_extract(), feeding one byte at a time, so that
+// every message is split.
+static std::size_t split_pass(feed_streambuf& buf, std::istream& in)
+{
+    std::size_t n = 0;
+    message msg;
+    buf.rewind();
+    while (not buf.done())
+    {
+        buf.feed(1);
+        while (true)
+        {
+            const auto status = try_extract(in, msg);
+            if (status == extract_status::would_block) break;
+            if (status == extract_status::end_of_file)
+            {
+                check(buf.done(), "try_extract: unexpected end of file");
+                break;
+            }
+            check(status != extract_status::stream_error, "try_extract: stream error");
+            if (status == extract_status::ok) ++n;
+            if (status == extract_status::stream_error) return n;
+        }
+    }
+    return n;
+}
+
+// Read everything at once with extract().
+static std::size_t whole_pass(feed_streambuf& buf, std::istream& in)
+{
+    std::size_t n = 0;
+    std::size_t errors = 0;
+    message msg;
+    buf.rewind();
+    buf.feed_all();
+    while (true)
+    {
+        const auto status = extract(in, msg);
+        if (status == extract_status::end_of_file) break;
+        if (status == extract_status::ok) ++n;
+        else if (status == extract_status::invalid_status or status == extract_status::unexpected_status) ++errors;
+        else
+        {
+            check(false, "extract: stream error");
+            break;
+        }
+    }
+    check(errors == 2, "extract: expected one invalid and one unexpected status");
+    return n;
+}
+
+int main()
+{
+    feed_streambuf buf { input, sizeof(input) };
+    std::istream in { &buf };
+
+    // The first use of a stream allocates its state.
+    const auto split_n = split_pass(buf, in);
+    const auto whole_n = whole_pass(buf, in);
+    check(split_n == whole_n, "split and whole input give different results");
+    check(whole_n == 14, "unexpected number of messages");
+
+    allocations = 0;
+    for (unsigned i = 0; i < 100; ++i)
+    {
+        split_pass(buf, in);
+        whole_pass(buf, in);
+    }
+    const std::size_t n = allocations;
+    check(n == 0, "memory was allocated");
+    std::printf("%zu allocations\n", n);
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks that fanout_router produces the same bytes as emit(), including
+// running status across sysex data that contains status bytes, and when
+// both are used on the same stream.
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <jw/midi/message.h>
+#include <jw/midi/fanout.h>
+
+using namespace jw::midi;
+using jw::byte;
+
+static unsigned failures = 0;
+
+static void print(const char* name, const std::string& s)
+{
+    std::printf("  %-8s", name);
+    for (unsigned char c : s) std::printf(" %02x", c);
+    std::printf("\n");
+}
+
+static void compare(const char* what, const std::string& expected, const std::string& actual)
+{
+    if (expected == actual) return;
+    std::printf("FAIL: %s\n", what);
+    print("emit", expected);
+    print(what, actual);
+    ++failures;
+}
+
+static untimed_message note_on(unsigned note) { return { 0u, note_event { note, 100, true } }; }
+static untimed_message note_off(unsigned note) { return { 0u, note_event { note, 0x40, false } }; }
+static untimed_message data(std::vector<byte> bytes) { return sysex { std::move(bytes) }; }
+
+int main()
+{
+    const std::vector<untimed_message> messages
+    {
+        // Sysex fragment ending on a note off, so that running status on
+        // the wire is 0x80.
+        note_on(60),
+        data({ 0x90, 0x3c, 0x64, 0x80, 0x3c, 0x00 }),
+        note_on(61),
+        // Fragment starting with a data byte.
+        data({ 0x3c, 0x64 }),
+        note_on(62),
+        note_on(63),
+        note_off(63),
+        { 0u, control_change { 7, 100 } },
+        { 0u, control_change { 10, 64 } },
+        // Complete sysex, with realtime in between.
+        data({ 0xf0, 0x7e, 0x7f, 0x06, 0x01, 0xf7 }),
+        note_on(64),
+        realtime::clock_tick,
+        note_on(65),
+        { song_position { { 0x00, 0x10 } } },
+        note_on(66),
+        // Sysex split over two blocks, with a status byte inside the data.
+        data({ 0xf0, 0x7d, 0x01 }),
+        data({ 0x02, 0xf7, 0x90, 0x40, 0x40 }),
+        note_on(67),
+        // Single realtime byte as raw data.
+        data({ 0xf8 }),
+        note_on(68),
+        { 1u, program_change { 5 } },
+        { 1u, program_change { 6 } },
+        { tune_request { } },
+        note_off(68),
+    };
+
+    std::ostringstream by_emit, by_router, by_encoded, mixed;
+    fanout_router router, encoded_router, mixed_router;
+    router.add(by_router);
+    encoded_router.add(by_encoded);
+    mixed_router.add(mixed);
+
+    for (std::size_t i = 0; i < messages.size(); ++i)
+    {
+        const auto& msg = messages[i];
+        emit(by_emit, msg);
+        router.send(msg);
+        encoded_router.send(encode_shared(msg));
+        if (i % 2 == 0) emit(mixed, msg);
+        else mixed_router.send(msg);
+    }
+
+    compare("router", by_emit.str(), by_router.str());
+    compare("encoded", by_emit.str(), by_encoded.str());
+    compare("mixed", by_emit.str(), mixed.str());
+
+    // The rvalue overload of encode_shared() moves sysex data, but must
+    // produce the same block.
+    std::ostringstream moved;
+    fanout_router moved_router;
+    moved_router.add(moved);
+    for (auto msg : messages) moved_router.send(encode_shared(std::move(msg)));
+    compare("moved", by_emit.str(), moved.str());
+
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
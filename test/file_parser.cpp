@@ -0,0 +1,132 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks that file_parser gives the same messages as file::read(), with
+// window sizes down to a single byte, and from a stream that can not seek
+// and returns one byte at a time.
+
+#include <sstream>
+#include <streambuf>
+#include "util.h"
+
+using namespace test;
+
+// Non-seekable input that makes one byte available per underflow().
+struct trickle_streambuf final : std::streambuf
+{
+    explicit trickle_streambuf(const std::string& s) : data { s } { }
+
+protected:
+    virtual int_type underflow() override
+    {
+        if (gptr() < egptr()) return traits_type::to_int_type(*gptr());
+        if (pos == data.size()) return traits_type::eof();
+        char* const p = &data[pos++];
+        setg(p, p, p + 1);
+        return traits_type::to_int_type(*p);
+    }
+
+private:
+    std::string data;
+    std::size_t pos { 0 };
+};
+
+static std::vector<byte> text(std::size_t n)
+{
+    std::vector<byte> v;
+    for (std::size_t i = 0; i < n; ++i) v.push_back('a' + i % 26);
+    return v;
+}
+
+static std::vector<byte> sysex_body(std::size_t n)
+{
+    std::vector<byte> v;
+    for (std::size_t i = 0; i < n; ++i) v.push_back(i & 0x7f);
+    v.push_back(0xf7);
+    return v;
+}
+
+static std::vector<std::string> expected_from(const file& f)
+{
+    std::vector<std::string> out;
+    for (std::size_t i = 0; i < f.tracks.size(); ++i)
+        for (const auto& [tick, msgs] : f.tracks[i])
+            for (const auto& msg : msgs)
+                out.push_back(std::to_string(i) + "/" + std::to_string(tick) + ": " + describe(msg));
+    return out;
+}
+
+static std::vector<std::string> parse(std::istream& in, file_parser& p)
+{
+    std::vector<std::string> out;
+    p.parse(in, [&out](std::size_t track, std::uint64_t tick, untimed_message&& msg)
+    {
+        out.push_back(std::to_string(track) + "/" + std::to_string(tick) + ": " + describe(msg));
+    });
+    return out;
+}
+
+int main()
+{
+    const auto data = smf { 1, 480 }
+        .track()
+        .event(0, { 0xff, 0x03 }, text(40))
+        .event(0, { 0xff, 0x51 }, { 0x07, 0xa1, 0x20 })
+        .event(0, { 0xff, 0x58 }, { 0x04, 0x02, 0x18, 0x08 })
+        .end(1920)
+        .chunk("XYZW", text(100))
+        .track()
+        .event(0, { 0xff, 0x20 }, { 0x03 })
+        .event(0, { 0xff, 0x04 }, text(10))
+        .event(0, { 0xc3, 0x05 })
+        .event(0, { 0x93, 0x3c, 0x64 })
+        .event(96, { 0x3c, 0x00 })
+        .event(20000, { 0xb3, 0x07, 0x7f })
+        .event(0, { 0x0a, 0x40 })
+        .event(1, { 0xf0 }, sysex_body(300))
+        .event(2, { 0xf0 }, { 0x7e, 0x01 })
+        .event(3, { 0xf7 }, { 0x02, 0xf7 })
+        .event(0, { 0xf7 }, { 0xf8, 0xe3, 0x00, 0x40 })
+        .event(0x0fffffff, { 0xa3, 0x3c, 0x10 })
+        .end()
+        .str();
+
+    std::istringstream whole { data };
+    const auto f = file::read(whole);
+    check(not whole.fail(), "file::read failed");
+    const auto expected = expected_from(f);
+    check(expected.size() == 15, "file::read: unexpected number of messages");
+
+    for (std::size_t window : { 1, 2, 3, 5, 16, 4096 })
+    {
+        const auto name = "window " + std::to_string(window);
+        {
+            file_parser p { window };
+            std::istringstream in { data };
+            compare(name, expected, parse(in, p));
+            check(not in.fail(), name + ": parse failed");
+            check(p.num_tracks == 2, name + ": wrong num_tracks");
+            check(not p.asynchronous_tracks, name + ": wrong format");
+            check(std::get<unsigned>(p.time_division) == 480, name + ": wrong time_division");
+        }
+        {
+            file_parser p { window };
+            trickle_streambuf buf { data };
+            std::istream in { &buf };
+            compare(name + ", non-seekable", expected, parse(in, p));
+            check(not in.fail(), name + ", non-seekable: parse failed");
+        }
+    }
+
+    // Truncated input is reported via the stream state.  Messages before
+    // the cut are still delivered.
+    {
+        file_parser p { 3 };
+        std::istringstream in { data.substr(0, data.size() - 10) };
+        const auto got = parse(in, p);
+        check(in.eof() or in.fail(), "truncated: error not reported");
+        check(got.size() == expected.size() - 1, "truncated: wrong number of messages");
+    }
+
+    return result();
+}
@@ -0,0 +1,102 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks file::read() with and without read_options::reassemble_sysex, on
+// sysex split into an 0xf0 packet and 0xf7 continuations, followed by 0xf7
+// escape sequences.  The reported sysex_layouts are checked too.
+
+#include <sstream>
+#include "util.h"
+
+using namespace test;
+
+static file read(const std::string& data, bool reassemble)
+{
+    std::istringstream in { data };
+    auto f = file::read(in, { reassemble });
+    check(not in.fail(), "read failed");
+    return f;
+}
+
+static std::string describe(const file::sysex_layout& l)
+{
+    std::string s = std::to_string(l.tick) + "/" + std::to_string(l.index) + ":";
+    for (const auto& p : l.packets) s += " " + std::to_string(p.offset) + "+" + std::to_string(p.delay);
+    return s;
+}
+
+int main()
+{
+    const auto data = smf { 0 }
+        .track()
+        // Complete sysex, not joined with anything.
+        .event(0, { 0xf0 }, { 0x7e, 0x00, 0xf7 })
+        // Split over three packets, then an escaped note on.
+        .event(0, { 0xf0 }, { 0x7e, 0x01, 0x02 })
+        .event(10, { 0xf7 }, { 0x03, 0x04 })
+        .event(5, { 0xf7 }, { 0x05, 0xf7 })
+        .event(0, { 0xf7 }, { 0x90, 0x3c, 0x64 })
+        // Terminated in a continuation that carries an escape sequence
+        // after the 0xf7.
+        .event(0, { 0xf0 }, { 0x41, 0x10 })
+        .event(1, { 0xf7 }, { 0x11, 0xf7, 0x90, 0x3d, 0x64 })
+        // Running status within an escape, and a lone 0xf7.
+        .event(2, { 0xf7 }, { 0x80, 0x3c, 0x40, 0x3d, 0x40 })
+        .event(0, { 0xf7 }, { 0xf7 })
+        // Interrupted by a channel message: not joined, and the following
+        // 0xf7 event is an escape.
+        .event(0, { 0xf0 }, { 0x43, 0x20 })
+        .event(1, { 0x90, 0x3e, 0x64 })
+        .event(1, { 0xf7 }, { 0xf8 })
+        .end()
+        .str();
+
+    const auto joined = read(data, true);
+    compare("reassembled",
+    {
+        "0: sysex f0 7e 00 f7",
+        "0: sysex f0 7e 01 02 03 04 05 f7",
+        "10: -",
+        "15: 90 3c 64",
+        "15: sysex f0 41 10 11 f7",
+        "16: 90 3d 64",
+        "18: 80 3c 40",
+        "18: 80 3d 40",
+        "18: sysex f7",
+        "18: sysex f0 43 20",
+        "19: 90 3e 64",
+        "20: f8",
+    }, describe(joined.tracks.at(0)));
+
+    std::vector<std::string> layouts;
+    check(joined.sysex_layouts.size() == 1, "expected sysex_layouts for one track");
+    if (joined.sysex_layouts.size() == 1)
+        for (const auto& l : joined.sysex_layouts[0]) layouts.push_back(describe(l));
+    compare("sysex_layouts",
+    {
+        "0/1: 0+0 4+10 6+15",
+        "15/1: 0+0 3+1",
+    }, layouts);
+
+    const auto split = read(data, false);
+    compare("not reassembled",
+    {
+        "0: sysex f0 7e 00 f7",
+        "0: sysex f0 7e 01 02",
+        "10: sysex 03 04",
+        "15: sysex 05 f7",
+        "15: 90 3c 64",
+        "15: sysex f0 41 10",
+        "16: sysex 11 f7",
+        "16: 90 3d 64",
+        "18: 80 3c 40",
+        "18: 80 3d 40",
+        "18: sysex f7",
+        "18: sysex f0 43 20",
+        "19: 90 3e 64",
+        "20: f8",
+    }, describe(split.tracks.at(0)));
+    check(split.sysex_layouts.empty(), "sysex_layouts filled in without reassemble_sysex");
+
+    return result();
+}
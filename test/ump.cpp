@@ -0,0 +1,160 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Checks UMP value scaling, and round trips from MIDI 1.0 messages to UMP
+// and back, with both protocols.
+
+#include <jw/midi/ump.h>
+#include "util.h"
+
+using namespace test;
+
+static std::vector<byte> sysex_data(std::size_t n)
+{
+    std::vector<byte> v { 0xf0 };
+    for (std::size_t i = 0; i < n; ++i) v.push_back((i * 7) & 0x7f);
+    v.push_back(0xf7);
+    return v;
+}
+
+static std::vector<untimed_message> channel_messages()
+{
+    std::vector<untimed_message> v;
+    for (unsigned ch : { 0u, 9u, 15u })
+    {
+        for (unsigned x : { 0u, 1u, 0x3fu, 0x40u, 0x41u, 0x7fu })
+        {
+            v.push_back({ ch, note_event { x, std::max(x, 1u), true } });
+            v.push_back({ ch, note_event { x, x, false } });
+            v.push_back({ ch, key_pressure { x, x } });
+            v.push_back({ ch, control_change { x, x } });
+            v.push_back({ ch, program_change { x } });
+            v.push_back({ ch, channel_pressure { x } });
+            v.push_back({ ch, pitch_change { { x, x } } });
+        }
+        v.push_back({ ch, pitch_change { 0x2000 } });
+        v.push_back({ ch, pitch_change { 0x3fff } });
+    }
+    return v;
+}
+
+static std::vector<untimed_message> other_messages()
+{
+    std::vector<untimed_message> v;
+    v.push_back({ mtc_quarter_frame { 0x35 } });
+    v.push_back({ song_position { { 0x12, 0x34 } } });
+    v.push_back({ song_select { 5 } });
+    v.push_back({ tune_request { } });
+    for (auto rt : { realtime::clock_tick, realtime::clock_start, realtime::clock_continue, realtime::clock_stop })
+        v.push_back({ rt });
+    for (std::size_t n : { 0, 1, 5, 6, 7, 12, 13, 100 }) v.push_back({ sysex { sysex_data(n) } });
+    return v;
+}
+
+static std::vector<std::string> describe(const std::vector<untimed_message>& msgs)
+{
+    std::vector<std::string> out;
+    for (const auto& m : msgs) out.push_back(test::describe(m));
+    return out;
+}
+
+static void append_bytes(std::vector<byte>& out, const untimed_message& msg)
+{
+    auto put = [&out](std::span<const byte> b) { out.insert(out.end(), b.begin(), b.end()); };
+    if (auto* t = std::get_if<channel_message>(&msg.category)) return put(encode(*t).span());
+    if (auto* t = std::get_if<realtime>(&msg.category)) return put(encode(*t).span());
+    if (auto* t = std::get_if<system_message>(&msg.category))
+    {
+        std::visit([&put](const auto& m)
+        {
+            if constexpr (std::is_same_v<std::remove_cvref_t<decltype(m)>, sysex>) put(m.data);
+            else put(encode(m).span());
+        }, t->message);
+    }
+}
+
+static void round_trip(const char* name, const std::vector<untimed_message>& msgs, ump::protocol p)
+{
+    std::vector<std::uint32_t> words;
+    ump::encode(msgs, words, 3, p);
+    bool groups_ok = true;
+    ump::for_each_packet(words, [&groups_ok](const ump::packet& pk) { groups_ok &= pk.group() == 3; });
+    check(groups_ok, std::string { name } + ": wrong group");
+
+    std::vector<untimed_message> decoded;
+    ump::decoder d;
+    check(d.decode(words, decoded) == words.size(), std::string { name } + ": not all words consumed");
+    compare(name, describe(msgs), describe(decoded));
+
+    // The byte decoder must give the same bytes, without running status.
+    std::vector<byte> expected;
+    for (const auto& m : msgs) append_bytes(expected, m);
+    std::vector<byte> bytes;
+    ump::decoder bd;
+    check(bd.decode(words, bytes) == words.size(), std::string { name } + ": byte decoder did not consume all words");
+    check(bytes == expected, std::string { name } + ": byte decoder output differs");
+}
+
+int main()
+{
+    // Minimum, center and maximum are preserved, and scaling down undoes
+    // scaling up.
+    for (auto [src, dst] : { std::pair { 7u, 16u }, { 7u, 32u }, { 14u, 32u }, { 16u, 32u } })
+    {
+        const std::uint32_t max_src = (1ull << src) - 1;
+        const std::uint32_t max_dst = (1ull << dst) - 1;
+        const auto name = "scale_up(" + std::to_string(src) + ", " + std::to_string(dst) + ")";
+        check(ump::scale_up(0, src, dst) == 0, name + ": minimum");
+        check(ump::scale_up(1u << (src - 1), src, dst) == 1u << (dst - 1), name + ": center");
+        check(ump::scale_up(max_src, src, dst) == max_dst, name + ": maximum");
+        if (src > 14) continue;
+        bool ok = true;
+        std::uint32_t prev = 0;
+        for (std::uint32_t v = 0; v <= max_src; ++v)
+        {
+            const auto up = ump::scale_up(v, src, dst);
+            ok &= ump::scale_down(up, dst, src) == v;
+            ok &= v == 0 or up > prev;
+            prev = up;
+        }
+        check(ok, name + ": not monotonic, or scale_down() does not invert it");
+    }
+    check(ump::scale_up(0x41, 7, 16) == 0x8208, "scale_up(0x41, 7, 16)");
+
+    auto all = channel_messages();
+    const auto other = other_messages();
+    all.insert(all.end(), other.begin(), other.end());
+    round_trip("midi1 protocol", all, ump::protocol::midi1);
+    round_trip("midi2 protocol", all, ump::protocol::midi2);
+
+    // Sysex packets from different groups may be interleaved.
+    {
+        std::vector<std::uint32_t> a, b, words;
+        ump::encode(untimed_message { sysex { sysex_data(20) } }, a, 1);
+        ump::encode(untimed_message { sysex { sysex_data(30) } }, b, 2);
+        for (std::size_t i = 0; i < std::max(a.size(), b.size()); i += 2)
+        {
+            if (i < a.size()) words.insert(words.end(), a.begin() + i, a.begin() + i + 2);
+            if (i < b.size()) words.insert(words.end(), b.begin() + i, b.begin() + i + 2);
+        }
+        std::vector<untimed_message> decoded;
+        ump::decoder d;
+        d.decode(words, decoded);
+        compare("interleaved groups", { "sysex " + hex(sysex_data(20)), "sysex " + hex(sysex_data(30)) }, describe(decoded));
+    }
+
+    // An incomplete packet at the end is left for the next call.
+    {
+        std::vector<std::uint32_t> words;
+        ump::encode(untimed_message { 0u, note_event { 60, 100, true } }, words);
+        ump::encode(untimed_message { 0u, note_event { 61, 100, true } }, words);
+        std::vector<untimed_message> decoded;
+        ump::decoder d;
+        const auto n = d.decode(std::span { words }.first(3), decoded);
+        check(n == 2 and decoded.size() == 1, "incomplete packet consumed");
+        d.decode(std::span { words }.subspan(n), decoded);
+        compare("split buffer", { "90 3c 64", "90 3d 64" }, describe(decoded));
+    }
+
+    return result();
+}
@@ -0,0 +1,169 @@
+/* * * * * * * * * * * * * * * * * * jwmidi * * * * * * * * * * * * * * * * * */
+/*    Copyright (C) 2022 - 2023 J.W. Jagersma, see COPYING.txt for details    */
+
+// Helpers shared between the test programs.
+
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include <jw/midi/message.h>
+#include <jw/midi/file.h>
+#include <jw/midi/encode.h>
+
+namespace test
+{
+    using namespace jw::midi;
+    using jw::byte;
+
+    inline unsigned failures = 0;
+
+    inline void check(bool ok, const std::string& what)
+    {
+        if (ok) return;
+        std::printf("FAIL: %s\n", what.c_str());
+        ++failures;
+    }
+
+    inline int result() { return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE; }
+
+    inline std::string hex(const auto& bytes)
+    {
+        std::string s;
+        char buf[4];
+        for (byte b : bytes)
+        {
+            std::snprintf(buf, sizeof(buf), "%02x ", b);
+            s += buf;
+        }
+        if (not s.empty()) s.pop_back();
+        return s;
+    }
+
+    // Printable form of a message, for comparison.
+    inline std::string describe(const untimed_message& msg)
+    {
+        if (auto* t = std::get_if<channel_message>(&msg.category)) return hex(encode(*t));
+        if (auto* t = std::get_if<realtime>(&msg.category)) return hex(encode(*t));
+        if (auto* t = std::get_if<system_message>(&msg.category))
+        {
+            if (auto* s = std::get_if<sysex>(&t->message)) return "sysex " + hex(s->data);
+            return std::visit([](const auto& m)
+            {
+                if constexpr (std::is_same_v<std::remove_cvref_t<decltype(m)>, sysex>) return std::string { };
+                else return hex(encode(m));
+            }, t->message);
+        }
+        if (auto* t = std::get_if<meta_message>(&msg.category))
+        {
+            const meta& m = **t;
+            std::string s = "meta";
+            if (m.channel) s += " ch" + std::to_string(static_cast<unsigned>(*m.channel));
+            s += " #" + std::to_string(m.message.index());
+            if (auto* x = std::get_if<meta::tempo_change>(&m.message)) s += " " + std::to_string(x->quarter_note.count());
+            if (auto* x = std::get_if<meta::text>(&m.message)) s += " " + x->text;
+            if (auto* x = std::get_if<meta::unknown>(&m.message)) s += " " + hex(x->data);
+            return s;
+        }
+        return "invalid";
+    }
+
+    // Flattened form of a track: one line per message, and one for each
+    // tick without messages (such as the end of track).
+    inline std::vector<std::string> describe(const file::track& trk)
+    {
+        std::vector<std::string> out;
+        for (const auto& [tick, msgs] : trk)
+        {
+            for (const auto& msg : msgs) out.push_back(std::to_string(tick) + ": " + describe(msg));
+            if (msgs.empty()) out.push_back(std::to_string(tick) + ": -");
+        }
+        return out;
+    }
+
+    inline void compare(const std::string& what, const std::vector<std::string>& expected, const std::vector<std::string>& actual)
+    {
+        if (expected == actual) return;
+        check(false, what);
+        for (std::size_t i = 0; i < std::max(expected.size(), actual.size()); ++i)
+        {
+            const char* e = i < expected.size() ? expected[i].c_str() : "-";
+            const char* a = i < actual.size() ? actual[i].c_str() : "-";
+            const bool same = i < expected.size() and i < actual.size() and expected[i] == actual[i];
+            std::printf("  %c %-40s %s\n", same ? ' ' : '*', e, a);
+        }
+    }
+
+    // Builds a standard MIDI file in memory.
+    struct smf
+    {
+        smf(unsigned format, unsigned division = 96) : format { format }, division { division } { }
+
+        // Start a new track chunk.
+        smf& track() { chunks.push_back({ "MTrk", { } }); ++num_tracks; return *this; }
+
+        // Insert a chunk of another type.
+        smf& chunk(const char* id, std::vector<byte> data) { chunks.push_back({ id, std::move(data) }); return *this; }
+
+        // Append a delta time and raw event bytes to the current track.
+        smf& event(std::uint64_t delta, std::initializer_list<byte> bytes)
+        {
+            vlq(delta);
+            chunks.back().data.insert(chunks.back().data.end(), bytes);
+            return *this;
+        }
+
+        // Append an event with a length prefix (sysex, escape or meta).
+        smf& event(std::uint64_t delta, std::initializer_list<byte> prefix, const std::vector<byte>& data)
+        {
+            event(delta, prefix);
+            vlq(data.size());
+            chunks.back().data.insert(chunks.back().data.end(), data.begin(), data.end());
+            return *this;
+        }
+
+        smf& end(std::uint64_t delta = 0) { return event(delta, { 0xff, 0x2f, 0x00 }); }
+
+        std::string str() const
+        {
+            std::string s;
+            auto put = [&s](const char* id, const std::vector<byte>& body)
+            {
+                s.append(id, 4);
+                const std::uint32_t n = body.size();
+                s += { char(n >> 24), char(n >> 16), char(n >> 8), char(n) };
+                s.append(body.begin(), body.end());
+            };
+            put("MThd", { 0, byte(format), 0, byte(num_tracks), byte(division >> 8), byte(division) });
+            for (const auto& c : chunks) put(c.id, c.data);
+            return s;
+        }
+
+    private:
+        void vlq(std::uint64_t value)
+        {
+            byte buf[10];
+            unsigned n = 0;
+            do
+            {
+                buf[n++] = value & 0x7f;
+                value >>= 7;
+            } while (value != 0);
+            while (n > 1) chunks.back().data.push_back(buf[--n] | 0x80);
+            chunks.back().data.push_back(buf[0]);
+        }
+
+        struct raw_chunk
+        {
+            const char* id;
+            std::vector<byte> data;
+        };
+
+        unsigned format;
+        unsigned division;
+        unsigned num_tracks { 0 };
+        std::vector<raw_chunk> chunks;
+    };
+}